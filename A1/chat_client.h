@@ -0,0 +1,462 @@
+// Event-driven client of the chat server, the engine of client_grp and embeddable in bots and tests.
+//
+// A ChatClient owns one non-blocking connection and runs on one thread. poll_once() waits for the
+// socket and the descriptors added with watch(), reads everything that arrived into one reusable ring
+// buffer, hands every complete message to on_message and then writes the queued lines with as few
+// send calls as possible. Frames are reassembled in the ring buffer whatever their size, up to
+// MAX_FRAME_SZ.
+//
+// send_line() takes what a user would type: the username, the password, then commands. During the
+// login a line is held back until the server asked for it, and commands until the password was
+// accepted, so they may be queued at once. In framed mode the username also negotiates the protocol
+// (and compression), and every line goes out as the matching frame. login() queues both credentials.
+//
+// Callbacks run on the thread calling poll_once(), every method must be called from that thread.
+
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include "compression.h"
+#include "framing.h"
+
+#define CLIENT_READ_SZ 16384 // bytes asked for per recv, one read takes a whole burst of small messages
+
+struct ChatClientOptions
+{
+    std::string host = "127.0.0.1";
+    int port = 12345;
+    bool framed = false;           // binary framed protocol
+    bool compress = false;         // offer compression at login, implies framed
+    const char *ca_file = nullptr; // connect with TLS, trusting the certificates in this file
+    std::string session_file;      // TLS session resumed from and saved to this file, none if empty
+};
+
+class ChatClient
+{
+public:
+    std::function<void(std::string_view)> on_message; // a message of the server, login prompts included
+    std::function<void(bool)> on_login;               // the server's verdict on the password
+    std::function<void()> on_disconnect;              // the connection is gone, poll_once() returns false from then on
+
+    explicit ChatClient(ChatClientOptions options) : opts(std::move(options))
+    {
+        opts.framed = opts.framed || opts.compress;
+    }
+    ChatClient(const ChatClient &) = delete;
+    ChatClient &operator=(const ChatClient &) = delete;
+    ~ChatClient()
+    {
+        close();
+        SSL_CTX_free(ctx);
+    }
+
+    // connects and, with a ca_file, runs the TLS handshake. false with a reason in error on failure.
+    bool connect(std::string &error)
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(opts.port);
+        if (inet_pton(AF_INET, opts.host.c_str(), &addr.sin_addr) != 1)
+        {
+            error = "Invalid server address " + opts.host + ".";
+            return false;
+        }
+        sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0 || ::connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            error = "Error connecting to server.";
+            close();
+            return false;
+        }
+        if (opts.ca_file != nullptr && !start_tls(error))
+        {
+            close();
+            return false;
+        }
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        return true;
+    }
+
+    // queues the credentials of a bot, each is sent once the server asks for it
+    void login(std::string username, std::string password)
+    {
+        send_line(std::move(username));
+        send_line(std::move(password));
+    }
+
+    // queues a line as typed by a user, written by the next poll_once()
+    void send_line(std::string line)
+    {
+        waiting.push_back(std::move(line));
+        release();
+    }
+
+    // has poll_once() call on_readable whenever fd is readable
+    void watch(int fd, std::function<void()> on_readable) { watched.push_back({fd, std::move(on_readable)}); }
+    void unwatch(int fd) { std::erase_if(watched, [fd](const Watch &w) { return w.fd == fd; }); }
+
+    // waits up to timeout_ms (-1 for ever) and handles what happened, false once the connection is gone
+    bool poll_once(int timeout_ms)
+    {
+        if (sock < 0)
+        {
+            return false;
+        }
+        std::vector<pollfd> fds;
+        fds.push_back({sock, (short)(POLLIN | (out.empty() ? 0 : POLLOUT)), 0});
+        for (const Watch &w : watched)
+        {
+            fds.push_back({w.fd, POLLIN, 0});
+        }
+        if (::poll(fds.data(), fds.size(), timeout_ms) < 0)
+        {
+            return errno == EINTR;
+        }
+
+        bool alive = !(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) || read_input();
+        // a callback may watch or unwatch descriptors, the ones polled are looked up again
+        for (size_t i = 1; i < fds.size() && alive && sock >= 0; i++)
+        {
+            auto w = std::find_if(watched.begin(), watched.end(), [&](const Watch &w) { return w.fd == fds[i].fd; });
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && w != watched.end())
+            {
+                std::function<void()> on_readable = w->on_readable;
+                on_readable();
+            }
+        }
+        alive = alive && (sock < 0 || flush());
+        if (!alive)
+        {
+            close();
+            if (on_disconnect)
+            {
+                on_disconnect();
+            }
+        }
+        return sock >= 0;
+    }
+
+    // closes the connection, queued lines that were not written are dropped
+    void close()
+    {
+        if (ssl != nullptr)
+        {
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+        if (sock >= 0)
+        {
+            ::close(sock);
+            sock = -1;
+        }
+    }
+
+    int fd() const { return sock; }
+    bool logged_in() const { return accepted; }
+    bool flushed() const { return waiting.empty() && out.empty(); } // every line sent was written
+    bool tls() const { return ssl != nullptr; }
+    bool tls_resumed() const { return ssl != nullptr && SSL_session_reused(ssl); }
+
+private:
+    enum Phase
+    {
+        TEXT,        // legacy text protocol, every read is one message
+        NEGOTIATING, // framed protocol asked for, text until the server's FRAME_MAGIC
+        FRAMED       // frames only
+    };
+
+    struct Watch
+    {
+        int fd;
+        std::function<void()> on_readable;
+    };
+
+    ChatClientOptions opts;
+    int sock = -1;
+    SSL_CTX *ctx = nullptr;
+    SSL *ssl = nullptr;
+    Phase phase = TEXT;
+    FrameParser parser;              // receive buffer, reused for every read
+    Inflater inflater;               // restores OP_DEFLATE frames
+    std::string scratch;             // a text message that wraps around the ring buffer
+    std::deque<std::string> waiting; // lines held back until the login gets that far
+    std::deque<std::string> out;     // bytes to write, a text mode line per entry since the server reads one per recv
+    size_t out_off = 0;              // bytes of out.front() already written
+    int lines_sent = 0;              // login lines sent, 2 once the password is out
+    int prompts = 0;                 // login prompts received, the username and the password are sent after them
+    bool accepted = false;           // the password was accepted, commands are sent
+    std::vector<Watch> watched;
+
+    bool start_tls(std::string &error)
+    {
+        ctx = SSL_CTX_new(TLS_client_method());
+        if (ctx == nullptr || SSL_CTX_load_verify_locations(ctx, opts.ca_file, nullptr) != 1)
+        {
+            error = std::string("Cannot load the trusted certificates of ") + opts.ca_file + ".";
+            return false;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+        // a write that blocks is retried later with the rest of the buffer, which may have moved
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, sock);
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), opts.host.c_str());
+
+        if (FILE *file = opts.session_file.empty() ? nullptr : fopen(opts.session_file.c_str(), "r"))
+        {
+            SSL_SESSION *session = PEM_read_SSL_SESSION(file, nullptr, nullptr, nullptr);
+            fclose(file);
+            if (session != nullptr)
+            {
+                SSL_set_session(ssl, session);
+                SSL_SESSION_free(session);
+            }
+        }
+        if (SSL_connect(ssl) != 1)
+        {
+            error = std::string("TLS handshake failed: ") + X509_verify_cert_error_string(SSL_get_verify_result(ssl));
+            return false;
+        }
+        return true;
+    }
+
+    // saves the session for the next run, TLS 1.3 tickets only arrive after the handshake
+    void save_tls_session()
+    {
+        SSL_SESSION *session = SSL_get1_session(ssl);
+        if (session == nullptr || !SSL_SESSION_is_resumable(session))
+        {
+            SSL_SESSION_free(session);
+            return;
+        }
+        if (FILE *file = fopen(opts.session_file.c_str(), "w"))
+        {
+            fchmod(fileno(file), 0600); // holds the session secret
+            PEM_write_SSL_SESSION(file, session);
+            fclose(file);
+        }
+        SSL_SESSION_free(session);
+    }
+
+    // recv semantics over TLS too, -1 with EAGAIN while TLS waits for the socket
+    ssize_t net_recv(char *buf, size_t len)
+    {
+        if (ssl == nullptr)
+        {
+            return recv(sock, buf, len, 0);
+        }
+        int n = SSL_read(ssl, buf, len);
+        if (n > 0)
+        {
+            return n;
+        }
+        int err = SSL_get_error(ssl, n);
+        errno = EAGAIN;
+        return (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? -1 : 0;
+    }
+
+    ssize_t net_send(const char *buf, size_t len)
+    {
+        if (ssl == nullptr)
+        {
+            return send(sock, buf, len, MSG_NOSIGNAL);
+        }
+        int n = SSL_write(ssl, buf, len);
+        if (n > 0)
+        {
+            return n;
+        }
+        int err = SSL_get_error(ssl, n);
+        errno = EAGAIN;
+        return (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? -1 : 0;
+    }
+
+    // reads until the socket would block, false once the connection is gone
+    bool read_input()
+    {
+        while (sock >= 0) // a callback may have closed the client
+        {
+            RingBuffer &in = parser.buffer();
+            auto [buf, space] = in.write_space(CLIENT_READ_SZ);
+            ssize_t n = net_recv(buf, space);
+            if (n > 0)
+            {
+                in.commit(n);
+                if (!handle_input())
+                {
+                    return false;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        return true;
+    }
+
+    // hands the complete messages in the ring buffer to deliver, false on a corrupt frame
+    bool handle_input()
+    {
+        RingBuffer &in = parser.buffer();
+        if (phase != FRAMED)
+        {
+            scratch.resize(in.size());
+            in.peek(0, scratch.data(), in.size());
+            if (phase == TEXT)
+            {
+                in.consume(in.size());
+                deliver(scratch);
+                return true;
+            }
+
+            // text before the acknowledgement is skipped, a magic cut by the read stays buffered
+            size_t magic = scratch.find(FRAME_MAGIC);
+            if (magic == std::string::npos)
+            {
+                in.consume(in.size() - std::min(in.size(), (size_t)FRAME_MAGIC_LEN - 1));
+                return true;
+            }
+            in.consume(magic + FRAME_MAGIC_LEN);
+            phase = FRAMED;
+        }
+
+        Frame frame;
+        FrameStatus status;
+        while ((status = parser.next(frame)) == FRAME_OK)
+        {
+            if (frame.opcode == OP_COMPRESS)
+            {
+                if (frame.payload != COMPRESS_METHOD && on_message)
+                {
+                    on_message("Server declined compression."); // not a login prompt
+                }
+                continue;
+            }
+            if (frame.opcode == OP_DEFLATE)
+            {
+                if (!inflater.decompress(frame.payload, scratch))
+                {
+                    return false;
+                }
+                deliver(scratch);
+                continue;
+            }
+            deliver(frame.payload);
+        }
+        return status != FRAME_ERROR;
+    }
+
+    void deliver(std::string_view text)
+    {
+        if (on_message)
+        {
+            on_message(text);
+        }
+        if (lines_sent < 2)
+        {
+            prompts = std::min(prompts + 1, 2); // the server asked for the next credential
+        }
+        else if (!accepted)
+        {
+            accepted = text.find("Authentication failed") == std::string_view::npos;
+            if (accepted && ssl != nullptr && !opts.session_file.empty())
+            {
+                save_tls_session();
+            }
+            if (on_login)
+            {
+                on_login(accepted);
+            }
+        }
+        release();
+    }
+
+    // moves the lines the login allows to the output
+    void release()
+    {
+        while (!waiting.empty() && (accepted || lines_sent < prompts))
+        {
+            queue_line(waiting.front());
+            waiting.pop_front();
+        }
+    }
+
+    void queue_line(std::string_view line)
+    {
+        if (!opts.framed)
+        {
+            out.emplace_back(line);
+            lines_sent += (lines_sent < 2);
+            return;
+        }
+        if (out.empty())
+        {
+            out.emplace_back();
+        }
+        std::string &bytes = out.back();
+        if (lines_sent == 0)
+        {
+            // ask for the framed protocol in place of the username, a compression offer goes first so
+            // that everything after the login can be compressed
+            bytes.append(FRAME_MAGIC);
+            if (opts.compress)
+            {
+                bytes.append(encode_frame(OP_COMPRESS, COMPRESS_METHOD));
+            }
+            phase = NEGOTIATING;
+        }
+        uint8_t opcode = (lines_sent == 0) ? OP_USERNAME : (lines_sent == 1) ? OP_PASSWORD : OP_COMMAND;
+        size_t start = bytes.size();
+        bytes.resize(start + FRAME_HDR_SZ);
+        encode_frame_header((unsigned char *)bytes.data() + start, opcode, line.size());
+        bytes.append(line);
+        lines_sent += (lines_sent < 2);
+    }
+
+    // writes the queued bytes until the socket would block, false once the connection is gone
+    bool flush()
+    {
+        while (!out.empty())
+        {
+            std::string &bytes = out.front();
+            ssize_t n = net_send(bytes.data() + out_off, bytes.size() - out_off);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+            out_off += n;
+            if (out_off == bytes.size())
+            {
+                out.pop_front();
+                out_off = 0;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
@@ -2,105 +2,119 @@
 
 #include <iostream>
 #include <string>
-#include <thread>
-#include <mutex>
-#include <unordered_map>
-#include <unordered_set>
-#include <vector>
-#include <sstream>
-#include <cstring>
 #include <cstdlib>
+#include <csignal>
 #include <unistd.h>
-#include <arpa/inet.h>
-
-#define BUFFER_SIZE 1024
-
-std::mutex cout_mutex;
-
-void handle_server_messages(int server_socket) {
-    char buffer[BUFFER_SIZE];
-    while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            std::lock_guard<std::mutex> lock(cout_mutex);
-            std::cout << "Disconnected from server." << std::endl;
-            close(server_socket);
-            exit(0);
+#include "chat_client.h"
+
+#define STDIN_READ_SZ 4096
+#define SESSION_FILE ".shadow_room_session" // TLS session saved for the next run, which then skips the full handshake
+                                            // (one per server port)
+
+// Writes everything in text to stdout at once and empties it.
+void write_out(std::string &text) {
+    size_t done = 0;
+    while (done < text.size()) {
+        ssize_t n = write(STDOUT_FILENO, text.data() + done, text.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
         }
-        std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << buffer << std::endl;
+        done += n;
     }
+    text.clear();
 }
 
-int main() {
-    int client_socket;
-    sockaddr_in server_address{};
-
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket < 0) {
-        std::cerr << "Error creating socket." << std::endl;
-        return 1;
+int main(int argc, char* argv[]) {
+    ChatClientOptions options; // a node of a cluster listens on its own port (-p)
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-f") {
+            options.framed = true;
+        } else if (arg == "-z") {
+            options.compress = true;
+        } else if (arg == "-p" && i + 1 < argc && (options.port = atoi(argv[i + 1])) > 0 && options.port < 65536) {
+            i++;
+        } else if (arg == "-t" && i + 1 < argc) {
+            options.ca_file = argv[++i]; // connect with TLS, trusting the certificates in this file
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [-f] [-z] [-p port] [-t trusted certificate file]" << std::endl;
+            return 1;
+        }
     }
+    options.session_file = SESSION_FILE "." + std::to_string(options.port);
+    signal(SIGPIPE, SIG_IGN); // a server that went away is noticed by the next read
 
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(12345);
-    server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    if (connect(client_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
-        std::cerr << "Error connecting to server." << std::endl;
+    ChatClient client(options);
+    std::string error;
+    if (!client.connect(error)) {
+        std::cerr << error << std::endl;
         return 1;
     }
-
-    std::cout << "Connected to the server." << std::endl;
-
-    // Authentication
-    std::string username, password;
-    char buffer[BUFFER_SIZE];
-
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the user name" for the server
-    // You should have a line like this in the server.cpp code: send_message(client_socket, "Enter username: ");
- 
-    std::cout << buffer;
-    std::getline(std::cin, username);
-    send(client_socket, username.c_str(), username.size(), 0);
-
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
-    std::cout << buffer;
-    std::getline(std::cin, password);
-    send(client_socket, password.c_str(), password.size(), 0);
-
-    memset(buffer, 0, BUFFER_SIZE);
-    // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
-    recv(client_socket, buffer, BUFFER_SIZE, 0); 
-    std::cout << buffer << std::endl;
-
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
-        close(client_socket);
-        return 1;
-    }
-
-    // Start thread for receiving messages from server
-    std::thread receive_thread(handle_server_messages, client_socket);
-    // We use detach because we want this thread to run in the background while the main thread continues running
-    receive_thread.detach();
-
-    // Send messages to the server
-    while (true) {
-        std::string message;
-        std::getline(std::cin, message);
-
-        if (message.empty()) continue;
-
-        send(client_socket, message.c_str(), message.size(), 0);
-
-        if (message == "/exit") {
-            close(client_socket);
-            break;
+    std::cout << "Connected to the server" << (!client.tls() ? "." : client.tls_resumed() ? " (TLS, resumed)." : " (TLS).")
+              << std::endl;
+
+    // Everything printed in one turn of the loop is written with one call, the login prompts are printed
+    // as they are and every later message on a line of its own
+    std::string screen;
+    bool rejected = false;
+    client.on_message = [&](std::string_view text) {
+        screen.append(text);
+        if (client.logged_in()) {
+            screen.push_back('\n');
+        }
+    };
+    client.on_login = [&](bool accepted) {
+        screen.push_back('\n');
+        rejected = !accepted;
+    };
+    client.on_disconnect = [&] {
+        if (!rejected) {
+            screen.append("Disconnected from server.\n");
+        }
+    };
+
+    // The user's lines go to the server as they are completed, the client holds back each one until the
+    // login gets that far
+    std::string typed;
+    int lines = 0;
+    bool exiting = false;
+    client.watch(STDIN_FILENO, [&] {
+        char buffer[STDIN_READ_SZ];
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n <= 0) {
+            if (n == 0 || errno != EINTR) {
+                client.unwatch(STDIN_FILENO); // nothing more to send, keep printing what arrives
+            }
+            return;
+        }
+        typed.append(buffer, n);
+        size_t end;
+        while ((end = typed.find('\n')) != std::string::npos && !exiting) {
+            std::string message = typed.substr(0, end);
+            typed.erase(0, end + 1);
+            if (message.empty() && lines >= 2) continue; // the username and the password may be empty
+
+            lines++;
+            exiting = message == "/exit";
+            client.send_line(std::move(message));
+        }
+    });
+
+    // Single event loop: server messages, the user's input and the writes to the server
+    while (client.poll_once(-1)) {
+        write_out(screen);
+        if (rejected) {
+            client.close();
+            return 1;
+        }
+        if (exiting && client.flushed()) {
+            client.close(); // /exit was written
+            return 0;
         }
     }
-
-    return 0;
+    write_out(screen);
+    return rejected ? 1 : 0;
 }
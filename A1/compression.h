@@ -0,0 +1,142 @@
+// Payload compression of the framed protocol, shared by server_grp and client_grp.
+//
+// A framed client offers compression with an OP_COMPRESS frame naming the method, sent before its
+// username. The server answers with an OP_COMPRESS frame naming the method it accepted, empty if it
+// declined, and every later message that compression makes smaller is sent as an OP_DEFLATE frame:
+//
+//   payload: raw deflate stream (RFC 1951) of the OP_TEXT payload, primed with DEFLATE_DICT
+//
+// Each message is a complete stream of its own, so a message sent to many clients is compressed once
+// and the same bytes go to all of them. The preset dictionary holds the strings the server sends most,
+// which is what makes short chat messages worth compressing.
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <zlib.h>
+#include "framing.h"
+
+#define COMPRESS_METHOD "deflate" // the only method offered and accepted
+#define DEFLATE_MIN_SZ 32         // shorter messages are sent as they are
+#define DEFLATE_LEVEL 6           // zlib compression level
+
+// Strings every session receives, a back reference into the dictionary is cheaper the closer it is to
+// the end, so the most frequent ones come last. Changing it breaks clients built with the old one.
+constexpr const char DEFLATE_DICT[] =
+    "\033[93m/msg <recipient's username> <message>\033[0m\tSend a private message to another user in the chat\n"
+    "\033[93m/broadcast <message>\033[0m\t\t\tSend a message to all the users in the chat\n"
+    "\033[93m/create_group <group_name>\033[0m\t\tCreate a group for messaging\n"
+    "\033[93m/join_group <group_name>\033[0m\t\tJoin an existing group\n"
+    "\033[93m/group_msg <group_name> <message>\033[0m\tSend a message to all the members of the group\n"
+    "\033[93m/leave_group <group_name>\033[0m\t\tLeave a group\n"
+    "\033[93m/list_all_members\033[0m\t\t\tPrint a list of all members present in the chat\n"
+    "\033[93m/list_all_groups\033[0m\t\t\tPrint a list of all groups in the chat\n"
+    "\033[93m/list_group_members <group_name>\033[0m\tPrint a list of all members in a group\n"
+    "\033[93m/queue_stats\033[0m\t\t\t\tPrint the outgoing queue and dropped messages of every member\n"
+    "\033[93m/history <group_name> [<count>]\033[0m\t\tPrint the last messages sent to a group (default 10)\n"
+    "\033[93m/help\033[0m\t\t\t\t\tPrint this help message\n"
+    "\033[93m/exit\033[0m\t\t\t\t\tExit the chat\n"
+    "\033[32mList of availabe actions : \033[0m\n"
+    "\n"
+    "██╗    ██╗███████╗██╗      ██████╗ ██████╗ ███╗   ███╗███████╗\n"
+    "██║    ██║██╔════╝██║     ██╔════╝██╔═══██╗████╗ ████║██╔════╝\n"
+    "██║ █╗ ██║█████╗  ██║     ██║     ██║   ██║██╔████╔██║█████╗  \n"
+    "██║███╗██║██╔══╝  ██║     ██║     ██║   ██║██║╚██╔╝██║██╔══╝  \n"
+    "╚███╔███╔╝███████╗███████╗╚██████╗╚██████╔╝██║ ╚═╝ ██║███████╗\n"
+    " ╚══╝╚══╝ ╚══════╝╚══════╝ ╚═════╝ ╚═════╝ ╚═╝     ╚═╝╚══════╝             \n"
+    "\033[31mError : This group does not exist!\033[0m"
+    "\033[93mRecipient is offline, the message will be delivered when they log in.\033[0m"
+    " messages were skipped because you were reading too slowly.\033[0m"
+    "\033[90m(2026-01-01 00:00:00)\033[0m "
+    "\033[093m has joined the chat!\033[0m"
+    "\033[093m has left the chat! \033[0m"
+    " joined .\033[0m left .\033[0m"
+    " on broadcast]: "
+    " on Group ";
+
+// Compresses messages into OP_DEFLATE payloads, one per thread, the stream is reused between messages.
+class Deflater
+{
+public:
+    Deflater()
+    {
+        ok = deflateInit2(&zs, DEFLATE_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    Deflater(const Deflater &) = delete;
+    Deflater &operator=(const Deflater &) = delete;
+    ~Deflater() { deflateEnd(&zs); }
+
+    // compressed form of a message, false if it is short or does not get smaller
+    bool compress(std::string_view text, std::string &out)
+    {
+        if (!ok || text.size() < DEFLATE_MIN_SZ || deflateReset(&zs) != Z_OK ||
+            deflateSetDictionary(&zs, (const Bytef *)DEFLATE_DICT, sizeof(DEFLATE_DICT) - 1) != Z_OK)
+        {
+            return false;
+        }
+        out.resize(deflateBound(&zs, text.size()));
+        zs.next_in = (Bytef *)text.data();
+        zs.avail_in = text.size();
+        zs.next_out = (Bytef *)out.data();
+        zs.avail_out = out.size();
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= text.size())
+        {
+            return false;
+        }
+        out.resize(zs.total_out);
+        return true;
+    }
+
+private:
+    z_stream zs = {};
+    bool ok;
+};
+
+// Restores the text of OP_DEFLATE payloads.
+class Inflater
+{
+public:
+    Inflater() { ok = inflateInit2(&zs, -MAX_WBITS) == Z_OK; }
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+    ~Inflater() { inflateEnd(&zs); }
+
+    // text of a compressed message, false if the payload is corrupt or expands past MAX_FRAME_SZ
+    bool decompress(std::string_view payload, std::string &out)
+    {
+        if (!ok || inflateReset(&zs) != Z_OK ||
+            inflateSetDictionary(&zs, (const Bytef *)DEFLATE_DICT, sizeof(DEFLATE_DICT) - 1) != Z_OK)
+        {
+            return false;
+        }
+        zs.next_in = (Bytef *)payload.data();
+        zs.avail_in = payload.size();
+        out.resize(4 * payload.size() + 256);
+        while (true)
+        {
+            zs.next_out = (Bytef *)out.data() + zs.total_out;
+            zs.avail_out = out.size() - zs.total_out;
+            int ret = inflate(&zs, Z_FINISH);
+            if (ret == Z_STREAM_END)
+            {
+                out.resize(zs.total_out);
+                return true;
+            }
+            // out of room is the only reason to go on, a truncated stream leaves room unused
+            if ((ret != Z_BUF_ERROR && ret != Z_OK) || zs.avail_out != 0 || out.size() >= MAX_FRAME_SZ)
+            {
+                return false;
+            }
+            out.resize(std::min(2 * out.size(), (size_t)MAX_FRAME_SZ));
+        }
+    }
+
+private:
+    z_stream zs = {};
+    bool ok;
+};
+
+#endif
@@ -0,0 +1,225 @@
+// Precompiled credential file shared by make_credentials and server_grp.
+//
+// make_credentials builds it offline from users.txt, the server maps it read only and
+// looks usernames up in place, nothing is parsed or allocated per login:
+//
+//   +------------+-----------------------------+-------------------------+
+//   | CredHeader | CredSlot[num_slots]         | usernames (names_size)  |
+//   +------------+-----------------------------+-------------------------+
+//
+// The slots are an open addressing table (linear probing, at most half full) keyed by the
+// FNV-1a hash of the username. A slot stores a random salt and PBKDF2-HMAC-SHA256 of the
+// password, never the password itself. Integers are in host byte order.
+
+#ifndef CREDENTIALS_H
+#define CREDENTIALS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#define CRED_MAGIC "SRCRED1"     // 8 bytes including the terminating NUL
+#define CRED_SALT_SZ 16
+#define CRED_HASH_SZ 32          // SHA-256 digest
+#define CRED_ITERATIONS 10000    // default PBKDF2 iterations of make_credentials
+
+struct CredHeader
+{
+    char magic[8];       // CRED_MAGIC
+    uint32_t iterations; // PBKDF2 iterations of every hash in the file
+    uint32_t reserved;
+    uint64_t num_slots;  // a power of two
+    uint64_t num_users;
+    uint64_t names_size; // bytes of the username area
+};
+
+struct CredSlot
+{
+    uint64_t name_hash;                 // cred_name_hash of the username
+    uint32_t name_off;                  // offset of the username in the username area
+    uint32_t name_len;                  // 0 for an empty slot
+    unsigned char salt[CRED_SALT_SZ];
+    unsigned char hash[CRED_HASH_SZ];   // PBKDF2-HMAC-SHA256(password, salt, iterations)
+};
+
+static_assert(sizeof(CredHeader) == 40 && sizeof(CredSlot) == 64, "credential file layout changed");
+
+// 64 bit FNV-1a, the table index is its low bits
+inline uint64_t cred_name_hash(std::string_view name)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : name)
+    {
+        h = (h ^ c) * 1099511628211ull;
+    }
+    return h;
+}
+
+inline bool cred_hash_password(std::string_view password, const unsigned char *salt, uint32_t iterations,
+                               unsigned char *out)
+{
+    return PKCS5_PBKDF2_HMAC(password.data(), password.size(), salt, CRED_SALT_SZ, iterations, EVP_sha256(),
+                             CRED_HASH_SZ, out) == 1;
+}
+
+// Read only view of a credential file image, does not own the memory.
+class CredTable
+{
+public:
+    CredTable() = default;
+
+    // false if data is not a well formed credential file of exactly size bytes
+    bool open(const char *data, size_t size)
+    {
+        if (size < sizeof(CredHeader))
+        {
+            return false;
+        }
+        const CredHeader *hdr = (const CredHeader *)data;
+        uint64_t n = hdr->num_slots;
+        if (memcmp(hdr->magic, CRED_MAGIC, sizeof(hdr->magic)) != 0 || hdr->iterations == 0 || n == 0 ||
+            (n & (n - 1)) != 0 || n > (size - sizeof(CredHeader)) / sizeof(CredSlot) ||
+            sizeof(CredHeader) + n * sizeof(CredSlot) + hdr->names_size != size)
+        {
+            return false;
+        }
+        header = hdr;
+        slots = (const CredSlot *)(data + sizeof(CredHeader));
+        names = data + sizeof(CredHeader) + n * sizeof(CredSlot);
+        return true;
+    }
+
+    size_t users() const { return header ? header->num_users : 0; }
+
+    // slot of a username, nullptr if it is not in the table
+    const CredSlot *find(std::string_view name) const
+    {
+        if (header == nullptr || name.empty())
+        {
+            return nullptr;
+        }
+        uint64_t h = cred_name_hash(name);
+        uint64_t mask = header->num_slots - 1;
+        for (uint64_t i = h & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++)
+        {
+            const CredSlot &slot = slots[i];
+            if (slot.name_len == 0)
+            {
+                return nullptr;
+            }
+            if (slot.name_hash == h && slot.name_len == name.size() &&
+                (uint64_t)slot.name_off + slot.name_len <= header->names_size &&
+                memcmp(names + slot.name_off, name.data(), name.size()) == 0)
+            {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    // hashes password with the user's salt and compares in constant time, false for unknown users
+    bool verify(std::string_view name, std::string_view password) const
+    {
+        const CredSlot *slot = find(name);
+        unsigned char hash[CRED_HASH_SZ];
+        return slot != nullptr && cred_hash_password(password, slot->salt, header->iterations, hash) &&
+               CRYPTO_memcmp(hash, slot->hash, CRED_HASH_SZ) == 0;
+    }
+
+private:
+    const CredHeader *header = nullptr;
+    const CredSlot *slots = nullptr;
+    const char *names = nullptr;
+};
+
+// Builds a credential file image from (username, password) pairs, a later duplicate replaces
+// an earlier one. Hashing is spread over num_threads threads. Returns an empty string if the
+// random number generator or the hash fails.
+inline std::string build_credentials(const std::vector<std::pair<std::string, std::string>> &users,
+                                     uint32_t iterations, unsigned num_threads = 1)
+{
+    // table at most half full
+    uint64_t num_slots = 16;
+    while (num_slots < users.size() * 2)
+    {
+        num_slots *= 2;
+    }
+    std::vector<CredSlot> slots(num_slots);
+    std::vector<const std::pair<std::string, std::string> *> owner(num_slots, nullptr);
+    std::string names;
+    uint64_t num_users = 0;
+    for (auto &user : users)
+    {
+        if (user.first.empty())
+        {
+            continue;
+        }
+        uint64_t h = cred_name_hash(user.first);
+        uint64_t i = h & (num_slots - 1);
+        while (owner[i] != nullptr && owner[i]->first != user.first)
+        {
+            i = (i + 1) & (num_slots - 1);
+        }
+        if (owner[i] == nullptr)
+        {
+            slots[i].name_hash = h;
+            slots[i].name_off = names.size();
+            slots[i].name_len = user.first.size();
+            names += user.first;
+            num_users++;
+        }
+        owner[i] = &user;
+    }
+
+    // PBKDF2 dominates, each thread hashes an interleaved share of the slots
+    std::vector<char> ok(std::max(1u, num_threads), 1);
+    auto hash_share = [&](unsigned t)
+    {
+        for (uint64_t i = t; i < num_slots; i += ok.size())
+        {
+            if (owner[i] != nullptr &&
+                (RAND_bytes(slots[i].salt, CRED_SALT_SZ) != 1 ||
+                 !cred_hash_password(owner[i]->second, slots[i].salt, iterations, slots[i].hash)))
+            {
+                ok[t] = 0;
+                return;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < ok.size(); t++)
+    {
+        threads.emplace_back(hash_share, t);
+    }
+    hash_share(0);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    if (std::count(ok.begin(), ok.end(), 0) > 0)
+    {
+        return "";
+    }
+
+    CredHeader hdr = {};
+    memcpy(hdr.magic, CRED_MAGIC, sizeof(hdr.magic));
+    hdr.iterations = iterations;
+    hdr.num_slots = num_slots;
+    hdr.num_users = num_users;
+    hdr.names_size = names.size();
+
+    std::string image((const char *)&hdr, sizeof(hdr));
+    image.append((const char *)slots.data(), num_slots * sizeof(CredSlot));
+    image += names;
+    return image;
+}
+
+#endif
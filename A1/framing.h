@@ -0,0 +1,271 @@
+// Binary framed protocol shared by server_grp and client_grp.
+//
+// A client opts in by sending FRAME_MAGIC in place of its username, right after the
+// welcome prompt. The server answers with FRAME_MAGIC and from then on both sides
+// exchange frames instead of raw text:
+//
+//   +------------------------+-----------+---------------------+
+//   | payload length (4, BE) | opcode(1) | payload (length)    |
+//   +------------------------+-----------+---------------------+
+//
+// Clients that never send the magic keep using the legacy text protocol.
+
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#define FRAME_MAGIC "\x7fSRF1"  // protocol negotiation marker, not a valid username
+#define FRAME_MAGIC_LEN 5
+#define FRAME_HDR_SZ 5          // length + opcode
+#define MAX_FRAME_SZ (1 << 20)  // larger frames are a protocol error
+
+enum Opcode : uint8_t
+{
+    // login and raw text
+    OP_USERNAME = 1,  // client -> server, payload is the username
+    OP_PASSWORD = 2,  // client -> server, payload is the password
+    OP_COMMAND = 3,   // client -> server, payload is a command line as typed ("/msg bob hi")
+    OP_TEXT = 4,      // server -> client, payload is a message to display
+    OP_COMPRESS = 5,  // both ways before the username, payload is the compression method (compression.h)
+    OP_DEFLATE = 6,   // server -> client, payload is an OP_TEXT payload compressed with that method
+
+    // actions, payload is everything after the action name ("bob hi" for /msg)
+    OP_EXIT = 16,
+    OP_MSG,
+    OP_BROADCAST,
+    OP_CREATE_GROUP,
+    OP_JOIN_GROUP,
+    OP_LEAVE_GROUP,
+    OP_GROUP_MSG,
+    OP_LIST_ALL_MEMBERS,
+    OP_LIST_ALL_GROUPS,
+    OP_LIST_GROUP_MEMBERS,
+    OP_HELP,
+    OP_QUEUE_STATS,
+    OP_HISTORY,
+    OP_PRESENCE,
+    OP_LAST_ACTION = OP_PRESENCE
+};
+
+// action names, indexed by opcode - OP_EXIT
+constexpr const char *ACTION_NAMES[] = {"/exit", "/msg", "/broadcast", "/create_group", "/join_group", "/leave_group",
+                                        "/group_msg", "/list_all_members", "/list_all_groups", "/list_group_members", "/help",
+                                        "/queue_stats", "/history", "/presence"};
+
+#define ACTION_HASH_SZ 64 // slots of the action name hash table, a power of two
+
+// action name of an action opcode, nullptr for any other opcode
+inline const char *opcode_action(uint8_t opcode)
+{
+    if (opcode < OP_EXIT || opcode > OP_LAST_ACTION)
+    {
+        return nullptr;
+    }
+    return ACTION_NAMES[opcode - OP_EXIT];
+}
+
+// hash of an action name, mixes its length with the letter after the '/'
+constexpr size_t action_hash(std::string_view action)
+{
+    return (action.size() < 2) ? 0 : (action.size() * 22 + (unsigned char)action[1]) & (ACTION_HASH_SZ - 1);
+}
+
+struct ActionTable
+{
+    uint8_t opcodes[ACTION_HASH_SZ] = {}; // opcode of the action hashed to each slot, 0 if none
+    bool collision = false;               // two actions hash to the same slot
+};
+
+constexpr ActionTable make_action_table()
+{
+    ActionTable table;
+    for (int opcode = OP_EXIT; opcode <= OP_LAST_ACTION; opcode++)
+    {
+        uint8_t &slot = table.opcodes[action_hash(ACTION_NAMES[opcode - OP_EXIT])];
+        table.collision = table.collision || slot != 0;
+        slot = opcode;
+    }
+    return table;
+}
+
+constexpr ActionTable ACTION_TABLE = make_action_table();
+static_assert(!ACTION_TABLE.collision, "action_hash is no longer perfect for ACTION_NAMES, change its multiplier");
+
+// opcode of a typed action name ("/msg"), 0 if it is not an action, a single compare confirms the slot
+inline uint8_t action_opcode(std::string_view action)
+{
+    uint8_t opcode = ACTION_TABLE.opcodes[action_hash(action)];
+    return (opcode != 0 && action == ACTION_NAMES[opcode - OP_EXIT]) ? opcode : 0;
+}
+
+inline void encode_frame_header(unsigned char *hdr, uint8_t opcode, uint32_t len)
+{
+    hdr[0] = len >> 24;
+    hdr[1] = len >> 16;
+    hdr[2] = len >> 8;
+    hdr[3] = len;
+    hdr[4] = opcode;
+}
+
+inline std::string encode_frame(uint8_t opcode, std::string_view payload)
+{
+    std::string frame(FRAME_HDR_SZ + payload.size(), '\0');
+    encode_frame_header((unsigned char *)frame.data(), opcode, payload.size());
+    memcpy(frame.data() + FRAME_HDR_SZ, payload.data(), payload.size());
+    return frame;
+}
+
+// Byte queue over a power-of-two circular buffer that doubles when it runs out of space.
+class RingBuffer
+{
+public:
+    explicit RingBuffer(size_t initial = 4096) : buf(initial) {}
+
+    size_t size() const { return count; }
+
+    // contiguous free space to receive into, grows the buffer if less than min_free bytes are free
+    std::pair<char *, size_t> write_space(size_t min_free)
+    {
+        if (count == 0)
+        {
+            head = 0; // empty, restart at the front so a read is never split at the wrap
+        }
+        if (buf.size() - count < min_free)
+        {
+            grow(count + min_free);
+        }
+        size_t tail = (head + count) & (buf.size() - 1);
+        size_t len = (tail >= head) ? buf.size() - tail : head - tail;
+        return {buf.data() + tail, len};
+    }
+
+    // marks n bytes of the last write_space as filled
+    void commit(size_t n) { count += n; }
+
+    // copies n bytes in at the end
+    void append(const char *src, size_t n)
+    {
+        while (n > 0)
+        {
+            auto [dst, len] = write_space(n);
+            len = std::min(len, n);
+            memcpy(dst, src, len);
+            commit(len);
+            src += len;
+            n -= len;
+        }
+    }
+
+    void consume(size_t n)
+    {
+        head = (head + n) & (buf.size() - 1);
+        count -= n;
+    }
+
+    // copies n bytes starting at offset off
+    void peek(size_t off, char *dst, size_t n) const
+    {
+        size_t start = (head + off) & (buf.size() - 1);
+        size_t first = std::min(n, buf.size() - start);
+        memcpy(dst, buf.data() + start, first);
+        memcpy(dst + first, buf.data(), n - first);
+    }
+
+    // pointer to n bytes at offset off, nullptr if they wrap around the end
+    const char *contiguous(size_t off, size_t n) const
+    {
+        size_t start = (head + off) & (buf.size() - 1);
+        return (start + n <= buf.size()) ? buf.data() + start : nullptr;
+    }
+
+private:
+    void grow(size_t needed)
+    {
+        size_t cap = buf.size();
+        while (cap < needed)
+        {
+            cap *= 2;
+        }
+        std::vector<char> bigger(cap);
+        peek(0, bigger.data(), count);
+        buf.swap(bigger);
+        head = 0;
+    }
+
+    std::vector<char> buf;
+    size_t head = 0;  // offset of the first unread byte
+    size_t count = 0; // unread bytes
+};
+
+struct Frame
+{
+    uint8_t opcode;
+    std::string_view payload; // valid until the next call to FrameParser::next
+};
+
+enum FrameStatus
+{
+    FRAME_OK,         // a complete frame was returned
+    FRAME_INCOMPLETE, // more bytes are needed
+    FRAME_ERROR       // frame exceeds MAX_FRAME_SZ
+};
+
+// Incremental frame parser, bytes are received straight into buffer() and any number
+// of complete frames (a read may carry several pipelined ones) are taken out with next().
+class FrameParser
+{
+public:
+    RingBuffer &buffer() { return ring; }
+
+    FrameStatus next(Frame &frame)
+    {
+        ring.consume(last_frame_sz); // the previous frame is no longer referenced
+        last_frame_sz = 0;
+        if (ring.size() < FRAME_HDR_SZ)
+        {
+            return FRAME_INCOMPLETE;
+        }
+
+        unsigned char hdr[FRAME_HDR_SZ];
+        ring.peek(0, (char *)hdr, FRAME_HDR_SZ);
+        uint32_t len = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) | ((uint32_t)hdr[2] << 8) | hdr[3];
+        if (len > MAX_FRAME_SZ)
+        {
+            return FRAME_ERROR;
+        }
+        if (ring.size() < FRAME_HDR_SZ + len)
+        {
+            return FRAME_INCOMPLETE;
+        }
+
+        // payloads are read in place unless they wrap around the end of the ring
+        const char *payload = ring.contiguous(FRAME_HDR_SZ, len);
+        if (payload == nullptr)
+        {
+            scratch.resize(len);
+            ring.peek(FRAME_HDR_SZ, scratch.data(), len);
+            payload = scratch.data();
+        }
+        frame.opcode = hdr[4];
+        frame.payload = std::string_view(payload, len);
+        last_frame_sz = FRAME_HDR_SZ + len;
+        return FRAME_OK;
+    }
+
+    // the frame returned by the last next() stays in the buffer and is returned again
+    void retain() { last_frame_sz = 0; }
+
+private:
+    RingBuffer ring;
+    std::string scratch;      // holds payloads that wrap around the ring
+    size_t last_frame_sz = 0; // bytes of the frame returned by the last next()
+};
+
+#endif
@@ -0,0 +1,80 @@
+// Offline tool that compiles users.txt (username:password per line) into the hashed
+// credential file loaded by server_grp, see credentials.h for the format.
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <getopt.h>
+#include <unistd.h>
+#include "credentials.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+    uint32_t iterations = CRED_ITERATIONS;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:")) != -1)
+    {
+        if (opt == 'i' && atoi(optarg) > 0)
+        {
+            iterations = atoi(optarg);
+        }
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [-i <PBKDF2 iterations>] [users.txt] [users.cred]\n";
+            return 1;
+        }
+    }
+    string in_path = (optind < argc) ? argv[optind] : "users.txt";
+    string out_path = (optind + 1 < argc) ? argv[optind + 1] : "users.cred";
+
+    ifstream file(in_path);
+    if (!file)
+    {
+        perror(("Error opening " + in_path).c_str());
+        return 1;
+    }
+    vector<pair<string, string>> users;
+    string line;
+    while (getline(file, line))
+    {
+        size_t pos = line.find(':');
+        if (pos != string::npos)
+        {
+            users.emplace_back(line.substr(0, pos), line.substr(pos + 1));
+        }
+    }
+
+    string image = build_credentials(users, iterations, max(1u, thread::hardware_concurrency()));
+    if (image.empty())
+    {
+        cerr << "Error hashing the passwords.\n";
+        return 1;
+    }
+
+    // write a temporary file and rename it over the old one, a server reloading at the same
+    // time maps either the complete old file or the complete new one
+    string tmp_path = out_path + ".tmp";
+    FILE *out = fopen(tmp_path.c_str(), "wb");
+    if (out == nullptr)
+    {
+        perror(("Error creating " + tmp_path).c_str());
+        return 1;
+    }
+    bool written = fwrite(image.data(), 1, image.size(), out) == image.size();
+    written = (fflush(out) == 0) && written && fsync(fileno(out)) == 0;
+    if (fclose(out) != 0 || !written || rename(tmp_path.c_str(), out_path.c_str()) != 0)
+    {
+        perror(("Error writing " + out_path).c_str());
+        unlink(tmp_path.c_str());
+        return 1;
+    }
+    cout << "Wrote " << out_path << " (" << ((const CredHeader *)image.data())->num_users << " users, " << iterations
+         << " iterations)" << endl;
+    return 0;
+}
@@ -0,0 +1,351 @@
+// Append-only message log of server_grp, one stream per group and per offline inbox.
+//
+// A stream is a directory of numbered segment files and one index:
+//
+//   00000000.seg, 00000001.seg, ...   records in append order, a segment is closed once it
+//                                     passes LOG_SEGMENT_SZ and the next one is started
+//   index                             LogIndexHeader, then one LogIndexEntry per record,
+//                                     mapped read/write, entry i locates record i
+//
+//   record: | LogRecordHeader | payload (len bytes) |
+//
+// Appends are written right away but only indexed by commit(), after the segment is synced,
+// so the index never points at a record that could be lost. A crash between the two leaves
+// synced records past the end of the index; open() indexes every complete record it finds
+// there and cuts off a torn tail. Integers are in host byte order.
+//
+// A LogStream is not thread safe, the server touches all streams from its log thread only.
+
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define LOG_MAGIC "SRLOGI1"        // 8 bytes including the terminating NUL
+#define LOG_SEGMENT_SZ (8 << 20)   // bytes after which a new segment is started
+#define LOG_INDEX_GROW 4096        // index entries added each time the index file fills up
+#define LOG_MAX_RECORD (16 << 20)  // larger records are treated as corruption
+
+struct LogIndexHeader
+{
+    char magic[8];      // LOG_MAGIC
+    uint64_t next_seq;  // records indexed so far
+    uint64_t delivered; // records already handed to the reader of an inbox
+    uint64_t reserved;
+};
+
+struct LogIndexEntry
+{
+    uint32_t segment; // number of the segment holding the record
+    uint32_t len;     // payload bytes
+    uint64_t offset;  // offset of the record header in the segment
+};
+
+struct LogRecordHeader
+{
+    uint32_t len;      // payload bytes
+    uint32_t checksum; // log_checksum of the payload
+    uint64_t seq;      // position of the record in its stream
+    int64_t time;      // wall clock milliseconds when the record was appended
+};
+
+static_assert(sizeof(LogIndexHeader) == 32 && sizeof(LogIndexEntry) == 16 && sizeof(LogRecordHeader) == 24,
+              "message log layout changed");
+
+// 32 bit FNV-1a, catches torn writes when a stream is recovered
+inline uint32_t log_checksum(std::string_view data)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned char c : data)
+    {
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+class LogStream
+{
+public:
+    LogStream() = default;
+    LogStream(const LogStream &) = delete;
+    LogStream &operator=(const LogStream &) = delete;
+
+    ~LogStream()
+    {
+        if (index != nullptr)
+        {
+            munmap(index, index_size);
+        }
+        for (int fd : {seg_fd, index_fd, dir_fd})
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    }
+
+    // opens the stream in dir, creating it if create is set, and recovers records the index
+    // lost in a crash. false if the stream does not exist or cannot be used.
+    bool open(const std::string &dir, bool create)
+    {
+        if (create && mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+        {
+            return false;
+        }
+        dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0)
+        {
+            return false;
+        }
+        index_fd = openat(dir_fd, "index", O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (index_fd < 0 || fstat(index_fd, &st) < 0)
+        {
+            return false;
+        }
+
+        bool fresh = st.st_size == 0;
+        if (!map_index(fresh ? sizeof(LogIndexHeader) + LOG_INDEX_GROW * sizeof(LogIndexEntry) : st.st_size))
+        {
+            return false;
+        }
+        if (fresh)
+        {
+            memcpy(index->magic, LOG_MAGIC, sizeof(index->magic));
+            fsync(dir_fd); // the new index survives a crash
+        }
+        else if (memcmp(index->magic, LOG_MAGIC, sizeof(index->magic)) != 0 || index->next_seq > capacity())
+        {
+            return false;
+        }
+        return recover();
+    }
+
+    uint64_t next_seq() const { return index->next_seq + pending.size(); } // sequence of the next append
+    uint64_t committed() const { return index->next_seq; }                 // records that are durable and indexed
+    uint64_t delivered() const { return index->delivered; }
+    void set_delivered(uint64_t seq) { index->delivered = seq; }
+    bool has_pending() const { return !pending.empty(); }
+
+    // writes a record to the current segment, it is durable and readable after the next commit().
+    // false if the write failed, the stream should then be closed and opened again.
+    bool append(std::string_view payload, int64_t time)
+    {
+        if (payload.size() > LOG_MAX_RECORD || (seg_size >= LOG_SEGMENT_SZ && !next_segment()))
+        {
+            return false;
+        }
+        LogRecordHeader hdr = {(uint32_t)payload.size(), log_checksum(payload), next_seq(), time};
+        struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {(void *)payload.data(), payload.size()}};
+        if (writev(seg_fd, iov, 2) != (ssize_t)(sizeof(hdr) + payload.size()))
+        {
+            return false;
+        }
+        pending.push_back({segment, (uint32_t)payload.size(), seg_size});
+        seg_size += sizeof(hdr) + payload.size();
+        return true;
+    }
+
+    // syncs the appended records and then indexes them, one sync covers every append since the
+    // last commit (group commit). false if the sync failed, the records are then lost.
+    bool commit()
+    {
+        if (pending.empty())
+        {
+            return true;
+        }
+        if (fdatasync(seg_fd) < 0 || !reserve(index->next_seq + pending.size()))
+        {
+            return false;
+        }
+        memcpy(entries() + index->next_seq, pending.data(), pending.size() * sizeof(LogIndexEntry));
+        index->next_seq += pending.size();
+        pending.clear();
+        return true;
+    }
+
+    // payload and time of a committed record
+    bool read(uint64_t seq, std::string &payload, int64_t &time) const
+    {
+        if (seq >= index->next_seq)
+        {
+            return false;
+        }
+        const LogIndexEntry &entry = entries()[seq];
+        int fd = (entry.segment == segment) ? seg_fd : open_segment(entry.segment, O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        LogRecordHeader hdr;
+        payload.resize(entry.len);
+        bool ok = pread(fd, &hdr, sizeof(hdr), entry.offset) == sizeof(hdr) && hdr.len == entry.len &&
+                  pread(fd, payload.data(), entry.len, entry.offset + sizeof(hdr)) == (ssize_t)entry.len;
+        if (fd != seg_fd)
+        {
+            close(fd);
+        }
+        time = hdr.time;
+        return ok;
+    }
+
+private:
+    int dir_fd = -1;
+    int index_fd = -1;
+    int seg_fd = -1;                    // segment appended to
+    uint32_t segment = 0;               // number of that segment
+    uint64_t seg_size = 0;              // bytes in that segment
+    LogIndexHeader *index = nullptr;    // mapped index file
+    size_t index_size = 0;
+    std::vector<LogIndexEntry> pending; // records appended since the last commit
+
+    LogIndexEntry *entries() const { return (LogIndexEntry *)(index + 1); }
+    uint64_t capacity() const { return (index_size - sizeof(LogIndexHeader)) / sizeof(LogIndexEntry); }
+
+    int open_segment(uint32_t number, int flags) const
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "%08u.seg", number);
+        return openat(dir_fd, name, flags | O_CLOEXEC, 0644);
+    }
+
+    bool map_index(size_t size)
+    {
+        if (index != nullptr)
+        {
+            munmap(index, index_size);
+            index = nullptr;
+        }
+        if (ftruncate(index_fd, size) < 0)
+        {
+            return false;
+        }
+        void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+        if (map == MAP_FAILED)
+        {
+            return false;
+        }
+        index = (LogIndexHeader *)map;
+        index_size = size;
+        return true;
+    }
+
+    // grows the index file to hold at least count entries
+    bool reserve(uint64_t count)
+    {
+        if (count <= capacity())
+        {
+            return true;
+        }
+        uint64_t grown = (count + LOG_INDEX_GROW - 1) / LOG_INDEX_GROW * LOG_INDEX_GROW;
+        return map_index(sizeof(LogIndexHeader) + grown * sizeof(LogIndexEntry));
+    }
+
+    // starts the next segment, the current one was synced by the last commit or is synced here
+    bool next_segment()
+    {
+        if (fdatasync(seg_fd) < 0)
+        {
+            return false;
+        }
+        int fd = open_segment(segment + 1, O_RDWR | O_CREAT | O_TRUNC | O_APPEND);
+        if (fd < 0)
+        {
+            return false;
+        }
+        close(seg_fd);
+        seg_fd = fd;
+        segment++;
+        seg_size = 0;
+        fsync(dir_fd);
+        return true;
+    }
+
+    // indexes the complete records past the last indexed one, then truncates what is left
+    bool recover()
+    {
+        uint64_t seq = index->next_seq;
+        if (seq > 0)
+        {
+            const LogIndexEntry &last = entries()[seq - 1];
+            segment = last.segment;
+            seg_size = last.offset + sizeof(LogRecordHeader) + last.len;
+        }
+        while (true)
+        {
+            int fd = open_segment(segment, O_RDWR | O_CREAT);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) < 0)
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                return false;
+            }
+            uint64_t size = st.st_size;
+            std::string payload;
+            LogRecordHeader hdr;
+            while (seg_size + sizeof(hdr) <= size && pread(fd, &hdr, sizeof(hdr), seg_size) == sizeof(hdr) &&
+                   hdr.seq == seq && hdr.len <= LOG_MAX_RECORD && seg_size + sizeof(hdr) + hdr.len <= size)
+            {
+                payload.resize(hdr.len);
+                if (pread(fd, payload.data(), hdr.len, seg_size + sizeof(hdr)) != (ssize_t)hdr.len ||
+                    log_checksum(payload) != hdr.checksum || !reserve(seq + 1))
+                {
+                    break;
+                }
+                entries()[seq++] = {segment, hdr.len, seg_size};
+                seg_size += sizeof(hdr) + hdr.len;
+            }
+
+            // a full segment continues in the next one if that exists
+            int next = (seg_size == size && size >= LOG_SEGMENT_SZ) ? open_segment(segment + 1, O_RDONLY) : -1;
+            if (next >= 0)
+            {
+                close(next);
+                close(fd);
+                segment++;
+                seg_size = 0;
+                continue;
+            }
+            if (seg_size < size && ftruncate(fd, seg_size) < 0)
+            {
+                close(fd);
+                return false;
+            }
+            close(fd);
+            break;
+        }
+        index->next_seq = seq;
+        index->delivered = std::min(index->delivered, seq);
+
+        // segments after a torn record hold nothing that was ever committed
+        for (uint32_t stale = segment + 1;; stale++)
+        {
+            char name[16];
+            snprintf(name, sizeof(name), "%08u.seg", stale);
+            if (unlinkat(dir_fd, name, 0) < 0)
+            {
+                break;
+            }
+        }
+        seg_fd = open_segment(segment, O_RDWR | O_APPEND);
+        return seg_fd >= 0;
+    }
+};
+
+#endif
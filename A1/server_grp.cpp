@@ -2,21 +2,87 @@
 #include <cstdio>
 #include <iostream>
 #include <cstring>
+#include <atomic>
 #include <memory>
 #include <string>
 #include <thread>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <bits/stdc++.h>
 #include <mutex>
+#include <shared_mutex>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include "framing.h"
+#include "compression.h"
+#include "credentials.h"
+#include "message_log.h"
+#include "uring.h"
+#include "trace.h"
 
 using namespace std;
 
 #define PORT 12345
 #define BUFF_SZ 1024 // username buffer size
 #define MSG_SZ 2048  // message buffer size
+#define MAX_EVENTS 256        // epoll events handled per epoll_wait call
+#define SENDER_QUEUE_SZ 65536 // messages a sender worker accepts before producers have to wait
+#define MAX_IOV 64            // buffers flushed to one socket per writev call
+#define HIGH_WATERMARK (4 << 20) // default bytes queued for a blocked client before the slow consumer policy applies
+#define LOW_WATERMARK (1 << 20)  // default bytes a slow client's queue is brought back to
+#define NUM_SHARDS 64         // shards of each registry, a power of two
+#define ARENA_BLOCK_SZ 16384  // bytes of a session's arena block kept between commands
+#define NAME_CHUNK 4096       // names per chunk of a NameTable
+#define MAX_NAME_CHUNKS 4096  // chunks of a NameTable, it holds at most MAX_NAME_CHUNKS * NAME_CHUNK names
+#define AUTH_QUEUE_SZ 4096    // logins waiting for an auth worker, more are turned away
+#define LOGIN_RATE 5          // default login attempts per second allowed from one client address
+#define LOGIN_BURST 20        // login attempts one address may make at once
+#define LOGIN_SHARD_MAX 4096  // addresses tracked per shard before idle ones are forgotten
+#define COMMAND_RATE 50       // default commands per second one session may send
+#define COMMAND_BURST 100     // commands a session may send at once
+#define GROUP_RATE 200        // default messages per second sent to one group
+#define GROUP_BURST 400       // messages a group may be sent at once
+#define HIST_BUCKETS 64       // buckets of a Histogram, two per power of two
+#define METRICS_REQ_SZ 4096   // bytes of a scrape request read by the metrics endpoint
+#define LOG_QUEUE_SZ 65536    // records waiting for the log thread, group messages beyond that are not logged
+#define LOG_MAX_STREAMS 256   // log streams kept open, the least recently used idle one is closed beyond that
+#define HISTORY_DEFAULT 10    // messages sent by /history without a count
+#define HISTORY_MAX 100       // most messages sent by one /history
+#define MAX_PEERS 64          // other nodes of a cluster, a fan-out marks the nodes it reaches in a 64 bit mask
+#define PEER_QUEUE_SZ 65536   // frames queued for one peer link, more are dropped until it catches up
+#define PEER_RETRY_MS 500     // pause between connection attempts to a peer
+#define PEER_TIMEOUT 5        // seconds a write to a peer may block before the link is dropped
+#define TLS_RECORD_SZ 16384   // plaintext a sender packs into one TLS record, the largest a record holds
+#define TLS_READ_SZ 17408     // ciphertext read per recv of a TLS client, a full record with its header and tag
+#define TLS_TICKETS 1         // session tickets issued after a full handshake
+#define LOG_DIR "chat_log"    // default directory of the message log
+#define CRED_FILE "users.cred" // hashed credentials built by make_credentials
+#define USERS_FILE "users.txt" // plain text credentials, used when there is no CRED_FILE
+#define DRAIN_MS 5000         // most milliseconds a shutdown waits for the outbound queues to empty
+#define HANDOFF_CHUNK_SZ 65536 // bytes of buffered input or output carried by one handoff message
+#define HANDOFF_TIMEOUT 10    // seconds either process of a hot upgrade waits for the other
+#define PRESENCE_WINDOW_MS 250 // default milliseconds join and leave notices are collected into one digest
+#define PRESENCE_MAX_MS 60000 // longest window a group may set with /presence
+#define PRESENCE_NAMES 5      // users named by a digest, the rest are counted
+#define URING_ENTRIES 256     // submission queue of an io_uring, also the sockets a sender writes per io_uring_enter
+#define URING_BUFS 1024       // provided receive buffers of a reactor's io_uring, a power of two
+#define URING_BUF_SZ 4096     // bytes of one provided receive buffer
+#define TOPIC_CACHE_SZ 4096   // groups whose matching wildcard subscribers are cached, the cache starts over beyond that
+#define TRACE_FLUSH_MS 100    // milliseconds between two writes of the trace file (-t)
 
 const char *banner = R"(
 ██╗    ██╗███████╗██╗      ██████╗ ██████╗ ███╗   ███╗███████╗
@@ -27,648 +93,6534 @@ const char *banner = R"(
  ╚══╝╚══╝ ╚══════╝╚══════╝ ╚═════╝ ╚═════╝ ╚═╝     ╚═╝╚══════╝             
 )";
 
-map<string, string> auth;                // map of username to password
-set<int> client_set;                     // set of all client sockets
-map<string, int> userToSocket;           // map of username to socket
-map<int, string> socketToUser;           // map of client fd (socket) to username
-map<string, set<string>> groupToMembers; // map of group name to set of usernames in group
+typedef uint32_t NameId;  // dense integer ID of an interned username or group name
+#define NO_NAME UINT32_MAX // NameId of a name that was never interned
 
-mutex mtx;   // lock
-int sock_fd; // server socket
+// hashes string and string_view alike, so a NameTable is searched without building a string
+struct NameHash
+{
+    using is_transparent = void;
+    size_t operator()(string_view name) const { return hash<string_view>()(name); }
+};
+
+// Gives every distinct name a dense integer ID, the registries then hash and compare integers
+// only. Names are never removed, an ID stays valid while the server runs and name_of needs no lock.
+struct NameTable
+{
+    shared_mutex lock;                                         // protects ids, count and chunk allocation
+    unordered_map<string, NameId, NameHash, equal_to<>> ids;   // name -> ID
+    string *chunks[MAX_NAME_CHUNKS] = {};                      // ID -> name, NAME_CHUNK names per chunk
+    NameId count = 0;                                          // IDs handed out
+};
+
+typedef vector<pair<NameId, int>> UserList; // (user, socket) pairs
+typedef vector<NameId> MemberList;          // sorted user IDs
+
+// Logged in users whose ID maps to this shard. Lookups take the shared lock, broadcasts
+// walk an immutable copy (snapshot) that is rebuilt on the first broadcast after a change.
+struct UserShard
+{
+    shared_mutex lock;
+    unordered_map<NameId, int> sockets;  // user -> socket
+    shared_ptr<const UserList> snapshot; // nullptr while stale
+};
+
+// Token bucket kept as the time at which it is full again (GCRA). Taking tokens refills it in the
+// same compare-and-swap, so a bucket shared by the reactors needs no lock.
+struct RateBucket
+{
+    atomic<uint64_t> full_at{0}; // now_ns() from which the bucket holds its whole burst again
+};
+
+// refill rate and size of a kind of RateBucket
+struct RateLimit
+{
+    double rate;  // tokens per second, 0 disables the limit
+    double burst; // tokens the bucket holds
+};
+
+// Groups whose ID maps to this shard. A member list is never modified in place, joins and
+// leaves publish a new copy (RCU style), so fan-out walks its snapshot without holding a lock.
+struct GroupShard
+{
+    shared_mutex lock;
+    unordered_map<NameId, shared_ptr<const MemberList>> members; // group -> members
+    unordered_map<NameId, RateBucket> limits;                    // group -> bucket of its messages
+};
+
+// One level of the subscription trie. Group names are topics split at '.', a pattern level is a
+// literal, '*' for any one level, or a final '#' for any number of levels (none included).
+struct TopicNode
+{
+    unordered_map<string, unique_ptr<TopicNode>, NameHash, equal_to<>> next; // literal levels
+    unique_ptr<TopicNode> any;          // '*'
+    shared_ptr<const MemberList> here;  // subscribers of the pattern that ends at this node
+    shared_ptr<const MemberList> rest;  // subscribers of the pattern that ends in '#' after this node
+};
+
+// Wildcard subscriptions of all users. A group message matches its group name against the trie
+// once, the merged subscribers are cached per group until the next subscribe or unsubscribe.
+struct TopicRouter
+{
+    shared_mutex lock;                                           // protects root and by_user, matching takes it shared
+    TopicNode root;
+    unordered_map<NameId, vector<string>> by_user;               // user -> its patterns
+    atomic<size_t> subscriptions{0};                             // group messages skip the trie while there are none
+    shared_mutex cache_lock;                                     // protects matches, only taken with lock held
+    unordered_map<NameId, shared_ptr<const MemberList>> matches; // group -> sorted subscribers, nullptr if none
+};
+
+// Log-linear histogram, values v and v + 1 share a bucket only once v >= 2 and a bucket never spans
+// more than a third of its values, so percentiles are good to about 30% over the full uint32 range.
+struct Histogram
+{
+    atomic<uint64_t> counts[HIST_BUCKETS] = {};
+    atomic<uint64_t> sum{0};
+};
+
+enum LoginResult
+{
+    LOGIN_OK,      // password verified
+    LOGIN_FAILED,  // wrong password
+    LOGIN_UNKNOWN, // no such user, rejected without hashing
+    LOGIN_LIMITED, // address out of login attempts
+    LOGIN_BUSY,    // admission queue full
+    NUM_LOGIN_RESULTS
+};
+
+enum FanoutKind
+{
+    FANOUT_GROUP,
+    FANOUT_BROADCAST,
+    FANOUT_PRESENCE,
+    NUM_FANOUT_KINDS
+};
+
+#define NUM_ACTION_SLOTS (OP_LAST_ACTION - OP_EXIT + 2) // every action, and slot 0 for invalid ones
+
+// the rate limits a command has to pass
+enum RateLimitKind
+{
+    LIMIT_SESSION, // commands of one session (-c)
+    LIMIT_GROUP,   // messages to one group (-g)
+    LIMIT_FANOUT,  // deliveries of all broadcasts and group messages together (-b)
+    NUM_LIMITS
+};
+
+// what happens to a command over a rate limit
+enum RatePenalty
+{
+    PENALTY_DELAY,      // the session's input is left unread until the limit lets the command pass
+    PENALTY_DROP,       // the command is dropped, the client is told once until a command passes again
+    PENALTY_DISCONNECT, // the client is logged out and disconnected
+    NUM_PENALTIES
+};
+
+// Counters of one thread. Only the owning thread writes them, with a relaxed load and store instead
+// of a locked add, and the metrics endpoint adds up the blocks of all threads when it is scraped.
+struct ThreadMetrics
+{
+    atomic<uint64_t> commands[NUM_ACTION_SLOTS] = {};    // actions handled, by action_slot
+    Histogram command_ns[NUM_ACTION_SLOTS];              // time to handle an action, by action_slot
+    Histogram fanout[NUM_FANOUT_KINDS];                  // recipients of a group message, broadcast or presence digest
+    atomic<uint64_t> presence[2] = {};                   // join and leave notices collected, and digests sent for them
+    Histogram lock_hold_ns;                              // time a sender worker's mtx is held
+    Histogram auth_ns;                                   // time to verify a password
+    Histogram tls_handshake_ns;                          // time of one TLS handshake step on an auth worker
+    atomic<uint64_t> tls_handshakes[2] = {};             // completed TLS handshakes, full and resumed
+    Histogram tls_record_messages;                       // messages packed into one TLS record by a sender
+    atomic<uint64_t> deflate_bytes[2] = {};              // message bytes compressed by a sender, and what they shrank to
+    atomic<uint64_t> logins[NUM_LOGIN_RESULTS] = {};     // login attempts, by outcome
+    atomic<uint64_t> bytes_in{0};                        // bytes received from clients
+    atomic<uint64_t> bytes_out{0};                       // bytes written to clients
+    atomic<uint64_t> io_calls[2] = {};                   // system calls receiving from clients (waits, accepts, reads) and writing to them
+    atomic<uint64_t> rate_limited[NUM_LIMITS] = {};      // commands over a rate limit, by the limit
+    atomic<uint64_t> topic_cache[2] = {};                // group messages whose wildcard subscribers were cached, and those matched
+    atomic<uint64_t> traced[2] = {};                     // records appended to the trace (-t), and those dropped as the thread's ring was full
+    Histogram log_commit_ns;                             // time to write and sync one batch of the message log
+    Histogram log_batch;                                 // records made durable by one sync
+    atomic<uint64_t> log_dropped{0};                     // group messages not logged, the log queue was full
+};
+
+// outbound queue of one connection, kept up to date by its sender worker for /queue_stats
+struct QueueStats
+{
+    atomic<uint32_t> depth{0};   // messages waiting to be written
+    atomic<uint64_t> bytes{0};   // bytes waiting to be written
+    atomic<uint64_t> dropped{0}; // messages dropped by the slow consumer policy
+};
+
+struct SocketShard
+{
+    mutex lock;
+    unordered_map<int, shared_ptr<QueueStats>> sockets; // socket -> its outbound queue stats
+};
+
+// Credentials that logins are checked against, an immutable table mapped from CRED_FILE or built
+// from USERS_FILE. A reload publishes a new CredStore, logins that loaded the old one keep it alive.
+struct CredStore
+{
+    CredTable table;
+    void *map = MAP_FAILED; // mapping of CRED_FILE, MAP_FAILED if the table was built from USERS_FILE
+    size_t map_size = 0;
+    string image;           // table built from USERS_FILE
+
+    CredStore() = default;
+    CredStore(const CredStore &) = delete;
+    CredStore &operator=(const CredStore &) = delete;
+    ~CredStore()
+    {
+        if (map != MAP_FAILED)
+        {
+            munmap(map, map_size);
+        }
+    }
+};
+
+enum GroupStatus
+{
+    GROUP_OK,
+    GROUP_EXISTS,   // create_group of an existing group
+    GROUP_MISSING,  // group does not exist
+    ALREADY_MEMBER, // join_group by a member
+    NOT_MEMBER,     // leave_group by a non member
+    GROUP_LIMIT,    // create_group with group_names full
+    BAD_NAME        // create_group of a name with a wildcard, or a malformed pattern
+};
+
+shared_ptr<const CredStore> credentials; // current credentials, only accessed with atomic_load and atomic_store
+NameTable user_names;                  // IDs of the users that logged in at least once
+NameTable group_names;                 // IDs of the groups that were created
+UserShard userToSocket[NUM_SHARDS];    // user to socket of every logged in user
+GroupShard groupToMembers[NUM_SHARDS]; // group to sorted user IDs in group
+TopicRouter topics;                    // wildcard subscriptions, matched against the group of every group message
+SocketShard client_set[NUM_SHARDS];    // sockets of all connected clients, sharded by fd
+
+// state of a connection in the login state machine driven by the reactors
+enum SessionState
+{
+    TLS_HANDSHAKE,  // TLS handshake step handed to an auth worker, input is left unread until it is done
+    AWAIT_USERNAME, // welcome prompt sent, waiting for the username
+    AWAIT_PASSWORD, // password prompt sent, waiting for the password
+    AUTHENTICATING, // password handed to an auth worker, input is left unread until its verdict
+    ACTIVE          // authenticated, handling chat actions
+};
+
+struct Session;
+
+// what a reactor does besides serving its clients, set by a shutdown or a hot upgrade
+enum ReactorMode
+{
+    REACTOR_RUN,   // accepts and serves clients
+    REACTOR_DRAIN, // serves its clients but accepts no new ones
+    REACTOR_PARK   // touches nothing until it is resumed, its sessions may be handed to another process
+};
+
+// how the reactors and the senders do their socket I/O, set with -B
+enum IoBackend
+{
+    IO_EPOLL, // readiness from epoll, then one system call per accept, read and write
+    IO_URING  // multishot accepts and receives into provided buffers, the writes of a batch in one submission
+};
+
+// what a completion of a reactor's io_uring belongs to, kept in the low bits of its user_data
+// next to the Session it is for
+enum RingTag : uint64_t
+{
+    RING_ACCEPT,  // multishot accept on listen_fd
+    RING_POLL,    // multishot poll of epoll_fd, which still watches TLS clients and event_fd
+    RING_RECV,    // multishot receive of a plain TCP session
+    RING_CANCEL,  // cancellation of one of them, nothing to do
+    RING_TAG_MASK = 3
+};
+
+// state of a reactor thread that other threads hand work back to
+struct Reactor
+{
+    int epoll_fd;                            // client sockets, the listener and event_fd
+    int event_fd;                            // wakes the reactor when auth_done becomes non-empty or its mode changes
+    int listen_fd;                           // server socket the reactor accepts on
+    bool accepting = false;                  // listen_fd is watched, only touched by the reactor
+    Uring *ring = nullptr;                   // io_uring backend: accepts and plain TCP input, nullptr with epoll
+    int accepts = 0;                         // io_uring backend: multishot accepts in flight, one unless being cancelled
+    int receiving = 0;                       // io_uring backend: multishot receives in flight
+    bool polling = false;                    // io_uring backend: the multishot poll of epoll_fd is armed
+    int timer_fd;                            // in epoll_fd, fires when the first delayed session may go on
+    set<pair<uint64_t, Session *>> delayed;  // sessions holding back a command over a rate limit, by when they may go on
+    atomic<ReactorMode> mode{REACTOR_RUN};
+    unordered_set<Session *> sessions;       // every client of the reactor, only touched by the reactor unless it is parked
+    mutex mtx;                               // protects auth_done
+    vector<pair<Session *, bool>> auth_done; // verdicts of the auth workers, applied by the reactor
+};
+
+// the reactors, and how many of them are parked
+struct ReactorControl
+{
+    mutex mtx;                   // protects reactors and parked
+    condition_variable changed;  // signalled when a reactor parks and when the parked ones may resume
+    vector<Reactor *> reactors;  // never freed, auth workers may still hold a pointer to one
+    size_t parked = 0;
+};
+
+// Bump allocator for scratch memory needed while one command is handled. reset() after each
+// command releases everything at once and keeps at most one ARENA_BLOCK_SZ block, so the memory
+// of a session does not grow with the number of commands it sends.
+class Arena
+{
+public:
+    void *alloc(size_t n, size_t align = alignof(max_align_t))
+    {
+        size_t start = (used + align - 1) & ~(align - 1);
+        if (blocks.empty() || start + n > blocks.back().size)
+        {
+            size_t size = max(n, (size_t)ARENA_BLOCK_SZ); // oversized requests get a block of their own
+            blocks.push_back({unique_ptr<char[]>(new char[size]), size});
+            start = 0;
+        }
+        used = start + n;
+        return blocks.back().data.get() + start;
+    }
+
+    template <typename T>
+    T *alloc_array(size_t n) { return (T *)alloc(n * sizeof(T), alignof(T)); }
+
+    void reset()
+    {
+        if (!blocks.empty() && (blocks.size() > 1 || blocks[0].size > ARENA_BLOCK_SZ))
+        {
+            blocks.resize(1);
+            if (blocks[0].size > ARENA_BLOCK_SZ)
+            {
+                blocks.clear();
+            }
+        }
+        used = 0;
+    }
+
+private:
+    struct Block
+    {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+    vector<Block> blocks; // allocated lazily, the last one is being filled
+    size_t used = 0;      // bytes of the last block handed out
+};
+
+// TLS state of a connection. The SSL object reads from and writes to memory BIOs: the reactor feeds
+// it what it receives, the auth workers run the handshake and the sender worker encrypts and writes
+// what it produced. Only those threads touch the socket as before, none of them waits on another's I/O.
+struct TlsConn
+{
+    mutex mtx; // protects ssl, shared by the reactor, an auth worker and the sender of the socket
+    SSL *ssl = nullptr;
+
+    TlsConn() = default;
+    TlsConn(const TlsConn &) = delete;
+    TlsConn &operator=(const TlsConn &) = delete;
+    ~TlsConn() { SSL_free(ssl); }
+};
+
+struct Session
+{
+    int fd;             // client socket
+    Reactor *reactor;   // reactor serving this client
+    uint32_t addr;      // client IPv4 address (network byte order), logins are rate limited per address
+    SessionState state; // position in the login state machine
+    string username;    // valid once a username has been received
+    NameId user_id;     // interned username, valid once ACTIVE
+    bool framed;        // negotiated the binary framed protocol at login
+    FrameParser parser; // receive buffer, frames are parsed from it in framed mode
+    Arena arena;        // scratch memory of the command being handled
+    shared_ptr<TlsConn> tls; // nullptr for a plain TCP client
+    bool receiving = false;  // io_uring backend: a multishot receive of fd is in flight
+    bool ended = false;      // io_uring backend: end_session ran while receiving, the last completion frees it
+    bool input_closed = false; // io_uring backend: the input ended while it could not be handled
+    int input_error = 0;     // errno of the receive that ended the input, 0 if the client hung up
+    RateBucket bucket{};     // commands the session may send, only taken by its reactor
+    uint64_t delayed_until = 0; // while not 0, a command over a rate limit is held back until then (now_ns)
+    bool limited = false;    // the client was told that a command was dropped, until a command passes
+    uint32_t trace_id = 0;   // number of the session in the trace (-t), 0 if it is not traced
+    bool traced = false;     // the command held back by delay_session is in the trace already
+    deque<uint32_t> text_chunks{}; // io_uring backend, text mode: length of each buffered message, one per receive
+};
+
+// what happens to messages for a client whose socket is blocked and whose queue passed the high watermark
+enum SlowPolicy
+{
+    DROP_OLDEST, // drop the oldest unsent messages until the queue is down to the low watermark
+    DISCONNECT,  // drop the whole queue and disconnect the client
+    COALESCE     // queue nothing more until the low watermark, then one notice of how many messages were skipped
+};
+
+enum OutKind
+{
+    OUT_OPEN,   // start a fresh outbox for a newly accepted socket
+    OUT_DATA,   // message to write
+    OUT_FRAMED, // wrap every later message of the socket in an OP_TEXT frame
+    OUT_COMPRESS, // write the OP_COMPRESS acknowledgement, then compress every later message that shrinks
+    OUT_TLS,    // write what the TLS layer produced outside of a message (handshake, alerts)
+    OUT_CLOSE,  // close the socket once everything queued before is written
+    OUT_RESTORE, // OUT_OPEN of a socket taken over in a hot upgrade, data is the output it had queued
+    OUT_EXPORT  // hand the outbox of every plain TCP socket to a hot upgrade and forget it, fd is the worker's index
+};
+
+// immutable message buffer, a fan-out queues the same buffer for every recipient
+// and it is freed once the last of them has written it
+typedef shared_ptr<const string> Payload;
+
+// compressed form of a fan-out's payload, made by the first sender worker that has a compressing
+// recipient and reused by the others, so a message is compressed once however many clients get it
+struct DeflateCache
+{
+    once_flag once;
+    Payload data; // nullptr if compression does not make the message smaller
+};
+
+// one message (or control request) handed to a sender worker
+struct OutMsg
+{
+    int fd;
+    Payload data; // nullptr for control requests
+    OutKind kind;
+    shared_ptr<QueueStats> stats; // OUT_OPEN and OUT_RESTORE, where the worker publishes the queue of fd
+    shared_ptr<TlsConn> tls;      // OUT_OPEN of a TLS socket
+    shared_ptr<DeflateCache> deflated; // fan-out messages, shared by all their recipients
+};
+
+// a queued message, framed ones are written with a frame header in front
+struct Pending
+{
+    Payload data;
+    uint8_t opcode; // opcode of the frame header, 0 for a message of a text mode client
+};
+
+// state of one socket, only touched by the sender worker owning the socket
+struct Outbox
+{
+    deque<Pending> pending; // messages in FIFO order
+    size_t offset = 0;     // bytes of pending.front() (frame header included) already written
+    bool blocked = false;  // socket buffer full, waiting for EPOLLOUT
+    bool failed = false;   // write error, later messages are dropped until the socket is closed
+    bool framed = false;   // client negotiated the framed protocol, applies to messages queued later
+    bool deflate = false;  // client negotiated compression, applies to messages queued later
+    size_t bytes = 0;      // unwritten bytes of pending (frame headers included)
+    bool coalescing = false; // COALESCE policy: over the high watermark, new messages are skipped
+    uint64_t skipped = 0;  // messages skipped since coalescing started
+    shared_ptr<QueueStats> stats;
+    shared_ptr<TlsConn> tls; // TLS socket: pending is plaintext, sealed into records when written
+    string sealed;           // ciphertext not written yet
+    size_t sealed_off = 0;   // bytes of sealed already written
+    bool sending = false;    // io_uring backend: in the submission being written, a socket is touched twice by some batches
+};
+
+// login waiting for an auth worker, holds copies so the session's receive buffer can move on
+struct AuthRequest
+{
+    Session *session; // left alone by the reactor until the verdict is back
+    Reactor *reactor; // reactor of the session
+    string username;
+    string password;
+    shared_ptr<TlsConn> tls; // set for a TLS handshake step in place of a password check
+};
+
+struct AuthQueue
+{
+    mutex mtx;                    // protects requests
+    condition_variable not_empty; // signalled when a login is queued
+    deque<AuthRequest> requests;  // admission queue, at most AUTH_QUEUE_SZ logins
+};
+
+enum LogOp
+{
+    LOG_GROUP,   // append a group message to the group's stream
+    LOG_OFFLINE, // append a private message to the inbox of an offline user
+    LOG_REPLAY,  // deliver the inbox of a user who logged in
+    LOG_HISTORY, // send the last messages of a group
+    LOG_STOP     // close every stream and end the log thread once the requests before are done
+};
+
+// work for the log thread, replies go to client_sock only while user is still logged in on it
+struct LogRequest
+{
+    LogOp op;
+    string stream;       // directory of the stream in log_dir
+    Payload message;     // record to append
+    int client_sock;
+    NameId user;
+    NameId recipient;    // owner of the inbox of LOG_OFFLINE
+    size_t count;        // messages asked for by LOG_HISTORY
+    bool stored = false; // set by the log thread once the record is written
+};
+
+struct LogQueue
+{
+    mutex mtx;                    // protects requests
+    condition_variable not_empty; // signalled when a request is queued
+    deque<LogRequest> requests;   // at most LOG_QUEUE_SZ appends, replays are always accepted
+    bool running = true;          // false once the log thread ended on LOG_STOP
+    condition_variable ended;     // signalled when it does
+};
+
+// frames exchanged by the nodes of a cluster, payload fields are separated by a space and the last one
+// is the rest of the payload
+enum PeerOp : uint8_t
+{
+    PEER_HELLO = 64,   // first frame of a link, the sender's cluster port
+    PEER_USER_UP,      // <user> logged in on the sender
+    PEER_USER_DOWN,    // <user> logged out of the sender
+    PEER_MSG,          // <recipient> <text>, a private message for a user of the receiver
+    PEER_GROUP_MSG,    // <group> <0|1 logged> <text>, for the receiver's members of a group
+    PEER_BROADCAST,    // <text>, for every user of the receiver
+    PEER_CREATE_GROUP, // <group> [<creator>]
+    PEER_JOIN_GROUP,   // <group or pattern> <user>
+    PEER_LEAVE_GROUP,  // <group or pattern> <user>
+    PEER_PRESENCE      // <group> <milliseconds>, the presence window of a group
+};
+
+// link to another node of the cluster. Any thread queues frames, the link's thread writes them in
+// batches. Each node dials every other one, so a link only carries frames in one direction.
+struct PeerLink
+{
+    string name;                  // "<ip>:<port>" as given with -N
+    struct sockaddr_in addr;      // cluster port of the node
+    mutex mtx;                    // protects queue, up and inbound
+    condition_variable not_empty; // signalled when a frame is queued
+    vector<string> queue;         // encoded frames waiting to be written
+    bool up = false;              // connected, frames are not queued while the link is down
+    uint64_t inbound = 0;         // generation of the connection the node dialled to us
+};
+
+// users logged in on other nodes, sharded by ID like userToSocket
+struct RemoteShard
+{
+    shared_mutex lock;
+    unordered_map<NameId, int> nodes; // user -> index of their node in peers
+};
+
+// an open stream of the log thread
+struct OpenStream
+{
+    unique_ptr<LogStream> stream;
+    uint64_t last_use; // batch that last touched the stream
+};
+
+// join and leave notices of one scope, the whole chat or a group, collected until their digest is due
+struct PresenceBatch
+{
+    chrono::steady_clock::time_point due; // end of the window, counted from the first notice
+    unordered_map<NameId, bool> events;   // user -> joined (true) or left, a join and a leave cancel out
+    vector<NameId> order;                 // users in order of their first notice, some may have cancelled out
+};
+
+struct PresenceQueue
+{
+    mutex mtx;                                    // protects batches and windows
+    condition_variable changed;                   // signalled when a batch is started
+    unordered_map<NameId, PresenceBatch> batches; // scope -> its batch, NO_NAME is the whole chat
+    unordered_map<NameId, int> windows;           // group -> milliseconds set with /presence
+};
+
+// login attempts left to one client address, a token bucket refilled at login_rate per second
+struct LoginBucket
+{
+    double tokens;
+    chrono::steady_clock::time_point last; // time of the last refill
+};
+
+struct LoginShard
+{
+    mutex mtx;
+    unordered_map<uint32_t, LoginBucket> buckets; // client address -> its bucket
+    size_t prune_at = LOGIN_SHARD_MAX;            // number of buckets at which full ones are dropped
+};
+
+// the trace of -t. Every thread handling commands appends to a ring of its own, the trace thread
+// writes what they hold to the file every TRACE_FLUSH_MS.
+struct TraceState
+{
+    int fd = -1;                  // trace file, -1 if there is no trace
+    uint64_t start = 0;           // now_ns() when the trace started, record times count from it
+    atomic<uint32_t> sessions{0}; // sessions numbered so far
+    mutex mtx;                    // protects rings, and is held while the rings are written out
+    vector<TraceRing *> rings;    // ring of every thread that traced, never freed
+};
+
+// messages of a hot upgrade, the old process sends them to the new one over the control socket (-U).
+// Each is a frame (framing.h) in a SOCK_SEQPACKET message, a socket it names travels with it (SCM_RIGHTS).
+// Fields are a u32 (big endian) or a string with its u32 length in front.
+enum HandoffOp : uint8_t
+{
+    HANDOFF_LISTENER = 96, // <kind>, a listening socket
+    HANDOFF_TICKET_KEYS,   // the session ticket keys, tickets issued by the old process stay valid
+    HANDOFF_GROUP,         // <group or pattern> <member>..., a long member list is split into several messages
+    HANDOFF_SESSION,       // <state> <framed> <deflate> <addr> <username>, a client socket
+    HANDOFF_INPUT,         // input of the last session that was received but not handled yet
+    HANDOFF_OUTPUT,        // output queued for the last session, frame headers included
+    HANDOFF_END,           // <sessions>, everything was sent
+    HANDOFF_READY,         // new to old, the new process serves the sessions now
+    HANDOFF_PRESENCE,      // <group> <milliseconds>, the presence window of a group
+    HANDOFF_LOCK           // the lock file of log_dir, the new process holds it from then on
+};
+
+enum ListenerKind
+{
+    LISTEN_CLIENT,
+    LISTEN_PEER,
+    LISTEN_METRICS
+};
+
+// output queued for a plain TCP socket, taken out of its sender for a hot upgrade
+struct ExportedBox
+{
+    string bytes; // unwritten bytes, frame headers included
+    bool framed;
+    bool deflate;
+};
+
+struct HandoffState
+{
+    mutex mtx;                             // protects workers and boxes
+    condition_variable exported;           // signalled by every sender that handled OUT_EXPORT
+    int workers = 0;                       // senders that handled it
+    unordered_map<int, ExportedBox> boxes; // socket -> what it had queued
+};
+
+// what the new process of a hot upgrade received, the sessions are registered with the reactors later
+struct Takeover
+{
+    int conn = -1;             // control connection to the old process, -1 if there was none
+    vector<int> clients;       // client listeners, one per reactor of the old process
+    int peer = -1;             // cluster listener
+    int metrics = -1;          // metrics listener
+    int lock = -1;             // lock file of the old process's log_dir
+    vector<Session *> sessions;
+    vector<ExportedBox> outputs; // what the old process had queued for each session
+};
+
+// the buffers of one write of an outbox, frame headers are written from headers
+struct Gather
+{
+    struct iovec iov[2 * MAX_IOV];
+    unsigned char headers[MAX_IOV][FRAME_HDR_SZ];
+    int count = 0; // iovecs used
+};
+
+// one socket's sendmsg in an io_uring submission of a sender worker
+struct SendSlot
+{
+    int fd;
+    Gather gather;
+    struct msghdr msg;
+    int result; // bytes written or -errno
+};
+
+// sender worker, owns every socket with fd % num_senders == its index
+struct SenderWorker
+{
+    mutex mtx;                          // protects queue
+    condition_variable not_full;        // signalled when queue drains
+    vector<OutMsg> queue;               // bounded inbox filled by send_message
+    atomic<bool> busy{false};           // set with the lock held while a batch taken from queue is handled
+    int event_fd;                       // wakes the worker when queue becomes non-empty
+    int epoll_fd;                       // EPOLLOUT of blocked sockets and event_fd
+    unordered_map<int, Outbox> outboxes; // pending data per socket
+    Uring *ring = nullptr;              // io_uring backend: writes the sockets of a batch, nullptr with epoll
+    vector<SendSlot> slots;             // io_uring backend: one per submission queue entry
+};
+
+vector<int> listen_fds;  // server sockets, one per reactor (SO_REUSEPORT)
+int num_reactors = 1;    // number of epoll reactor threads
+ReactorControl reactor_control;    // the reactors, paused by a shutdown or a hot upgrade
+mutex lifecycle_lock;              // held by a shutdown or a hot upgrade, one of them runs at a time
+AuthQueue auth_queue;              // logins waiting for the auth workers
+int num_auth = 1;                  // number of auth worker threads
+double login_rate = LOGIN_RATE;    // set with -l, 0 disables the limit
+LoginShard login_limits[NUM_SHARDS]; // login token buckets, sharded by client address
+RateLimit command_limit = {COMMAND_RATE, COMMAND_BURST}; // set with -c, per session
+RateLimit group_limit = {GROUP_RATE, GROUP_BURST};       // set with -g, per group
+RateLimit fanout_limit = {0, 0};   // set with -b, deliveries per second of all fan-outs, 0 disables the budget
+RateBucket fanout_budget;          // deliveries left to the fan-outs of all reactors
+RatePenalty rate_penalty = PENALTY_DROP; // set with -e
+atomic<size_t> online_users{0};    // users logged in on this node, the size of a broadcast
+vector<SenderWorker *> senders; // fixed pool delivering all outgoing messages
+int num_senders = 1;            // number of sender worker threads
+size_t high_watermark = HIGH_WATERMARK; // set with -H
+size_t low_watermark = LOW_WATERMARK;   // set with -L
+SlowPolicy slow_policy = COALESCE;      // set with -p
+atomic<uint64_t> bytes_copied{0};     // message bytes copied into a new Payload
+atomic<uint64_t> bytes_referenced{0}; // message bytes queued for a recipient by sharing a Payload
+mutex metrics_lock;                     // protects thread_metrics
+vector<ThreadMetrics *> thread_metrics; // counters of every thread that recorded any, never freed
+int metrics_port = 0;                   // set with -M, 0 disables the metrics endpoint
+int client_port = PORT;                 // set with -P
+int cluster_port = 0;                   // set with -C, 0 runs a single node
+vector<PeerLink *> peers;               // other nodes of the cluster, set with -N
+RemoteShard remote_users[NUM_SHARDS];   // directory of the users of other nodes, sharded by ID
+LogQueue log_queue;                     // requests waiting for the log thread
+string log_dir = LOG_DIR;               // set with -d
+int log_lock_fd = -1;                   // log_dir/server.lock, locked while this process may write the log
+SSL_CTX *tls_ctx = nullptr;             // set with -T and -K, nullptr serves plain TCP
+unordered_map<string, OpenStream> log_streams; // open streams by directory, only touched by the log thread
+string control_path;                    // set with -U, the unix socket a new process takes over from
+HandoffState handoff;                   // outboxes exported for a hot upgrade
+int peer_listen_fd = -1;                // cluster listener, handed over in a hot upgrade
+int metrics_listen_fd = -1;             // metrics listener, handed over in a hot upgrade
+PresenceQueue presence;                 // join and leave notices waiting for their digest
+int presence_window = PRESENCE_WINDOW_MS; // set with -w, 0 sends every notice at once
+IoBackend io_backend = IO_EPOLL;        // set with -B, epoll if the kernel has no usable io_uring
+TraceState trace_state;                 // set with -t
+
+// Helper functions
+bool isEmpty(string_view str);
+string_view first_word(string_view message);
+string_view text_of(string_view data);
+string join_lines(const string_view *lines, size_t count, const char *prefix, const char *suffix);
+void send_message(int client_sock, string message);
+Payload make_payload(string message);
+void send_payload(int client_sock, const Payload &payload, const shared_ptr<DeflateCache> &deflated);
+void open_client(int client_sock, shared_ptr<QueueStats> stats, shared_ptr<TlsConn> tls);
+void close_client(int client_sock);
+void set_framed(int client_sock);
+void set_compressed(int client_sock, string method);
+bool group_mssg(string message, NameId group, int client_fd, bool logged = false);
+void private_mssg(string message, int recv_fd);
+void broadcast(string message, int broadcast_fd);
+string concat(initializer_list<string_view> parts);
+
+// Registry functions, safe to call from any thread
+NameId intern(NameTable &table, string_view name);                              // ID of a name, assigned on first use, NO_NAME if the table is full
+NameId lookup(NameTable &table, string_view name);                              // ID of a name, NO_NAME if it was never interned
+const string &name_of(NameTable &table, NameId id);                             // name of an interned ID
+size_t shard_of(NameId id);                                                     // shard index of a user or group
+void add_client(int client_sock, shared_ptr<QueueStats> stats);                 // registers a connected socket
+void remove_client(int client_sock);                                            // unregisters a socket
+shared_ptr<QueueStats> find_client(int client_sock);                            // queue stats of a connected socket, nullptr if not connected
+void add_user(NameId user, int client_sock);                                    // marks a user as logged in on client_sock
+void remove_user(NameId user, int client_sock);                                 // logs a user out unless it logged in again elsewhere
+int find_user(NameId user);                                                     // socket of a logged in user, -1 if not logged in
+shared_ptr<const UserList> user_snapshot(UserShard &shard);                     // current users of a shard
+GroupStatus create_group(string_view group_name, NameId creator);               // creator is the first member, none if NO_NAME
+GroupStatus join_group(NameId group, NameId user);
+GroupStatus leave_group(NameId group, NameId user);
+shared_ptr<const MemberList> group_snapshot(NameId group);                      // current members, nullptr if no such group
+vector<NameId> leave_all_groups(NameId user);                                   // removes a user from every group and pattern, returns those groups
+bool is_pattern(string_view name);                                              // true if a name has a wildcard
+GroupStatus subscribe(string_view pattern, NameId user);                        // adds a wildcard subscription
+GroupStatus unsubscribe(string_view pattern, NameId user);
+shared_ptr<const MemberList> topic_subscribers(NameId group);                   // users with a pattern matching a group, nullptr if none
+bool valid_pattern(string_view pattern);                                        // false if a wildcard is not a whole level or '#' not the last
+GroupStatus change_subscription(string_view pattern, NameId user, bool add);    // subscribe and unsubscribe
+bool update_pattern(TopicNode &node, string_view pattern, NameId user, bool add); // adds or removes a subscriber below node, false if nothing changed
+bool update_members(shared_ptr<const MemberList> &slot, NameId user, bool add); // publishes a copy of a subscriber list with or without user
+void match_topic(const TopicNode &node, string_view topic, vector<shared_ptr<const MemberList>> &found); // subscriber lists of the patterns matching topic
+
+// Credential functions
+shared_ptr<const CredStore> load_credentials();                                 // maps CRED_FILE, or hashes USERS_FILE if there is none, nullptr on error
+
+// Cluster functions
+bool add_peer(const char *address);                                             // adds a node given as <ip>:<port>, false if malformed
+int create_peer_listener();                                                     // binds the cluster port
+void start_cluster(int listen_fd);                                              // dials every peer and accepts their links
+void peer_accept_loop(int listen_fd);                                           // accepts the links of other nodes
+void peer_read_loop(int fd, in_addr_t from);                                    // applies the frames of one incoming link
+void peer_link_loop(PeerLink *link);                                            // keeps the outgoing link to a node connected and writes its frames
+bool write_frames(int fd, const vector<string> &frames);                        // writes frames with as few system calls as possible
+vector<string> peer_snapshot();                                                 // frames that bring a node up to date with this one
+void apply_peer_frame(int node, const Frame &frame);                            // applies a frame received from a node
+void peer_send(int node, uint8_t op, string_view payload);                      // queues a frame for one node, dropped while its link is down
+void peer_send_all(uint8_t op, string_view payload);                            // queues a frame for every node
+int find_remote(NameId user);                                                   // node of a user logged in elsewhere, -1 if none
+void forget_node(int node);                                                     // logs out every user of a node whose link was lost
+
+// Log functions
+string stream_dir(char kind, string_view name);                                 // stream directory of a group ('g') or inbox ('u')
+bool submit_log(LogRequest request);                                            // queues work for the log thread, false if the queue is full
+void log_loop();                                                                // appends, syncs and reads the message log
+LogStream *log_stream(const string &dir, bool create);                          // open stream of a directory, nullptr if it cannot be opened
+void log_reply(const LogRequest &request, string message);                      // answers a request if its client is still connected
+void deliver_inbox(LogStream &inbox, int client_sock);                          // sends the undelivered messages of an inbox
+void send_history(const LogRequest &request);                                   // sends the last messages of a group stream
+string log_line(string_view message, int64_t time);                             // a logged message with the time it was sent
+
+// Presence functions
+void notify_presence(NameId scope, NameId user, bool joined, int client_fd);    // announces a join or leave of the chat (NO_NAME) or a group
+void presence_loop();                                                           // sends the digests of the batches whose window ended
+void send_digest(NameId scope, PresenceBatch &batch);                           // sends one batch, a copy without their name to the users it names
+string presence_digest(NameId scope, const vector<NameId> &joined, const vector<NameId> &left, NameId skip); // text of a digest, empty if only skip is in it
+string name_list(const vector<NameId> &users, NameId skip, size_t &count);      // "alice, bob and 3 others", count is set to the users listed or counted
+int presence_window_of(NameId scope);                                           // window of a scope in milliseconds, presence.mtx must be held
+void set_presence_window(NameId group, int window_ms);
+
+// TLS functions
+SSL_CTX *create_tls_context(const char *cert_file, const char *key_file);       // server context issuing session tickets, nullptr on error
+shared_ptr<TlsConn> new_tls_conn();                                             // TLS state of an accepted socket, nullptr on error
+ssize_t tls_recv(Session &session, char *buf, size_t len);                      // decrypted input of a TLS client, recv semantics
+bool submit_handshake(Session &session);                                        // queues a handshake step for the auth workers, false if the queue is full
+bool handshake_step(AuthRequest &request);                                      // runs a handshake step on an auth worker, false if it failed
+void send_tls_output(int client_sock);                                          // has the sender write what the TLS layer produced
+bool flush_tls(SenderWorker *worker, int client_sock, Outbox &box);             // flush_outbox of a TLS socket
+bool seal_records(Outbox &box);                                                 // encrypts pending messages, packed into as few records as fit
+
+// Metrics functions
+ThreadMetrics &my_metrics();                                                    // counters of the calling thread, registered on first use
+void bump(atomic<uint64_t> &counter, uint64_t n = 1);                           // adds to a counter of the calling thread
+void record(Histogram &hist, uint64_t value);                                   // adds a sample to a histogram of the calling thread
+uint64_t now_ns();                                                              // monotonic clock for the latency histograms
+size_t action_slot(uint8_t opcode);                                             // index of an action in the per-action metrics
+int create_metrics_listener();                                                  // binds the metrics endpoint to 127.0.0.1:metrics_port
+void metrics_loop(int listen_fd);                                               // answers scrapes of the metrics endpoint
+string render_metrics();                                                        // all metrics in the Prometheus text format
+
+// Reactor functions
+bool probe_port();                                                              // false if another process listens on client_port
+int create_listener();                                                          // creates a non-blocking server socket bound to client_port
+Reactor *create_reactor(int listen_fd);                                         // a reactor accepting on listen_fd, nullptr on error
+void reactor_loop(Reactor *reactor);                                            // epoll event loop serving the clients of a reactor
+void dispatch_events(Reactor *reactor, const struct epoll_event *events, int n); // handles a batch of the reactor's epoll events
+void settle_reactor(Reactor *reactor);                                          // applies the reactor's mode, waits there while it is parked
+void accept_clients(Reactor *reactor, int listen_fd);                           // accepts all pending connections on listen_fd
+void open_session(Reactor *reactor, int client_sock, uint32_t addr);            // starts serving an accepted client
+bool watch_session(Session *session);                                           // starts reading a session's socket, false on error
+void read_client(Session *session);                                             // drains a readable client socket
+void hang_up(Session *session, int error);                                      // ends a session whose input ended, error is 0 if the client hung up
+void end_session(Session *session);                                             // stops watching a client, its socket is closed after the queued messages
+bool probe_uring();                                                             // checks that the kernel has every io_uring feature the backend uses
+void ring_reactor_loop(Reactor *reactor);                                       // io_uring event loop serving the clients of a reactor
+void handle_completion(Reactor *reactor, const io_uring_cqe &cqe);              // applies one completion of the reactor's io_uring
+bool receive_data(Session *session, const char *data, size_t len, bool parked); // handles received bytes, false once the session ended
+bool arm_receive(Session *session);                                             // submits the multishot receive of a plain TCP session
+void stop_receiving(Reactor *reactor);                                          // cancels every receive before the reactor parks
+void resume_receiving(Reactor *reactor);                                        // re-arms the receives and handles what they buffered
+void poll_epoll(Reactor *reactor);                                              // handles the ready events of an io_uring reactor's epoll set
+bool process_input(Session &session);                                           // handles the buffered input, false once the client is gone
+
+// Lifecycle functions
+void signal_loop();                                                             // reloads the credentials on SIGHUP, shuts down on SIGINT and SIGTERM
+void shut_down(int sig);                                                        // stops accepting, drains the outbound queues and exits
+void set_reactor_mode(ReactorMode mode);                                        // switches every reactor, returns once all are parked for REACTOR_PARK
+bool wait_for_senders(int timeout_ms, bool outboxes);                           // waits until the senders took every message (and wrote every outbox)
+void stop_log();                                                                // ends the log thread once everything queued is written
+void start_log();                                                               // starts the log thread
+bool lock_log_dir();                                                            // takes the lock of log_dir, false if another process holds it
+bool adopt_log_lock(int fd);                                                    // keeps a handed over lock if it is the lock of log_dir, else closes it
+int adopt_listener(int fd, int port);                                           // a handed over listener if it is bound to port, else closes it and returns -1
+int create_control_listener();                                                  // binds control_path for the next hot upgrade
+void upgrade_loop(int listen_fd);                                               // hands the server to every new process that connects to control_path
+bool hand_off(int conn);                                                        // sends the listeners and sessions to a new process, false if it did not take them
+bool take_over(Takeover &taken);                                                // receives them from the process serving control_path, false on error
+void adopt_sessions(Takeover &taken);                                           // registers the sessions taken over and spreads them across the reactors
+void export_outboxes(SenderWorker *worker);                                     // hands the worker's plain TCP outboxes to a hot upgrade
+bool send_handoff(int conn, uint8_t op, string_view payload, int fd = -1);      // one handoff message, fd travels along if set
+bool recv_handoff(int conn, string &buf, Frame &frame, int &fd);                // the next handoff message, fd is -1 if none came along
+void put_u32(string &out, uint32_t value);                                      // appends a handoff field
+void put_str(string &out, string_view value);                                   // appends a length prefixed handoff field
+bool get_u32(string_view &in, uint32_t &value);                                 // takes a field off a handoff payload, false if it is truncated
+bool get_str(string_view &in, string_view &value);
+
+// Auth functions
+void start_auth_workers();                                                      // creates the auth worker pool
+void auth_loop();                                                               // verifies the passwords of queued logins and runs TLS handshakes
+bool allow_login(uint32_t addr);                                                // takes a login attempt from the bucket of addr, false if it is empty
+bool submit_login(Session &session, string_view passwd);                        // queues a login for the auth workers, false if the queue is full
+void finish_logins(Reactor *reactor);                                           // applies the verdicts of the auth workers on the reactor thread
+bool login(Session &session);                                                   // completes a verified login, false if the client is turned away
+
+// Rate limit functions
+uint64_t take_tokens(RateBucket &bucket, const RateLimit &limit, double cost);  // 0 if cost tokens were taken, else ns until they are there
+void return_tokens(RateBucket &bucket, const RateLimit &limit, double cost);    // gives back what take_tokens took for a command that did not run
+uint64_t take_group_tokens(NameId group);                                       // take_tokens of a group's bucket, 0 if there is no such group
+void return_group_tokens(NameId group);                                         // return_tokens of a group's bucket
+uint64_t rate_wait(Session &session, uint8_t opcode, string_view message, RateLimitKind &kind); // ns a command has to wait, 0 if it may run now
+bool rate_limited(Session &session, RateLimitKind kind, uint64_t wait);        // applies the penalty to a command over a limit, false if the client is gone
+void delay_session(Session *session, uint64_t until);                           // holds back a session's input until then
+void arm_timer(Reactor *reactor);                                               // sets the reactor's timer_fd to the first delayed session
+void resume_delayed(Reactor *reactor);                                          // handles the input of every delayed session whose time came
+
+// Trace functions
+bool start_trace(const char *path);                                             // creates the trace file and starts the trace thread, false on error
+TraceRing &my_trace_ring();                                                     // ring of the calling thread, registered on first use
+void trace(TraceKind kind, uint32_t session, uint8_t opcode, string_view payload); // appends a record, dropped if the ring is full
+void trace_login(Session &session);                                             // numbers a session that logged in and records its login
+void trace_loop();                                                              // writes the rings to the trace file every TRACE_FLUSH_MS
+void flush_trace();                                                             // writes what every ring holds to the trace file
+
+// Sender functions
+void start_senders();                                                           // creates the sender worker pool
+void sender_loop(SenderWorker *worker);                                         // delivers the messages queued for the worker's sockets
+void enqueue(int client_sock, Payload message, OutKind kind, shared_ptr<QueueStats> stats = nullptr,
+             shared_ptr<TlsConn> tls = nullptr, shared_ptr<DeflateCache> deflated = nullptr); // hands a message to the worker owning client_sock
+bool flush_outbox(SenderWorker *worker, int client_sock, Outbox &box);          // writes pending data, false if the socket failed
+void flush_batch(SenderWorker *worker, const vector<int> &touched);             // flush_outbox of many sockets with one io_uring submission
+int gather_outbox(const Outbox &box, Gather &gather);                           // the buffers of the next write of an outbox, returns the iovecs used
+void advance_outbox(Outbox &box, size_t written);                               // drops what a write took from an outbox
+void wait_writable(SenderWorker *worker, int client_sock, Outbox &box);         // parks a blocked socket until EPOLLOUT
+void catch_up(Outbox &box);                                                     // ends coalescing once the queue is down to the low watermark
+void queue_message(SenderWorker *worker, int client_sock, Outbox &box, Payload data,
+                   const shared_ptr<DeflateCache> &deflated);                   // appends to an outbox, applying the slow consumer policy
+Payload deflate_payload(const Payload &message, const shared_ptr<DeflateCache> &cache); // compressed form of a message, nullptr if it does not shrink
+void publish_stats(Outbox &box);                                                // updates the QueueStats of an outbox
+void fail_outbox(SenderWorker *worker, int client_sock, Outbox &box);           // gives up on a socket, its messages are dropped until it is closed
+
+// Handler functions
+bool client_handle(Session &session, string_view msg);                           // handles one text message of a client, false once the client is gone
+bool handle_frame(Session &session, Frame &frame);                              // handles one frame of a framed client, false once the client is gone
+bool handle_action(Session &session, uint8_t opcode, string_view message, bool has_args); // runs one chat action and records it
+bool run_action(Session &session, uint8_t opcode, string_view message, bool has_args);    // dispatches an action to its handler
+void handle_msg(string_view message, int client_fd, string &username, NameId user); // handles private messaging feature 
+void handle_broadcast(std::string &username, string_view message, int &client_fd); // handles broadcast messaging feature
+void handle_create_group(string_view message, int &client_fd, NameId user);     // handles creating a new group feature
+void handle_join_group(string_view message, int &client_fd, std::string &username, NameId user);  // handles join group feature
+void handle_leave_group(string_view message, int &client_fd, std::string &username, NameId user); // handles leave group feature
+void handle_group_msg(string_view message, int &client_fd, string &username);   // handles group messaging feature
+void handle_exit(string &username, NameId user, int &client_fd);                // handles client exit feature
+
+// Additional functions
+void handle_list_all_members(int &client_fd, Arena &arena);                     // lists all members active on the server
+void handle_list_all_groups(int &client_fd, Arena &arena);                      // lists all groups active on the server
+void handle_list_group_members(string_view message, int &client_fd, Arena &arena); // lists all active members of the requested group
+void handle_queue_stats(int &client_fd, Arena &arena);                          // lists the outbound queue of every member, deepest first
+void handle_history(string_view message, int &client_fd, NameId user);          // sends the last messages of a group
+void handle_presence(string_view message, int &client_fd, NameId user);         // shows or sets how long join and leave notices of a group are collected
+void handle_help(int &client_fd);                                               // prints a help message for usage 
+
+int main(int argc, char *argv[])
+{
+    signal(SIGPIPE, SIG_IGN); // writing to a client that reset its connection fails with EPIPE instead
+
+    // SIGHUP, SIGINT and SIGTERM are only taken by the signal thread with sigwait, the threads created
+    // later inherit the mask, so no handler ever runs on a thread that holds a lock
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    for (int sig : {SIGHUP, SIGINT, SIGTERM})
+    {
+        sigaddset(&sigs, sig);
+    }
+    pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+
+    // parse command line options
+    num_reactors = max(1u, thread::hardware_concurrency());
+    num_senders = num_reactors;
+    num_auth = max(1, num_reactors / 2);
+    const char *cert_file = nullptr; // -T and -K serve TLS
+    const char *key_file = nullptr;
+    const char *trace_file = nullptr; // -t records the commands received
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:a:l:M:d:P:C:N:T:K:H:L:p:U:w:B:c:g:b:e:t:")) != -1)
+    {
+        if (opt == 'r' && atoi(optarg) > 0)
+        {
+            num_reactors = atoi(optarg);
+        }
+        else if (opt == 's' && atoi(optarg) > 0)
+        {
+            num_senders = atoi(optarg);
+        }
+        else if (opt == 'a' && atoi(optarg) > 0)
+        {
+            num_auth = atoi(optarg);
+        }
+        else if (opt == 'l' && atof(optarg) >= 0)
+        {
+            login_rate = atof(optarg);
+        }
+        else if (opt == 'M' && atoi(optarg) > 0 && atoi(optarg) < 65536)
+        {
+            metrics_port = atoi(optarg);
+        }
+        else if (opt == 'd' && *optarg != '\0')
+        {
+            log_dir = optarg;
+        }
+        else if (opt == 'P' && atoi(optarg) > 0 && atoi(optarg) < 65536)
+        {
+            client_port = atoi(optarg);
+        }
+        else if (opt == 'C' && atoi(optarg) > 0 && atoi(optarg) < 65536)
+        {
+            cluster_port = atoi(optarg);
+        }
+        else if (opt == 'N' && add_peer(optarg))
+        {
+            continue;
+        }
+        else if (opt == 'T')
+        {
+            cert_file = optarg;
+        }
+        else if (opt == 'K')
+        {
+            key_file = optarg;
+        }
+        else if (opt == 'H' && atoll(optarg) > 0)
+        {
+            high_watermark = atoll(optarg);
+        }
+        else if (opt == 'L' && atoll(optarg) >= 0)
+        {
+            low_watermark = atoll(optarg);
+        }
+        else if (opt == 'p' && (string)optarg == "drop-oldest")
+        {
+            slow_policy = DROP_OLDEST;
+        }
+        else if (opt == 'p' && (string)optarg == "disconnect")
+        {
+            slow_policy = DISCONNECT;
+        }
+        else if (opt == 'p' && (string)optarg == "coalesce")
+        {
+            slow_policy = COALESCE;
+        }
+        else if (opt == 'U' && *optarg != '\0' && strlen(optarg) < sizeof(sockaddr_un::sun_path))
+        {
+            control_path = optarg;
+        }
+        else if (opt == 'w' && atoi(optarg) >= 0 && atoi(optarg) <= PRESENCE_MAX_MS)
+        {
+            presence_window = atoi(optarg);
+        }
+        else if (opt == 'B' && (string)optarg == "epoll")
+        {
+            io_backend = IO_EPOLL;
+        }
+        else if (opt == 'B' && (string)optarg == "uring")
+        {
+            io_backend = IO_URING;
+        }
+        else if (opt == 'c' && atof(optarg) >= 0)
+        {
+            command_limit = {atof(optarg), max((double)COMMAND_BURST, atof(optarg))};
+        }
+        else if (opt == 'g' && atof(optarg) >= 0)
+        {
+            group_limit = {atof(optarg), max((double)GROUP_BURST, atof(optarg))};
+        }
+        else if (opt == 'b' && atof(optarg) >= 0)
+        {
+            fanout_limit = {atof(optarg), atof(optarg)}; // a second's worth of deliveries at once
+        }
+        else if (opt == 'e' && (string)optarg == "delay")
+        {
+            rate_penalty = PENALTY_DELAY;
+        }
+        else if (opt == 'e' && (string)optarg == "drop")
+        {
+            rate_penalty = PENALTY_DROP;
+        }
+        else if (opt == 'e' && (string)optarg == "disconnect")
+        {
+            rate_penalty = PENALTY_DISCONNECT;
+        }
+        else if (opt == 't' && *optarg != '\0')
+        {
+            trace_file = optarg;
+        }
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [-r <reactor threads>] [-s <sender threads>] [-a <auth threads>]"
+                 << " [-l <logins per second per address>] [-M <metrics port>] [-d <log directory>]"
+                 << " [-P <client port>] [-C <cluster port> -N <ip:cluster port of another node>...]"
+                 << " [-T <certificate file> -K <key file>]"
+                 << " [-H <high watermark bytes>] [-L <low watermark bytes>] [-p drop-oldest|disconnect|coalesce]"
+                 << " [-U <control socket>] [-w <presence window ms>] [-B epoll|uring]"
+                 << " [-c <commands per second per session>] [-g <messages per second per group>]"
+                 << " [-b <deliveries per second>] [-e delay|drop|disconnect] [-t <trace file>]\n";
+            return 1;
+        }
+    }
+    low_watermark = min(low_watermark, high_watermark);
+    if (!peers.empty() && cluster_port == 0)
+    {
+        cerr << "Error : -N needs a cluster port (-C) that the other nodes dial.\n";
+        return 1;
+    }
+    if ((cert_file == nullptr) != (key_file == nullptr))
+    {
+        cerr << "Error : TLS needs both a certificate (-T) and its private key (-K).\n";
+        return 1;
+    }
+    if (cert_file != nullptr && (tls_ctx = create_tls_context(cert_file, key_file)) == nullptr)
+    {
+        return 1;
+    }
+    if (io_backend == IO_URING && !probe_uring())
+    {
+        cerr << "Notice : io_uring is not usable here (" << strerror(errno) << "), serving with epoll.\n";
+        io_backend = IO_EPOLL;
+    }
+
+    // load the credentials, a SIGHUP loads them again
+    credentials = load_credentials();
+    if (credentials == nullptr)
+    {
+        return 1;
+    }
+    thread signal_thread(signal_loop);
+    signal_thread.detach();
+
+    // message log for group history and offline delivery, written by a thread of its own
+    if (mkdir(log_dir.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        perror(("Error creating " + log_dir).c_str());
+        return 1;
+    }
+
+    // one process writes a log_dir and listens on a port, a hot upgrade is handed both by the process it takes
+    // over from. These checks come before the threads start, returning from main later waits on them forever.
+    if (!lock_log_dir() && control_path.empty())
+    {
+        cerr << "Error : another server writes the message log in " << log_dir << ".\n";
+        return 1;
+    }
+    if (control_path.empty() && !probe_port())
+    {
+        return 1;
+    }
+    start_log();
+    if (trace_file != nullptr && !start_trace(trace_file))
+    {
+        return 1;
+    }
+    thread presence_thread(presence_loop);
+    presence_thread.detach();
+
+    start_senders();
+    start_auth_workers();
+
+    // a hot upgrade takes the listeners and sessions of the process serving control_path
+    Takeover taken;
+    if (!control_path.empty() && !take_over(taken))
+    {
+        return 1;
+    }
+    if (log_lock_fd >= 0 && taken.lock >= 0)
+    {
+        close(taken.lock); // the old process wrote another log_dir
+    }
+    else if (log_lock_fd < 0 && !adopt_log_lock(taken.lock))
+    {
+        cerr << "Error : another server writes the message log in " << log_dir << ".\n";
+        _exit(1);
+    }
+    metrics_listen_fd = adopt_listener(taken.metrics, metrics_port);
+    if (metrics_port > 0)
+    {
+        if (metrics_listen_fd < 0 && (metrics_listen_fd = create_metrics_listener()) < 0)
+        {
+            return 1;
+        }
+        thread metrics_thread(metrics_loop, metrics_listen_fd);
+        metrics_thread.detach();
+    }
+    peer_listen_fd = adopt_listener(taken.peer, cluster_port);
+    if (cluster_port > 0)
+    {
+        if (peer_listen_fd < 0 && (peer_listen_fd = create_peer_listener()) < 0)
+        {
+            return 1;
+        }
+        start_cluster(peer_listen_fd);
+    }
+
+    // one listening socket per reactor, the kernel spreads new connections across them. Every listener of
+    // an old process is kept, a socket in the port's SO_REUSEPORT group that nobody accepts on strands clients
+    for (int fd : taken.clients)
+    {
+        if ((fd = adopt_listener(fd, client_port)) >= 0)
+        {
+            listen_fds.push_back(fd);
+        }
+    }
+    num_reactors = max(num_reactors, (int)listen_fds.size());
+    if (listen_fds.empty() && !control_path.empty() && !probe_port())
+    {
+        _exit(1); // nobody handed the port over
+    }
+    while ((int)listen_fds.size() < num_reactors)
+    {
+        int fd = create_listener();
+        if (fd < 0)
+        {
+            for (int open_fd : listen_fds)
+            {
+                close(open_fd);
+            }
+            return 0;
+        }
+        listen_fds.push_back(fd);
+    }
+    for (int fd : listen_fds)
+    {
+        Reactor *reactor = create_reactor(fd);
+        if (reactor == nullptr)
+        {
+            return 1;
+        }
+        lock_guard<mutex> lock(reactor_control.mtx);
+        reactor_control.reactors.push_back(reactor);
+    }
+
+    // the old process exits once it hears that this one is ready, if it gave up meanwhile it serves on
+    if (taken.conn >= 0)
+    {
+        string buf;
+        Frame frame;
+        int fd;
+        if (!send_handoff(taken.conn, HANDOFF_READY, "") || !recv_handoff(taken.conn, buf, frame, fd) ||
+            frame.opcode != HANDOFF_READY)
+        {
+            cerr << "Error : the old process did not hand over, it keeps serving.\n";
+            return 1;
+        }
+        close(taken.conn);
+        adopt_sessions(taken);
+    }
+    if (!control_path.empty())
+    {
+        int control_fd = create_control_listener();
+        if (control_fd < 0)
+        {
+            return 1;
+        }
+        thread upgrade_thread(upgrade_loop, control_fd);
+        upgrade_thread.detach();
+    }
+    cout << "\033[32m" << (tls_ctx != nullptr ? "TLS" : "TCP") << " server listing on PORT : \033[93m" << client_port
+         << "\033[0m (" << num_reactors << " reactor" << (num_reactors > 1 ? "s" : "")
+         << (io_backend == IO_URING ? ", io_uring" : "") << ")" << endl;
+
+    // the main thread runs the first reactor
+    for (int i = 1; i < num_reactors; i++)
+    {
+        thread reactor_thread(reactor_loop, reactor_control.reactors[i]);
+        reactor_thread.detach();
+    }
+    reactor_loop(reactor_control.reactors[0]);
+    return 0;
+}
+
+bool probe_port()
+{
+    // the reactors' sockets share client_port through SO_REUSEPORT, so would another server's. A socket
+    // without it fails to bind while anyone listens on the port, like the single listener of old.
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    {
+        perror("Socket creation failed.");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(client_port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    bool free = bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0;
+    if (!free)
+    {
+        perror("Socket binding error.");
+    }
+    close(fd);
+    return free;
+}
+
+int create_listener()
+{
+    // creating server socket
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("Socket creation failed.");
+        return -1;
+    }
+
+    // setting socket options, SO_REUSEPORT lets every reactor bind its own socket to client_port
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        perror("setsockopt failed");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(client_port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    // binding socket to port
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Socket binding error.");
+        close(fd);
+        return -1;
+    }
+
+    // listening on server socket
+    if (listen(fd, SOMAXCONN) < 0)
+    {
+        perror("listing failed.");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+Reactor *create_reactor(int listen_fd)
+{
+    // never freed, auth workers may still hold a pointer to it
+    Reactor *reactor = new Reactor();
+    reactor->listen_fd = listen_fd;
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reactor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC); // the clock of now_ns
+    if (reactor->epoll_fd < 0 || reactor->event_fd < 0 || reactor->timer_fd < 0)
+    {
+        perror("Reactor creation failed");
+        return nullptr;
+    }
+
+    // the listener is added by settle_reactor once the reactor runs
+    struct epoll_event auth_ev = {};
+    auth_ev.events = EPOLLIN;
+    auth_ev.data.ptr = reactor;
+    struct epoll_event timer_ev = {};
+    timer_ev.events = EPOLLIN;
+    timer_ev.data.ptr = &reactor->timer_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &auth_ev) < 0 ||
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &timer_ev) < 0)
+    {
+        perror("epoll_ctl failed");
+        return nullptr;
+    }
+    if (io_backend == IO_URING)
+    {
+        reactor->ring = new Uring();
+        if (!reactor->ring->init(URING_ENTRIES) || !reactor->ring->setup_buffers(0, URING_BUFS, URING_BUF_SZ))
+        {
+            perror("io_uring setup failed");
+            return nullptr;
+        }
+    }
+    return reactor;
+}
+
+void reactor_loop(Reactor *reactor)
+{
+    int epoll_fd = reactor->epoll_fd;
+
+    // sessions taken over in a hot upgrade may have brought input that the old process did not handle
+    vector<Session *> taken(reactor->sessions.begin(), reactor->sessions.end());
+    for (Session *session : taken)
+    {
+        if (session->parser.buffer().size() > 0 && !process_input(*session))
+        {
+            end_session(session);
+        }
+    }
+    if (reactor->ring != nullptr)
+    {
+        ring_reactor_loop(reactor);
+        return;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        if (reactor->mode != REACTOR_RUN || !reactor->accepting)
+        {
+            settle_reactor(reactor);
+        }
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        bump(my_metrics().io_calls[0]);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+        dispatch_events(reactor, events, n);
+    }
+    close(epoll_fd);
+}
+
+void dispatch_events(Reactor *reactor, const struct epoll_event *events, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (events[i].data.ptr == nullptr)
+        {
+            accept_clients(reactor, reactor->listen_fd);
+        }
+        else if (events[i].data.ptr == reactor)
+        {
+            finish_logins(reactor);
+        }
+        else if (events[i].data.ptr == &reactor->timer_fd)
+        {
+            resume_delayed(reactor);
+        }
+        else if (reactor->sessions.count((Session *)events[i].data.ptr) != 0)
+        {
+            // an earlier event of the batch may have ended the session, finish_logins handling the
+            // commands pipelined behind its password
+            read_client((Session *)events[i].data.ptr);
+        }
+    }
+}
+
+void settle_reactor(Reactor *reactor)
+{
+    while (1)
+    {
+        // the listener is only watched while the reactor runs, level-triggered so a failed accept is
+        // retried on the next wakeup. With io_uring a multishot accept takes its place, re-armed here
+        // when it ends by itself
+        ReactorMode mode = reactor->mode;
+        bool accepting = mode == REACTOR_RUN;
+        if (accepting != reactor->accepting && reactor->ring != nullptr)
+        {
+            // a cancelled accept has to end before the next one is armed
+            io_uring_sqe *sqe = (!accepting || reactor->accepts == 0) ? reactor->ring->get_sqe() : nullptr;
+            if (sqe != nullptr && accepting)
+            {
+                Uring::prep_multishot_accept(sqe, reactor->listen_fd, RING_ACCEPT);
+                reactor->accepts++;
+            }
+            else if (sqe != nullptr)
+            {
+                Uring::prep_cancel(sqe, RING_ACCEPT, RING_CANCEL);
+            }
+            reactor->accepting = accepting;
+        }
+        else if (accepting != reactor->accepting)
+        {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = nullptr;
+            if (epoll_ctl(reactor->epoll_fd, accepting ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, reactor->listen_fd, &ev) < 0)
+            {
+                perror("epoll_ctl failed");
+            }
+            reactor->accepting = accepting;
+        }
+        if (reactor->ring != nullptr && !reactor->polling)
+        {
+            if (io_uring_sqe *sqe = reactor->ring->get_sqe())
+            {
+                Uring::prep_multishot_poll(sqe, reactor->epoll_fd, RING_POLL);
+                reactor->polling = true;
+            }
+        }
+        if (mode != REACTOR_PARK)
+        {
+            return;
+        }
+
+        // parked between two batches of events, nothing of this reactor is touched until it resumes
+        if (reactor->ring != nullptr)
+        {
+            stop_receiving(reactor);
+        }
+        unique_lock<mutex> lock(reactor_control.mtx);
+        reactor_control.parked++;
+        reactor_control.changed.notify_all();
+        reactor_control.changed.wait(lock, [reactor] { return reactor->mode != REACTOR_PARK; });
+        reactor_control.parked--;
+        lock.unlock();
+        if (reactor->ring != nullptr)
+        {
+            resume_receiving(reactor);
+        }
+    }
+}
+
+void accept_clients(Reactor *reactor, int listen_fd)
+{
+    // accepting multiple clients
+    while (1)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_sock = accept4(listen_fd, (struct sockaddr *)(&client_addr), &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        bump(my_metrics().io_calls[0]);
+        if (client_sock < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("Connection failed!");
+            }
+            return;
+        }
+        open_session(reactor, client_sock, client_addr.sin_addr.s_addr);
+    }
+}
+
+void open_session(Reactor *reactor, int client_sock, uint32_t addr)
+{
+    shared_ptr<TlsConn> tls = (tls_ctx != nullptr) ? new_tls_conn() : nullptr;
+    if (tls_ctx != nullptr && tls == nullptr)
+    {
+        close(client_sock);
+        return;
+    }
+    Session *session = new Session{client_sock, reactor, addr, AWAIT_USERNAME, "", NO_NAME,
+                                   false, FrameParser(), Arena(), tls};
+
+    auto stats = make_shared<QueueStats>();
+    add_client(client_sock, stats);
+    open_client(client_sock, move(stats), move(tls));
+
+    // a TLS client gets the welcome once its handshake is done
+    send_message(client_sock, "Welcome to Shadow Room!\nEnter your username: ");
+    if (!watch_session(session))
+    {
+        perror("epoll_ctl failed");
+        remove_client(client_sock);
+        close_client(client_sock);
+        delete session;
+        return;
+    }
+    reactor->sessions.insert(session);
+}
+
+bool watch_session(Session *session)
+{
+    // a plain TCP client of an io_uring reactor is read by a multishot receive, armed when a parked
+    // reactor resumes, a TLS client is always watched by epoll
+    Reactor *reactor = session->reactor;
+    if (reactor->ring != nullptr && session->tls == nullptr)
+    {
+        return reactor->mode == REACTOR_PARK || arm_receive(session);
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = session;
+    return epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, session->fd, &ev) == 0;
+}
+
+void read_client(Session *session)
+{
+    if (session->reactor->ring != nullptr && session->tls == nullptr)
+    {
+        // io_uring delivers the input as completions, reading here could overtake them. What is left is
+        // the end of the input if it came while the session could not handle it
+        if (session->input_closed && session->state != AUTHENTICATING)
+        {
+            hang_up(session, session->input_error);
+        }
+        return;
+    }
+
+    // edge-triggered: keep reading until the socket would block
+    while (1)
+    {
+        if (session->state == AUTHENTICATING || session->state == TLS_HANDSHAKE)
+        {
+            return; // left unread until the auth worker's verdict, finish_logins drains the socket then
+        }
+
+        // receive straight into the session's ring buffer, a text message is at most MSG_SZ bytes
+        RingBuffer &in = session->parser.buffer();
+        auto [buf, space] = in.write_space(MSG_SZ);
+        size_t len = session->framed ? space : min(space, (size_t)MSG_SZ);
+        ssize_t bytes_received = session->tls ? tls_recv(*session, buf, len) : recv(session->fd, buf, len, 0);
+        if (session->tls == nullptr)
+        {
+            bump(my_metrics().io_calls[0]); // tls_recv counts its own
+        }
+        if (bytes_received > 0)
+        {
+            in.commit(bytes_received);
+            bump(my_metrics().bytes_in, bytes_received);
+            if (!process_input(*session))
+            {
+                end_session(session);
+                return;
+            }
+            if (session->delayed_until != 0)
+            {
+                return; // the rest stays in the socket until the delay ends, resume_delayed reads on
+            }
+            continue;
+        }
+        if (bytes_received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        hang_up(session, bytes_received == 0 ? 0 : errno);
+        return;
+    }
+}
+
+void hang_up(Session *session, int error)
+{
+    // handle abrupt client shutdown
+    if (error != 0)
+    {
+        errno = error;
+    }
+    if (session->state == ACTIVE)
+    {
+        if (error == 0)
+        {
+            cout << session->username << " disconnected.\n";
+        }
+        else
+        {
+            perror("Error receiving data");
+        }
+        handle_exit(session->username, session->user_id, session->fd);
+    }
+    else
+    {
+        perror("TCP receive failed");
+    }
+    end_session(session);
+}
+
+void end_session(Session *session)
+{
+    // the client is gone, stop watching it and let its sender close it after the queued messages
+    Reactor *reactor = session->reactor;
+    if (session->receiving)
+    {
+        // the receive in flight still refers to the session, its last completion frees it
+        if (io_uring_sqe *sqe = reactor->ring->get_sqe())
+        {
+            Uring::prep_cancel(sqe, (uint64_t)session | RING_RECV, RING_CANCEL);
+        }
+        session->ended = true;
+    }
+    else
+    {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, session->fd, nullptr);
+    }
+    reactor->sessions.erase(session);
+    reactor->delayed.erase({session->delayed_until, session});
+    if (session->trace_id != 0)
+    {
+        trace(TRACE_LOGOUT, session->trace_id, 0, "");
+    }
+    remove_client(session->fd);
+    close_client(session->fd);
+    if (!session->ended)
+    {
+        delete session;
+    }
+}
+
+bool probe_uring()
+{
+    // multishot receives came after the rest (Linux 6.0), an older kernel only fails the receive itself
+    Uring ring;
+    int pair[2];
+    if (!ring.init(4) || !ring.setup_buffers(0, 2, 64) || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+    {
+        return false;
+    }
+    ring.prep_multishot_recv(ring.get_sqe(), pair[0], RING_RECV);
+    int result = -EIO;
+    bool more = false;
+    if (send(pair[1], "?", 1, 0) == 1 && ring.submit(1) >= 0)
+    {
+        ring.drain([&](const io_uring_cqe &cqe)
+        {
+            result = cqe.res;
+            more = cqe.flags & IORING_CQE_F_MORE;
+        });
+    }
+    close(pair[0]);
+    close(pair[1]);
+    errno = (result < 0) ? -result : EOPNOTSUPP;
+    return result == 1 && more;
+}
+
+void ring_reactor_loop(Reactor *reactor)
+{
+    // one io_uring_enter submits the re-armed requests and waits for completions, accepts and plain TCP
+    // input come as completions, TLS clients and the auth wakeups through the multishot poll of epoll_fd
+    Uring &ring = *reactor->ring;
+    while (1)
+    {
+        if (reactor->mode != REACTOR_RUN || !reactor->accepting || !reactor->polling)
+        {
+            settle_reactor(reactor);
+        }
+        int ret = ring.submit(1);
+        bump(my_metrics().io_calls[0]);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter failed");
+            break;
+        }
+        ring.drain([reactor](const io_uring_cqe &cqe) { handle_completion(reactor, cqe); });
+    }
+}
+
+void handle_completion(Reactor *reactor, const io_uring_cqe &cqe)
+{
+    // while the reactor parks the input is only buffered, a hot upgrade hands it over unhandled
+    bool parked = reactor->mode == REACTOR_PARK;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    uint64_t tag = cqe.user_data & RING_TAG_MASK;
+    if (tag == RING_CANCEL)
+    {
+        return;
+    }
+    if (tag == RING_ACCEPT)
+    {
+        if (!more && --reactor->accepts == 0)
+        {
+            reactor->accepting = false; // settle_reactor arms the next one if the reactor still runs
+        }
+        if (cqe.res >= 0)
+        {
+            struct sockaddr_in client_addr = {};
+            socklen_t client_len = sizeof(client_addr);
+            getpeername(cqe.res, (struct sockaddr *)&client_addr, &client_len);
+            bump(my_metrics().io_calls[0]);
+            open_session(reactor, cqe.res, client_addr.sin_addr.s_addr);
+        }
+        else if (cqe.res != -ECANCELED && cqe.res != -ECONNABORTED && cqe.res != -EINTR)
+        {
+            errno = -cqe.res;
+            perror("Connection failed!");
+        }
+        return;
+    }
+    if (tag == RING_POLL)
+    {
+        reactor->polling = more;
+        if (!parked)
+        {
+            poll_epoll(reactor);
+        }
+        return;
+    }
+
+    Session *session = (Session *)(cqe.user_data & ~(uint64_t)RING_TAG_MASK);
+    if (!more)
+    {
+        session->receiving = false;
+        reactor->receiving--;
+    }
+    int id = (cqe.flags & IORING_CQE_F_BUFFER) ? Uring::buffer_id(cqe) : -1;
+    if (session->ended)
+    {
+        if (id >= 0)
+        {
+            reactor->ring->recycle(id);
+        }
+        if (!session->receiving)
+        {
+            delete session;
+        }
+        return;
+    }
+    if (cqe.res > 0)
+    {
+        bump(my_metrics().bytes_in, cqe.res);
+        bool alive = receive_data(session, reactor->ring->buffer(id), cqe.res, parked);
+        reactor->ring->recycle(id);
+        if (alive && !more && !parked)
+        {
+            arm_receive(session); // the kernel ends a multishot receive now and then, e.g. when it has to reschedule
+        }
+        return;
+    }
+    if (id >= 0)
+    {
+        reactor->ring->recycle(id);
+    }
+    if (cqe.res == -ENOBUFS || cqe.res == -EINTR)
+    {
+        // every provided buffer holds data not copied out yet, they are recycled before the next submit
+        if (!parked)
+        {
+            arm_receive(session);
+        }
+        return;
+    }
+    if (cqe.res == -ECANCELED)
+    {
+        // stopped for a park or a delay, resume_receiving arms it again, or resume_delayed unless it came first
+        if (!parked && session->delayed_until == 0 && !session->receiving && !session->input_closed)
+        {
+            arm_receive(session);
+        }
+        return;
+    }
+
+    // the client hung up or the connection failed
+    session->input_closed = true;
+    session->input_error = -cqe.res;
+    if (!parked && session->state != AUTHENTICATING)
+    {
+        hang_up(session, session->input_error);
+    }
+}
+
+bool receive_data(Session *session, const char *data, size_t len, bool parked)
+{
+    // a text message is what one read returns, at most MSG_SZ bytes as with epoll, a framed client's
+    // input is handled in one go
+    RingBuffer &in = session->parser.buffer();
+    while (len > 0)
+    {
+        size_t chunk = session->framed ? len : min(len, (size_t)MSG_SZ);
+        in.append(data, chunk);
+        if (!session->framed)
+        {
+            session->text_chunks.push_back(chunk); // a receive held back behind another stays a message of its own
+        }
+        data += chunk;
+        len -= chunk;
+        if (parked || session->state == AUTHENTICATING)
+        {
+            continue; // left buffered until the auth worker's verdict or the reactor resumes
+        }
+        if (!process_input(*session))
+        {
+            end_session(session);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool arm_receive(Session *session)
+{
+    Reactor *reactor = session->reactor;
+    io_uring_sqe *sqe = reactor->ring->get_sqe();
+    if (sqe == nullptr)
+    {
+        return false;
+    }
+    reactor->ring->prep_multishot_recv(sqe, session->fd, (uint64_t)session | RING_RECV);
+    session->receiving = true;
+    reactor->receiving++;
+    return true;
+}
+
+void stop_receiving(Reactor *reactor)
+{
+    // a parked reactor has no receive in flight, whatever the kernel already took from a socket is
+    // in the session's buffer where a hot upgrade finds it, and no accept is left to add sessions
+    Uring &ring = *reactor->ring;
+    for (Session *session : reactor->sessions)
+    {
+        io_uring_sqe *sqe = session->receiving ? ring.get_sqe() : nullptr;
+        if (sqe != nullptr)
+        {
+            Uring::prep_cancel(sqe, (uint64_t)session | RING_RECV, RING_CANCEL);
+        }
+    }
+    while (reactor->receiving > 0 || reactor->accepts > 0)
+    {
+        if (ring.submit(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter failed");
+            return;
+        }
+        bump(my_metrics().io_calls[0]);
+        ring.drain([reactor](const io_uring_cqe &cqe) { handle_completion(reactor, cqe); });
+    }
+}
+
+void resume_receiving(Reactor *reactor)
+{
+    // the input buffered while parked is handled as if it had just arrived
+    vector<Session *> sessions(reactor->sessions.begin(), reactor->sessions.end());
+    for (Session *session : sessions)
+    {
+        if (session->tls != nullptr)
+        {
+            continue;
+        }
+        if (!session->input_closed && !session->receiving && session->delayed_until == 0)
+        {
+            arm_receive(session);
+        }
+        if (session->state == AUTHENTICATING)
+        {
+            continue;
+        }
+        if (session->parser.buffer().size() > 0 && !process_input(*session))
+        {
+            end_session(session);
+            continue;
+        }
+        if (session->input_closed)
+        {
+            hang_up(session, session->input_error);
+        }
+    }
+    poll_epoll(reactor); // events of the epoll set that came meanwhile
+}
+
+void poll_epoll(Reactor *reactor)
+{
+    // the multishot poll only says the set is ready, a full batch may leave more behind
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+    do
+    {
+        n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, 0);
+        bump(my_metrics().io_calls[0]);
+        if (n > 0)
+        {
+            dispatch_events(reactor, events, n);
+        }
+    } while (n == MAX_EVENTS || (n < 0 && errno == EINTR));
+}
+
+bool process_input(Session &session)
+{
+    if (session.delayed_until != 0)
+    {
+        return true; // a command over a rate limit is held back, resume_delayed handles the input
+    }
+    RingBuffer &in = session.parser.buffer();
+    if (!session.framed)
+    {
+        // a framed client sends FRAME_MAGIC in place of its username
+        char head[FRAME_MAGIC_LEN];
+        size_t head_len = min(in.size(), (size_t)FRAME_MAGIC_LEN);
+        in.peek(0, head, head_len);
+        if (session.state != AWAIT_USERNAME || memcmp(head, FRAME_MAGIC, head_len) != 0)
+        {
+            // legacy text mode: everything received by one read is one message, parsed in place. On io_uring
+            // the receives that came while the input was held back are queued, they are handled one by one
+            deque<uint32_t> &chunks = session.text_chunks;
+            bool connected;
+            do
+            {
+                size_t len = chunks.empty() ? min(in.size(), (size_t)MSG_SZ) : chunks.front();
+                const char *msg = in.contiguous(0, len);
+                if (msg == nullptr)
+                {
+                    // wraps around the end of the ring, handle a copy instead
+                    char *copy = (char *)session.arena.alloc(len, 1);
+                    in.peek(0, copy, len);
+                    msg = copy;
+                }
+                connected = client_handle(session, text_of(string_view(msg, len)));
+                if (session.delayed_until == 0)
+                {
+                    in.consume(chunks.empty() ? in.size() : len);
+                    if (!chunks.empty())
+                    {
+                        chunks.pop_front();
+                    }
+                }
+                session.arena.reset();
+            } while (connected && !chunks.empty() && session.delayed_until == 0 && session.state != AUTHENTICATING);
+            return connected;
+        }
+        if (head_len < FRAME_MAGIC_LEN)
+        {
+            return true; // wait for the rest of the magic
+        }
+
+        // acknowledge in text, everything after the acknowledgement is framed
+        in.consume(FRAME_MAGIC_LEN);
+        session.framed = true;
+        session.text_chunks.clear();
+        send_message(session.fd, FRAME_MAGIC);
+        set_framed(session.fd);
+    }
+
+    // framed mode: handle every complete frame, one read can carry several pipelined commands,
+    // frames after a password stay buffered until it is verified
+    Frame frame;
+    FrameStatus status = FRAME_INCOMPLETE;
+    while (session.state != AUTHENTICATING && session.delayed_until == 0 && (status = session.parser.next(frame)) == FRAME_OK)
+    {
+        bool connected = handle_frame(session, frame);
+        session.arena.reset();
+        if (!connected)
+        {
+            return false;
+        }
+    }
+    if (status == FRAME_ERROR)
+    {
+        send_message(session.fd, "\033[31mError : Frame too large.\033[0m");
+        if (session.state == ACTIVE)
+        {
+            handle_exit(session.username, session.user_id, session.fd);
+        }
+        return false;
+    }
+    return true;
+}
+
+bool handle_frame(Session &session, Frame &frame)
+{
+    // the payload stays in the receive buffer, the handlers parse views into it
+    string_view payload = text_of(frame.payload);
+
+    if ((frame.opcode == OP_USERNAME && session.state == AWAIT_USERNAME) ||
+        (frame.opcode == OP_PASSWORD && session.state == AWAIT_PASSWORD) ||
+        (frame.opcode == OP_COMMAND && session.state == ACTIVE))
+    {
+        return client_handle(session, payload);
+    }
+    if (opcode_action(frame.opcode) != nullptr && session.state == ACTIVE)
+    {
+        return handle_action(session, frame.opcode, payload, !payload.empty());
+    }
+    if (frame.opcode == OP_COMPRESS && session.state == AWAIT_USERNAME)
+    {
+        // offered before the username, so the banner and help text after the login are already compressed
+        set_compressed(session.fd, payload == COMPRESS_METHOD ? COMPRESS_METHOD : "");
+        return true;
+    }
+
+    const char *err_msg = "\033[31mError : Unexpected frame.\033[0m";
+    send_message(session.fd, err_msg);
+    return true;
+}
+
+bool client_handle(Session &session, string_view msg)
+{
+    int &client_fd = session.fd;
+    string &username = session.username;
+
+    if (session.state == AWAIT_USERNAME) // receive username
+    {
+        username = string(msg.substr(0, BUFF_SZ - 1));
+        send_message(client_fd, "Enter your password: ");
+        session.state = AWAIT_PASSWORD;
+        return true;
+    }
+
+    if (session.state == AWAIT_PASSWORD) // receive password
+    {
+        string_view passwd = msg.substr(0, BUFF_SZ - 1);
+
+        // the cheap checks run here, hashing the password is left to an auth worker
+        shared_ptr<const CredStore> creds = atomic_load(&credentials);
+        if (!allow_login(session.addr))
+        {
+            bump(my_metrics().logins[LOGIN_LIMITED]);
+            send_message(client_fd, "Authentication failed: too many login attempts, try again later.");
+            return false;
+        }
+        if (creds->table.find(username) == nullptr)
+        {
+            bump(my_metrics().logins[LOGIN_UNKNOWN]);
+            send_message(client_fd, "Authentication failed.");
+            return false;
+        }
+        if (!submit_login(session, passwd))
+        {
+            bump(my_metrics().logins[LOGIN_BUSY]);
+            send_message(client_fd, "Authentication failed: server busy, try again later.");
+            return false;
+        }
+        session.state = AUTHENTICATING;
+        return true;
+    }
+
+    // parse received message, the action and its arguments are views into msg
+    size_t sep = msg.find(' ');
+    string_view action = msg.substr(0, sep);
+    string_view message = (sep == string_view::npos) ? string_view() : msg.substr(sep + 1);
+    return handle_action(session, action_opcode(action), message, sep != string_view::npos);
+}
+
+bool login(Session &session)
+{
+    int &client_fd = session.fd;
+    string &username = session.username;
+
+    if ((session.user_id = intern(user_names, username)) == NO_NAME)
+    {
+        send_message(client_fd, "Authentication failed.");
+        return false;
+    }
+    send_message(client_fd, banner);
+    // Notify all the users, a crowd logging in at once is announced by one digest
+    notify_presence(NO_NAME, session.user_id, true, client_fd);
+
+    // update the data structures, the other nodes route this user's messages here from now on
+    add_user(session.user_id, client_fd);
+    peer_send_all(PEER_USER_UP, username);
+
+    handle_help(client_fd); // print help/usage message
+    // messages sent while the user was offline, added after the user is marked as logged in so
+    // that a message stored meanwhile is either replayed here or delivered by the log thread
+    submit_log({LOG_REPLAY, stream_dir('u', username), nullptr, client_fd, session.user_id, NO_NAME, 0});
+    session.state = ACTIVE;
+    trace_login(session);
+    return true;
+}
+
+bool handle_action(Session &session, uint8_t opcode, string_view message, bool has_args)
+{
+    uint64_t start = now_ns();
+    if (trace_state.fd >= 0 && !session.traced) // what the client sent, whether a limit lets it run or not
+    {
+        trace(TRACE_COMMAND, session.trace_id, opcode, message);
+    }
+    session.traced = false;
+    RateLimitKind kind;
+    if (uint64_t wait = rate_wait(session, opcode, message, kind))
+    {
+        return rate_limited(session, kind, wait); // the command does not run, no fan-out starts
+    }
+    session.limited = false;
+    bool connected = run_action(session, opcode, message, has_args);
+    ThreadMetrics &metrics = my_metrics();
+    bump(metrics.commands[action_slot(opcode)]);
+    record(metrics.command_ns[action_slot(opcode)], now_ns() - start);
+    return connected;
+}
+
+bool run_action(Session &session, uint8_t opcode, string_view message, bool has_args)
+{
+    int &client_fd = session.fd;
+    string &username = session.username;
+
+    // text actions were mapped to their opcode by action_opcode, 0 if invalid
+    switch (opcode)
+    {
+    case OP_EXIT:
+        if (!isEmpty(message) || has_args) // appropriate usage message for "/exit" function
+        {
+            const char *err_msg = "\033[93mUsage : /exit\n(Do not add any whitespace or other characters)\n\033[0m";
+            send_message(client_fd, err_msg);
+            return true;
+        }
+        handle_exit(username, session.user_id, client_fd);
+        return false;
+    case OP_MSG:
+        handle_msg(message, client_fd, username, session.user_id);
+        break;
+    case OP_BROADCAST:
+        handle_broadcast(username, message, client_fd);
+        break;
+    case OP_CREATE_GROUP:
+        handle_create_group(message, client_fd, session.user_id);
+        break;
+    case OP_JOIN_GROUP:
+        handle_join_group(message, client_fd, username, session.user_id);
+        break;
+    case OP_LEAVE_GROUP:
+        handle_leave_group(message, client_fd, username, session.user_id);
+        break;
+    case OP_GROUP_MSG:
+        handle_group_msg(message, client_fd, username);
+        break;
+    case OP_LIST_ALL_MEMBERS:
+        handle_list_all_members(client_fd, session.arena);
+        break;
+    case OP_LIST_ALL_GROUPS:
+        handle_list_all_groups(client_fd, session.arena);
+        break;
+    case OP_LIST_GROUP_MEMBERS:
+        handle_list_group_members(message, client_fd, session.arena);
+        break;
+    case OP_HELP:
+        handle_help(client_fd);
+        break;
+    case OP_QUEUE_STATS:
+        handle_queue_stats(client_fd, session.arena);
+        break;
+    case OP_HISTORY:
+        handle_history(message, client_fd, session.user_id);
+        break;
+    case OP_PRESENCE:
+        handle_presence(message, client_fd, session.user_id);
+        break;
+    default: // error if none of the above actions
+        const char *err_msg = "\033[31mError : Invalid Action.\033[0m";
+        send_message(client_fd, err_msg);
+        break;
+    }
+    return true;
+}
+
+void handle_msg(string_view message, int client_fd, std::string &username, NameId user)
+{
+    // the recipient is the first word of the message
+    string_view recpt = first_word(message);
+
+    NameId recipient = lookup(user_names, recpt);
+    int recv_fd = (recipient == NO_NAME) ? -1 : find_user(recipient);
+    if (isEmpty(recpt)) // Send usage message  if username is empty
+    {
+        const char *err_msg = "\033[93mUsage : /msg <recipient_username> <message>\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (recv_fd >= 0) // Send the message if everything is correct
+    {
+        private_mssg(concat({"[", username, "]: ", message}), recv_fd);
+    }
+    else if (int node = (recipient == NO_NAME) ? -1 : find_remote(recipient); node >= 0) // logged in on another node
+    {
+        peer_send(node, PEER_MSG, concat({recpt, " [", username, "]: ", message}));
+    }
+    else if (atomic_load(&credentials)->table.find(recpt) == nullptr ||
+             (recipient = intern(user_names, recpt)) == NO_NAME) // Send error message if username does not exist
+    {
+        const char *err_msg = "\033[31mError : Recipient not found in network.\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    // a known user who is offline, their inbox keeps the message until they log in
+    else if (!submit_log({LOG_OFFLINE, stream_dir('u', recpt), make_payload(concat({"[", username, "]: ", message})),
+                          client_fd, user, recipient, 0}))
+    {
+        const char *err_msg = "\033[31mError : The server is busy, the message was not stored.\033[0m";
+        send_message(client_fd, err_msg);
+    }
+}
+
+void handle_broadcast(std::string &username, string_view message, int &client_fd)
+{
+    // broadcast the message to all members except that client
+    broadcast(concat({"[", username, " on broadcast]: ", message}), client_fd);
+}
+
+void handle_create_group(string_view message, int &client_fd, NameId user)
+{
+    // the group name is the first word of the message
+    // group name does not contain whitespaces
+    string_view group_name = first_word(message);
+
+    GroupStatus status;
+    if (isEmpty(group_name)) // Send usage message if group name is empty
+    {
+        const char *err_msg = "\033[93mUsage : /create_group <group_name>\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if ((status = create_group(group_name, user)) == GROUP_EXISTS) // Send error message if group already exists
+    {
+        const char *err_msg = "\033[31mError : This group already exists!\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (status == BAD_NAME) // Send error message if the name would read as a pattern
+    {
+        const char *err_msg = "\033[31mError : A group name cannot contain * or #.\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (status == GROUP_LIMIT) // Send error message if no more groups can be created
+    {
+        const char *err_msg = "\033[31mError : The server cannot hold any more groups.\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else // the group was created with the client as its first member
+    {
+        const char *server_msg = "\033[93mGroup created.\033[0m";
+        send_message(client_fd, server_msg);
+        peer_send_all(PEER_CREATE_GROUP, concat({group_name, " ", name_of(user_names, user)}));
+    }
+}
+
+void handle_join_group(string_view message, int &client_fd, string &username, NameId user)
+{
+    // the group name is the first word of the message
+    string_view group_name = first_word(message);
+
+    // a pattern subscribes to every group it matches, also those created later
+    bool pattern = is_pattern(group_name);
+    NameId group = pattern ? NO_NAME : lookup(group_names, group_name);
+    GroupStatus status = pattern ? subscribe(group_name, user) : (group == NO_NAME) ? GROUP_MISSING : join_group(group, user);
+    if (isEmpty(group_name)) // Send usage message if group name is empty
+    {
+        const char *err_msg = "\033[93mUsage : /join_group <group_name>\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (status == BAD_NAME) // Send error message if a wildcard is not a level of its own
+    {
+        const char *err_msg = "\033[31mError : A wildcard must be a whole level, and # the last one.\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (status == GROUP_MISSING) // Send error message if group does not exist
+    {
+        const char *err_msg = "\033[31mError : This group does not exists!\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (status == ALREADY_MEMBER) // Send error message if the client is already in that group
+    {
+        const char *server_msg = pattern ? "\033[93mYou are already subscribed to this pattern.\033[0m"
+                                         : "\033[93mYou are already in this group.\033[0m";
+        send_message(client_fd, server_msg);
+    }
+    else if (pattern) // the client now gets the messages of every matching group, nobody is notified
+    {
+        peer_send_all(PEER_JOIN_GROUP, concat({group_name, " ", username}));
+        send_message(client_fd, concat({"\033[93mYou subscribed to ", group_name, ".\033[0m"}));
+    }
+    else  // the client was added to that group, notify all existing members of that group about the new member 
+    {
+        peer_send_all(PEER_JOIN_GROUP, concat({group_name, " ", username}));
+        send_message(client_fd, concat({"\033[93mYou joined ", group_name, ".\033[0m"}));
+        notify_presence(group, user, true, client_fd);
+    }
+}
+
+void handle_leave_group(string_view message, int &client_fd, string &username, NameId user)
+{
+    // the group name is the first word of the message
+    string_view group_name = first_word(message);
+
+    bool pattern = is_pattern(group_name);
+    NameId group = pattern ? NO_NAME : lookup(group_names, group_name);
+    GroupStatus status = pattern ? unsubscribe(group_name, user) : (group == NO_NAME) ? GROUP_MISSING : leave_group(group, user);
+    if (isEmpty(group_name)) // Send usage message if group name is empty
+    {
+        const char *err_msg = "\033[93mUsage : /leave_group <group_name>\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (status == GROUP_MISSING) // Send error message if group does not exist
+    {
+        const char *err_msg = "\033[31mError : This group does not exists!\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (status == NOT_MEMBER || status == BAD_NAME) // Send error message if the client is not in that group
+    {
+        const char *server_msg = pattern ? "\033[31mError : You are not subscribed to this pattern.\033[0m"
+                                         : "\033[31mError : You are not in this group.\033[0m";
+        send_message(client_fd, server_msg);
+    }
+    else if (pattern) // the subscription was dropped
+    {
+        peer_send_all(PEER_LEAVE_GROUP, concat({group_name, " ", username}));
+        send_message(client_fd, concat({"\033[93mYou unsubscribed from ", group_name, ".\033[0m"}));
+    }
+    else // the client was removed from that group, notify all existing members of that group about the exit member
+    {
+        peer_send_all(PEER_LEAVE_GROUP, concat({group_name, " ", username}));
+        send_message(client_fd, concat({"\033[93mYou left ", group_name, ".\033[0m"}));
+        notify_presence(group, user, false, client_fd);
+    }
+}
+
+void handle_group_msg(string_view message, int &client_fd, string &username)
+{
+    // the group name is the first word, the message body follows it (framed clients may send more than MSG_SZ)
+    string_view group_name = first_word(message);
+    string_view message_body = message.substr(group_name.size());
+
+    NameId group = isEmpty(group_name) ? NO_NAME : lookup(group_names, group_name);
+    if (isEmpty(group_name)) // Send usage message if group name is empty
+    {
+        const char *err_msg = "\033[93mUsage : /group_msg <group_name> <message>\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    // send the message to all members of the group except that client
+    else if (group == NO_NAME ||
+             !group_mssg(concat({"[", username, " on Group ", group_name, "]: ", message_body}), group, client_fd, true))
+    {
+        // Send error message if group does not exist
+        const char *err_msg = "\033[31mError : This group does not exist!\033[0m";
+        send_message(client_fd, err_msg);
+    }
+}
+
+void handle_exit(string &username, NameId user, int &client_fd)
+{
+    // update the data structures to remove that client, the other nodes drop it from their groups
+    remove_user(user, client_fd);
+    peer_send_all(PEER_USER_DOWN, username);
+
+    // remove that client from the groups it was joined in
+    vector<NameId> left_groups = leave_all_groups(user);
+
+    // notify the remaining members of those groups (the socket itself is closed by the reactor)
+    for (NameId group : left_groups)
+    {
+        notify_presence(group, user, false, client_fd);
+    }
+
+    // Notify all clients about that client leaving
+    notify_presence(NO_NAME, user, false, client_fd);
+    return;
+}
+
+void handle_list_all_members(int &client_fd, Arena &arena)
+{
+    // print sorted list of all clients active on the server
+    shared_ptr<const UserList> users[NUM_SHARDS];
+    size_t total = 0;
+    for (int i = 0; i < NUM_SHARDS; i++)
+    {
+        users[i] = user_snapshot(userToSocket[i]);
+        total += users[i]->size();
+    }
+    string_view *usernames = arena.alloc_array<string_view>(total);
+    size_t count = 0;
+    for (auto &shard_users : users)
+    {
+        for (auto &[user, socket] : *shard_users)
+        {
+            usernames[count++] = name_of(user_names, user);
+        }
+    }
+    // users of the other nodes, from the cluster directory
+    vector<string_view> remote;
+    for (auto &shard : remote_users)
+    {
+        shared_lock<shared_mutex> lock(shard.lock);
+        for (auto &[user, node] : shard.nodes)
+        {
+            remote.push_back(name_of(user_names, user));
+        }
+    }
+    string_view *all = arena.alloc_array<string_view>(count + remote.size());
+    copy(usernames, usernames + count, all);
+    copy(remote.begin(), remote.end(), all + count);
+    count += remote.size();
+    sort(all, all + count);
+    send_message(client_fd, join_lines(all, count, "\033[93m", "\033[0m"));
+}
+
+void handle_list_all_groups(int &client_fd, Arena &arena)
+{
+    // print sorted list of all groups active on the server
+    size_t total = 0;
+    for (auto &shard : groupToMembers)
+    {
+        shared_lock<shared_mutex> lock(shard.lock);
+        total += shard.members.size();
+    }
+    // groups created after counting are left out, they did not exist when the command was sent
+    string_view *names = arena.alloc_array<string_view>(total);
+    size_t count = 0;
+    for (auto &shard : groupToMembers)
+    {
+        shared_lock<shared_mutex> lock(shard.lock);
+        for (auto it = shard.members.begin(); it != shard.members.end() && count < total; ++it)
+        {
+            names[count++] = name_of(group_names, it->first);
+        }
+    }
+    sort(names, names + count);
+    send_message(client_fd, join_lines(names, count, "\033[93m", "\033[0m"));
+}
+
+void handle_list_group_members(string_view message, int &client_fd, Arena &arena)
+{
+    // print list of all members of a particular group on the server
+    string_view group_name = first_word(message);
+
+    NameId group = isEmpty(group_name) ? NO_NAME : lookup(group_names, group_name);
+    shared_ptr<const MemberList> members = (group == NO_NAME) ? nullptr : group_snapshot(group);
+    if (isEmpty(group_name)) // Send usage message if group name is empty
+    {
+        const char *err_msg = "\033[93mUsage : /list_group_members <group_name>\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (members == nullptr) // Send error message if group does not exist
+    {
+        const char *err_msg = "\033[31mError : This group does not exist!\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else
+    {
+        // members are kept in ID order, list them by name
+        string_view *usernames = arena.alloc_array<string_view>(members->size());
+        for (size_t i = 0; i < members->size(); i++)
+        {
+            usernames[i] = name_of(user_names, (*members)[i]);
+        }
+        sort(usernames, usernames + members->size());
+        send_message(client_fd, join_lines(usernames, members->size(), "", ""));
+    }
+}
+
+void handle_queue_stats(int &client_fd, Arena &arena)
+{
+    // print the outgoing queue of every member, the slowest readers first
+    struct Entry
+    {
+        string_view username;
+        uint32_t depth;
+        uint64_t bytes;
+        uint64_t dropped;
+    };
+    shared_ptr<const UserList> users[NUM_SHARDS];
+    size_t total = 0;
+    for (int i = 0; i < NUM_SHARDS; i++)
+    {
+        users[i] = user_snapshot(userToSocket[i]);
+        total += users[i]->size();
+    }
+    Entry *entries = arena.alloc_array<Entry>(total);
+    size_t count = 0;
+    for (auto &shard_users : users)
+    {
+        for (auto &[user, socket] : *shard_users)
+        {
+            shared_ptr<QueueStats> stats = find_client(socket);
+            if (stats != nullptr)
+            {
+                entries[count++] = {name_of(user_names, user), stats->depth.load(memory_order_relaxed),
+                                    stats->bytes.load(memory_order_relaxed), stats->dropped.load(memory_order_relaxed)};
+            }
+        }
+    }
+    sort(entries, entries + count, [](const Entry &a, const Entry &b)
+         { return a.bytes != b.bytes ? a.bytes > b.bytes : a.username < b.username; });
+
+    stringstream ss;
+    ss << "\033[93m";
+    for (size_t i = 0; i < count; i++)
+    {
+        ss << entries[i].username << " : " << entries[i].depth << " queued (" << entries[i].bytes << " bytes), "
+           << entries[i].dropped << " dropped\n";
+    }
+    ss << "\033[0m";
+    send_message(client_fd, ss.str());
+}
+
+void handle_history(string_view message, int &client_fd, NameId user)
+{
+    // the group name is the first word, an optional message count follows it
+    string_view group_name = first_word(message);
+    string_view count_arg = first_word(message.substr(min(message.size(), group_name.size() + 1)));
+
+    NameId group = isEmpty(group_name) ? NO_NAME : lookup(group_names, group_name);
+    shared_ptr<const MemberList> members = (group == NO_NAME) ? nullptr : group_snapshot(group);
+    size_t count = HISTORY_DEFAULT;
+    auto [end, err] = from_chars(count_arg.data(), count_arg.data() + count_arg.size(), count);
+    if (isEmpty(group_name) || (!count_arg.empty() && (err != errc() || end != count_arg.data() + count_arg.size() ||
+                                                       count == 0)))
+    {
+        // Send usage message if group name is empty or the count is not a positive number
+        const char *err_msg = "\033[93mUsage : /history <group_name> [<number of messages>]\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (members == nullptr) // Send error message if group does not exist
+    {
+        const char *err_msg = "\033[31mError : This group does not exist!\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    else if (!binary_search(members->begin(), members->end(), user)) // only members may read a group's messages
+    {
+        const char *err_msg = "\033[31mError : You are not in this group.\033[0m";
+        send_message(client_fd, err_msg);
+    }
+    // read by the log thread, the reactor never waits for the disk
+    else if (!submit_log({LOG_HISTORY, stream_dir('g', group_name), nullptr, client_fd, user, NO_NAME,
+                          min(count, (size_t)HISTORY_MAX)}))
+    {
+        const char *err_msg = "\033[31mError : The server is busy, try again later.\033[0m";
+        send_message(client_fd, err_msg);
+    }
+}
+
+void handle_presence(string_view message, int &client_fd, NameId user)
+{
+    // the group name is the first word, an optional window in milliseconds follows it
+    string_view group_name = first_word(message);
+    string_view window_arg = first_word(message.substr(min(message.size(), group_name.size() + 1)));
+
+    NameId group = isEmpty(group_name) ? NO_NAME : lookup(group_names, group_name);
+    shared_ptr<const MemberList> members = (group == NO_NAME) ? nullptr : group_snapshot(group);
+    int window = -1;
+    auto [end, err] = from_chars(window_arg.data(), window_arg.data() + window_arg.size(), window);
+    if (isEmpty(group_name) || (!window_arg.empty() && (err != errc() || end != window_arg.data() + window_arg.size() ||
+                                                        window < 0 || window > PRESENCE_MAX_MS)))
+    {
+        // Send usage message if group name is empty or the window is out of range
+        string err_msg = "\033[93mUsage : /presence <group_name> [<milliseconds, 0 to " + to_string(PRESENCE_MAX_MS) +
+                         ">]\033[0m";
+        send_message(client_fd, err_msg);
+        return;
+    }
+    if (members == nullptr) // Send error message if group does not exist
+    {
+        const char *err_msg = "\033[31mError : This group does not exist!\033[0m";
+        send_message(client_fd, err_msg);
+        return;
+    }
+    if (!binary_search(members->begin(), members->end(), user)) // only members may change a group's notices
+    {
+        const char *err_msg = "\033[31mError : You are not in this group.\033[0m";
+        send_message(client_fd, err_msg);
+        return;
+    }
+    if (window >= 0)
+    {
+        set_presence_window(group, window);
+        peer_send_all(PEER_PRESENCE, concat({group_name, " ", window_arg}));
+    }
+    else
+    {
+        lock_guard<mutex> lock(presence.mtx);
+        window = presence_window_of(group);
+    }
+    string server_msg = (window == 0) ? concat({"\033[93mJoin and leave notices of ", group_name, " are sent at once.\033[0m"})
+                                      : concat({"\033[93mJoin and leave notices of ", group_name, " are collected for ",
+                                                to_string(window), " ms.\033[0m"});
+    send_message(client_fd, server_msg);
+}
+
+void handle_help(int &client_fd)
+{
+    // print help message 
+    stringstream ss;
+    ss << "\033[32mList of availabe actions : \033[0m\n"
+       << "\033[93m/msg <recipient's username> <message>\033[0m\tSend a private message to another user in the chat\n"
+       << "\033[93m/broadcast <message>\033[0m\t\t\tSend a message to all the users in the chat\n"
+       << "\033[93m/create_group <group_name>\033[0m\t\tCreate a group for messaging\n"
+       << "\033[93m/join_group <group_name>\033[0m\t\tJoin an existing group, or every group matching a pattern (ops.*.db, ops.#)\n"
+       << "\033[93m/group_msg <group_name> <message>\033[0m\tSend a message to all the members of the group\n"
+       << "\033[93m/leave_group <group_name>\033[0m\t\tLeave a group or a pattern\n"
+       << "\033[93m/list_all_members\033[0m\t\t\tPrint a list of all members present in the chat\n"
+       << "\033[93m/list_all_groups\033[0m\t\t\tPrint a list of all groups in the chat\n"
+       << "\033[93m/list_group_members <group_name>\033[0m\tPrint a list of all members in a group\n"
+       << "\033[93m/queue_stats\033[0m\t\t\t\tPrint the outgoing queue and dropped messages of every member\n"
+       << "\033[93m/history <group_name> [<count>]\033[0m\t\tPrint the last messages sent to a group (default 10)\n"
+       << "\033[93m/presence <group_name> [<ms>]\033[0m\t\tShow or set how long join and leave notices of a group are collected\n"
+       << "\033[93m/help\033[0m\t\t\t\t\tPrint this help message\n"
+       << "\033[93m/exit\033[0m\t\t\t\t\tExit the chat\n";
+    string help_msg = ss.str();
+    send_message(client_fd, help_msg);
+}
+
+bool isEmpty(string_view str) // returns true if a string is empty or has just whitespaces, else false
+{
+    for (char c : str)
+    {
+        if (!isspace((unsigned char)c))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+string_view first_word(string_view message) // the message up to its first space, at most BUFF_SZ - 1 characters
+{
+    return message.substr(0, min(message.find(' '), (size_t)BUFF_SZ - 1));
+}
+
+string_view text_of(string_view data) // the text before the first NUL, clients send plain text and nothing after a NUL is read
+{
+    return data.substr(0, data.find('\0'));
+}
+
+string join_lines(const string_view *lines, size_t count, const char *prefix, const char *suffix) // one line per entry with a single allocation
+{
+    size_t len = strlen(prefix) + strlen(suffix);
+    for (size_t i = 0; i < count; i++)
+    {
+        len += lines[i].size() + 1;
+    }
+    string joined;
+    joined.reserve(len);
+    joined.append(prefix);
+    for (size_t i = 0; i < count; i++)
+    {
+        joined.append(lines[i]).push_back('\n');
+    }
+    joined.append(suffix);
+    return joined;
+}
+
+void send_message(int client_sock, string message) // send message to a particular client socket
+{
+    enqueue(client_sock, make_payload(move(message)), OUT_DATA);
+}
+
+Payload make_payload(string message) // wraps a message into a buffer that can be queued for any number of clients
+{
+    bytes_copied.fetch_add(message.size(), memory_order_relaxed);
+    return make_shared<const string>(move(message));
+}
+
+void send_payload(int client_sock, const Payload &payload, const shared_ptr<DeflateCache> &deflated) // queue an already built buffer, only its reference count changes
+{
+    enqueue(client_sock, payload, OUT_DATA, nullptr, nullptr, deflated);
+}
+
+void open_client(int client_sock, shared_ptr<QueueStats> stats, shared_ptr<TlsConn> tls) // prepare the sender of a newly accepted client socket
+{
+    enqueue(client_sock, nullptr, OUT_OPEN, move(stats), move(tls));
+}
+
+void close_client(int client_sock) // close a client socket once its queued messages are written
+{
+    enqueue(client_sock, nullptr, OUT_CLOSE);
+}
+
+void set_framed(int client_sock) // frame all messages sent to a client from now on
+{
+    enqueue(client_sock, nullptr, OUT_FRAMED);
+}
+
+void set_compressed(int client_sock, string method) // acknowledge a compression offer, an empty method declines it
+{
+    enqueue(client_sock, make_payload(move(method)), OUT_COMPRESS);
+}
+
+bool group_mssg(string message, NameId group, int client_fd, bool logged) // send message to all members of a group except the sending client
+{
+    // client_fd is -1 for a message forwarded by another node, it only goes to the members of this node
+    // walk a snapshot of the members, joins and leaves meanwhile do not wait for the fan-out
+    shared_ptr<const MemberList> members = group_snapshot(group);
+    if (members == nullptr)
+    {
+        return false;
+    }
+    shared_ptr<const MemberList> subscribers = topic_subscribers(group); // users with a matching pattern
+    Payload payload = make_payload(move(message)); // built once, every member's queue points at it
+    auto deflated = make_shared<DeflateCache>();   // and compressed at most once
+    uint64_t recipients = 0;
+    uint64_t nodes = 0; // other nodes with members of the group
+    auto deliver = [&](NameId member)
+    {
+        int member_fd = find_user(member);
+        if (member_fd >= 0 && member_fd != client_fd)
+        {
+            send_payload(member_fd, payload, deflated);
+            recipients++;
+        }
+        else if (member_fd < 0 && client_fd >= 0 && !peers.empty())
+        {
+            int node = find_remote(member);
+            nodes |= (node >= 0) ? 1ull << node : 0;
+        }
+    };
+    for (NameId member : *members)
+    {
+        deliver(member);
+    }
+    if (subscribers != nullptr)
+    {
+        for (NameId user : *subscribers)
+        {
+            if (!binary_search(members->begin(), members->end(), user)) // a member gets the message once
+            {
+                deliver(user);
+            }
+        }
+    }
+    // each of those nodes gets the message once and fans it out to its own members
+    for (int node = 0; nodes != 0; node++, nodes >>= 1)
+    {
+        if (nodes & 1)
+        {
+            peer_send(node, PEER_GROUP_MSG, concat({name_of(group_names, group), logged ? " 1 " : " 0 ", *payload}));
+        }
+    }
+    bytes_referenced.fetch_add(recipients * payload->size(), memory_order_relaxed);
+    record(my_metrics().fanout[FANOUT_GROUP], recipients);
+    // the log thread writes the same buffer, the fan-out never waits for the disk
+    if (logged && !submit_log({LOG_GROUP, stream_dir('g', name_of(group_names, group)), payload, client_fd, NO_NAME,
+                               NO_NAME, 0}))
+    {
+        bump(my_metrics().log_dropped);
+    }
+    return true;
+}
+
+void private_mssg(string message, int recv_fd) // send message to a particular client 
+{ 
+    send_message(recv_fd, move(message));
+}
+
+void broadcast(string message, int broadcast_fd) // send message to all active members on the server except the sending client
+{
+    // every other node gets the message once, broadcast_fd is -1 for a message forwarded by one of them
+    if (broadcast_fd >= 0)
+    {
+        peer_send_all(PEER_BROADCAST, message);
+    }
+    // walk the snapshot of every shard, logins and logouts meanwhile do not wait for the fan-out
+    Payload payload = make_payload(move(message)); // built once, every client's queue points at it
+    auto deflated = make_shared<DeflateCache>();   // and compressed at most once
+    uint64_t recipients = 0;
+    for (auto &shard : userToSocket)
+    {
+        shared_ptr<const UserList> users = user_snapshot(shard); // keeps the snapshot alive during the walk
+        for (auto &[user, socket] : *users)
+        {
+            if (socket != broadcast_fd)
+            {
+                send_payload(socket, payload, deflated);
+                recipients++;
+            }
+        }
+    }
+    bytes_referenced.fetch_add(recipients * payload->size(), memory_order_relaxed);
+    record(my_metrics().fanout[FANOUT_BROADCAST], recipients);
+}
+
+void notify_presence(NameId scope, NameId user, bool joined, int client_fd)
+{
+    unique_lock<mutex> lock(presence.mtx);
+    int window = presence_window_of(scope);
+    if (window == 0)
+    {
+        lock.unlock();
+        vector<NameId> users = {user};
+        string message = joined ? presence_digest(scope, users, {}, NO_NAME) : presence_digest(scope, {}, users, NO_NAME);
+        (scope == NO_NAME) ? broadcast(move(message), client_fd) : (void)group_mssg(move(message), scope, client_fd);
+        return;
+    }
+
+    // the digest goes out when the window of the first notice ends, a user who leaves and comes back
+    // meanwhile (a reconnect) is not announced at all
+    bump(my_metrics().presence[0]);
+    auto [entry, started] = presence.batches.try_emplace(scope);
+    PresenceBatch &batch = entry->second;
+    if (started)
+    {
+        batch.due = chrono::steady_clock::now() + chrono::milliseconds(window);
+    }
+    auto [event, added] = batch.events.try_emplace(user, joined);
+    if (added)
+    {
+        batch.order.push_back(user);
+    }
+    else if (event->second != joined)
+    {
+        batch.events.erase(event);
+    }
+    lock.unlock();
+    if (started)
+    {
+        presence.changed.notify_one();
+    }
+}
+
+void presence_loop()
+{
+    unique_lock<mutex> lock(presence.mtx);
+    while (1)
+    {
+        // take the batches that are due, the earliest of the others decides how long to sleep
+        auto now = chrono::steady_clock::now();
+        auto next = chrono::steady_clock::time_point::max();
+        vector<pair<NameId, PresenceBatch>> due;
+        for (auto entry = presence.batches.begin(); entry != presence.batches.end();)
+        {
+            if (entry->second.due <= now)
+            {
+                due.emplace_back(entry->first, move(entry->second));
+                entry = presence.batches.erase(entry);
+                continue;
+            }
+            next = min(next, entry->second.due);
+            ++entry;
+        }
+        if (due.empty())
+        {
+            (next == chrono::steady_clock::time_point::max()) ? presence.changed.wait(lock)
+                                                              : (void)presence.changed.wait_until(lock, next);
+            continue;
+        }
+        lock.unlock();
+        {
+            lock_guard<mutex> lifecycle(lifecycle_lock); // no digest while a shutdown or hot upgrade owns the sockets
+            for (auto &[scope, batch] : due)
+            {
+                send_digest(scope, batch);
+            }
+        }
+        lock.lock();
+    }
+}
+
+void send_digest(NameId scope, PresenceBatch &batch)
+{
+    vector<NameId> joined, left;
+    for (NameId user : batch.order)
+    {
+        auto event = batch.events.find(user); // gone if it cancelled out or is listed already
+        if (event != batch.events.end())
+        {
+            (event->second ? joined : left).push_back(user);
+            batch.events.erase(event);
+        }
+    }
+    if (joined.empty() && left.empty())
+    {
+        return;
+    }
+
+    // every recipient shares one digest, except the users it names as joining, who get one without
+    // themselves. The ones that are only counted find themselves among the others.
+    vector<NameId> named(joined.begin(), joined.begin() + min(joined.size(), (size_t)PRESENCE_NAMES));
+    sort(named.begin(), named.end());
+    Payload payload = make_payload(presence_digest(scope, joined, left, NO_NAME));
+    auto deflated = make_shared<DeflateCache>();
+    uint64_t recipients = 0;
+    auto deliver = [&](NameId user, int socket)
+    {
+        if (!binary_search(named.begin(), named.end(), user))
+        {
+            send_payload(socket, payload, deflated);
+            recipients++;
+        }
+        else if (string own = presence_digest(scope, joined, left, user); !own.empty())
+        {
+            send_message(socket, move(own));
+        }
+    };
+
+    // other nodes get the digest once and fan it out to their own users, whose notices they digest themselves
+    if (scope == NO_NAME)
+    {
+        peer_send_all(PEER_BROADCAST, *payload);
+        for (auto &shard : userToSocket)
+        {
+            shared_ptr<const UserList> users = user_snapshot(shard); // keeps the snapshot alive during the walk
+            for (auto &[user, socket] : *users)
+            {
+                deliver(user, socket);
+            }
+        }
+    }
+    else if (shared_ptr<const MemberList> members = group_snapshot(scope))
+    {
+        uint64_t nodes = 0;
+        for (NameId member : *members)
+        {
+            int member_fd = find_user(member);
+            if (member_fd >= 0)
+            {
+                deliver(member, member_fd);
+            }
+            else if (!peers.empty())
+            {
+                int node = find_remote(member);
+                nodes |= (node >= 0) ? 1ull << node : 0;
+            }
+        }
+        for (int node = 0; nodes != 0; node++, nodes >>= 1)
+        {
+            if (nodes & 1)
+            {
+                peer_send(node, PEER_GROUP_MSG, concat({name_of(group_names, scope), " 0 ", *payload}));
+            }
+        }
+    }
+    ThreadMetrics &metrics = my_metrics();
+    bytes_referenced.fetch_add(recipients * payload->size(), memory_order_relaxed);
+    record(metrics.fanout[FANOUT_PRESENCE], recipients);
+    bump(metrics.presence[1]);
+}
+
+string presence_digest(NameId scope, const vector<NameId> &joined, const vector<NameId> &left, NameId skip)
+{
+    // a single notice reads as it always did
+    string digest;
+    size_t count;
+    string names = name_list(joined, skip, count);
+    if (count > 0)
+    {
+        digest = (scope == NO_NAME) ? concat({"\033[093m", names, count == 1 ? " has" : " have", " joined the chat!\033[0m"})
+                                    : concat({"\033[93m", names, " joined ", name_of(group_names, scope), ".\033[0m"});
+    }
+    names = name_list(left, skip, count);
+    if (count > 0)
+    {
+        digest += digest.empty() ? "" : "\n";
+        digest += (scope == NO_NAME) ? concat({"\033[093m", names, count == 1 ? " has" : " have", " left the chat! \033[0m"})
+                                     : concat({"\033[93m", names, " left ", name_of(group_names, scope), ".\033[0m"});
+    }
+    return digest;
+}
+
+string name_list(const vector<NameId> &users, NameId skip, size_t &count)
+{
+    vector<string_view> names;
+    count = 0;
+    for (NameId user : users)
+    {
+        if (user == skip)
+        {
+            continue;
+        }
+        if (names.size() < PRESENCE_NAMES)
+        {
+            names.push_back(name_of(user_names, user));
+        }
+        count++;
+    }
+    string list;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        list += (i == 0) ? "" : (i + 1 == names.size() && count == names.size()) ? " and " : ", ";
+        list += names[i];
+    }
+    if (count > names.size())
+    {
+        size_t others = count - names.size();
+        list += concat({" and ", to_string(others), others == 1 ? " other" : " others"});
+    }
+    return list;
+}
+
+int presence_window_of(NameId scope)
+{
+    auto entry = (scope == NO_NAME) ? presence.windows.end() : presence.windows.find(scope);
+    return (entry == presence.windows.end()) ? presence_window : entry->second;
+}
+
+void set_presence_window(NameId group, int window_ms)
+{
+    lock_guard<mutex> lock(presence.mtx);
+    presence.windows[group] = window_ms;
+}
+
+string concat(initializer_list<string_view> parts) // joins the parts of a message with a single allocation
+{
+    size_t len = 0;
+    for (auto part : parts)
+    {
+        len += part.size();
+    }
+    string joined;
+    joined.reserve(len);
+    for (auto part : parts)
+    {
+        joined.append(part);
+    }
+    return joined;
+}
+
+NameId intern(NameTable &table, string_view name)
+{
+    NameId id = lookup(table, name);
+    if (id != NO_NAME)
+    {
+        return id;
+    }
+
+    unique_lock<shared_mutex> lock(table.lock);
+    auto known = table.ids.find(name);
+    if (known != table.ids.end())
+    {
+        return known->second; // interned meanwhile by another thread
+    }
+    if (table.count == (NameId)NAME_CHUNK * MAX_NAME_CHUNKS)
+    {
+        return NO_NAME;
+    }
+    id = table.count++;
+    string *&chunk = table.chunks[id / NAME_CHUNK];
+    if (chunk == nullptr)
+    {
+        chunk = new string[NAME_CHUNK];
+    }
+    chunk[id % NAME_CHUNK] = name;
+    table.ids.emplace(name, id);
+    return id;
+}
+
+NameId lookup(NameTable &table, string_view name)
+{
+    shared_lock<shared_mutex> lock(table.lock);
+    auto known = table.ids.find(name);
+    return (known == table.ids.end()) ? NO_NAME : known->second;
+}
+
+const string &name_of(NameTable &table, NameId id)
+{
+    // the ID was handed out under table.lock after its name was stored, so the slot is visible here
+    return table.chunks[id / NAME_CHUNK][id % NAME_CHUNK];
+}
+
+size_t shard_of(NameId id)
+{
+    return id & (NUM_SHARDS - 1); // IDs are dense, consecutive ones land in different shards
+}
+
+void add_client(int client_sock, shared_ptr<QueueStats> stats)
+{
+    SocketShard &shard = client_set[client_sock & (NUM_SHARDS - 1)];
+    lock_guard<mutex> lock(shard.lock);
+    shard.sockets[client_sock] = move(stats);
+}
+
+shared_ptr<QueueStats> find_client(int client_sock)
+{
+    SocketShard &shard = client_set[client_sock & (NUM_SHARDS - 1)];
+    lock_guard<mutex> lock(shard.lock);
+    auto entry = shard.sockets.find(client_sock);
+    return (entry == shard.sockets.end()) ? nullptr : entry->second;
+}
+
+void remove_client(int client_sock)
+{
+    SocketShard &shard = client_set[client_sock & (NUM_SHARDS - 1)];
+    lock_guard<mutex> lock(shard.lock);
+    shard.sockets.erase(client_sock);
+}
+
+void add_user(NameId user, int client_sock)
+{
+    UserShard &shard = userToSocket[shard_of(user)];
+    unique_lock<shared_mutex> lock(shard.lock);
+    if (shard.sockets.insert_or_assign(user, client_sock).second)
+    {
+        online_users.fetch_add(1, memory_order_relaxed);
+    }
+    shard.snapshot = nullptr;
+}
+
+void remove_user(NameId user, int client_sock)
+{
+    UserShard &shard = userToSocket[shard_of(user)];
+    unique_lock<shared_mutex> lock(shard.lock);
+    auto entry = shard.sockets.find(user);
+    if (entry != shard.sockets.end() && entry->second == client_sock)
+    {
+        shard.sockets.erase(entry);
+        shard.snapshot = nullptr;
+        online_users.fetch_sub(1, memory_order_relaxed);
+    }
+}
+
+int find_user(NameId user)
+{
+    UserShard &shard = userToSocket[shard_of(user)];
+    shared_lock<shared_mutex> lock(shard.lock);
+    auto entry = shard.sockets.find(user);
+    return (entry == shard.sockets.end()) ? -1 : entry->second;
+}
+
+shared_ptr<const UserList> user_snapshot(UserShard &shard)
+{
+    shared_lock<shared_mutex> read_lock(shard.lock);
+    if (shard.snapshot != nullptr)
+    {
+        return shard.snapshot;
+    }
+    read_lock.unlock();
+
+    // stale, the first broadcast after a login or logout rebuilds it
+    unique_lock<shared_mutex> write_lock(shard.lock);
+    if (shard.snapshot == nullptr)
+    {
+        shard.snapshot = make_shared<const UserList>(shard.sockets.begin(), shard.sockets.end());
+    }
+    return shard.snapshot;
+}
+
+GroupStatus create_group(string_view group_name, NameId creator)
+{
+    if (is_pattern(group_name))
+    {
+        return BAD_NAME; // it could not be told apart from a subscription
+    }
+    NameId group = intern(group_names, group_name);
+    if (group == NO_NAME)
+    {
+        return GROUP_LIMIT;
+    }
+    GroupShard &shard = groupToMembers[shard_of(group)];
+    unique_lock<shared_mutex> lock(shard.lock);
+    auto [entry, created] = shard.members.try_emplace(group, nullptr);
+    if (!created)
+    {
+        return GROUP_EXISTS;
+    }
+    entry->second = make_shared<const MemberList>((creator == NO_NAME) ? MemberList{} : MemberList{creator});
+    shard.limits.try_emplace(group);
+    return GROUP_OK;
+}
+
+GroupStatus join_group(NameId group, NameId user)
+{
+    GroupShard &shard = groupToMembers[shard_of(group)];
+    unique_lock<shared_mutex> lock(shard.lock);
+    auto entry = shard.members.find(group);
+    if (entry == shard.members.end())
+    {
+        return GROUP_MISSING;
+    }
+    const MemberList &members = *entry->second;
+    auto pos = lower_bound(members.begin(), members.end(), user);
+    if (pos != members.end() && *pos == user)
+    {
+        return ALREADY_MEMBER;
+    }
+
+    // publish a new member list, fan-outs still walking the old one keep it alive
+    auto updated = make_shared<MemberList>();
+    updated->reserve(members.size() + 1);
+    updated->insert(updated->end(), members.begin(), pos);
+    updated->push_back(user);
+    updated->insert(updated->end(), pos, members.end());
+    entry->second = move(updated);
+    return GROUP_OK;
+}
+
+GroupStatus leave_group(NameId group, NameId user)
+{
+    GroupShard &shard = groupToMembers[shard_of(group)];
+    unique_lock<shared_mutex> lock(shard.lock);
+    auto entry = shard.members.find(group);
+    if (entry == shard.members.end())
+    {
+        return GROUP_MISSING;
+    }
+    const MemberList &members = *entry->second;
+    auto pos = lower_bound(members.begin(), members.end(), user);
+    if (pos == members.end() || *pos != user)
+    {
+        return NOT_MEMBER;
+    }
+
+    auto updated = make_shared<MemberList>();
+    updated->reserve(members.size() - 1);
+    updated->insert(updated->end(), members.begin(), pos);
+    updated->insert(updated->end(), pos + 1, members.end());
+    entry->second = move(updated);
+    return GROUP_OK;
+}
+
+shared_ptr<const MemberList> group_snapshot(NameId group)
+{
+    GroupShard &shard = groupToMembers[shard_of(group)];
+    shared_lock<shared_mutex> lock(shard.lock);
+    auto entry = shard.members.find(group);
+    return (entry == shard.members.end()) ? nullptr : entry->second;
+}
+
+vector<NameId> leave_all_groups(NameId user)
+{
+    vector<NameId> left_groups;
+    for (auto &shard : groupToMembers)
+    {
+        vector<NameId> candidates;
+        {
+            shared_lock<shared_mutex> lock(shard.lock);
+            for (auto &[group, members] : shard.members)
+            {
+                if (binary_search(members->begin(), members->end(), user))
+                {
+                    candidates.push_back(group);
+                }
+            }
+        }
+        for (NameId group : candidates)
+        {
+            if (leave_group(group, user) == GROUP_OK)
+            {
+                left_groups.push_back(group);
+            }
+        }
+    }
+
+    vector<string> patterns;
+    {
+        shared_lock<shared_mutex> lock(topics.lock);
+        auto entry = topics.by_user.find(user);
+        if (entry != topics.by_user.end())
+        {
+            patterns = entry->second;
+        }
+    }
+    for (const string &pattern : patterns)
+    {
+        unsubscribe(pattern, user);
+    }
+    return left_groups;
+}
+
+bool is_pattern(string_view name)
+{
+    return name.find_first_of("*#") != string_view::npos;
+}
+
+bool valid_pattern(string_view pattern)
+{
+    // a wildcard is a whole level, '#' only the last one
+    while (true)
+    {
+        size_t dot = pattern.find('.');
+        string_view level = pattern.substr(0, dot);
+        if (is_pattern(level) && level != "*" && (level != "#" || dot != string_view::npos))
+        {
+            return false;
+        }
+        if (dot == string_view::npos)
+        {
+            return true;
+        }
+        pattern.remove_prefix(dot + 1);
+    }
+}
+
+bool update_pattern(TopicNode &node, string_view pattern, NameId user, bool add)
+{
+    size_t dot = pattern.find('.');
+    string_view level = pattern.substr(0, dot);
+    if (level == "#")
+    {
+        return update_members(node.rest, user, add);
+    }
+
+    unique_ptr<TopicNode> *child = &node.any;
+    if (level != "*")
+    {
+        auto entry = node.next.find(level);
+        if (entry == node.next.end() && add)
+        {
+            entry = node.next.try_emplace(string(level)).first;
+        }
+        child = (entry == node.next.end()) ? nullptr : &entry->second;
+    }
+    if (child == nullptr || (*child == nullptr && !add))
+    {
+        return false;
+    }
+    if (*child == nullptr)
+    {
+        *child = make_unique<TopicNode>();
+    }
+    TopicNode &below = **child;
+    bool changed = (dot == string_view::npos) ? update_members(below.here, user, add)
+                                               : update_pattern(below, pattern.substr(dot + 1), user, add);
+
+    // a node no pattern runs through any more is dropped, the trie only holds live subscriptions
+    if (below.here == nullptr && below.rest == nullptr && below.any == nullptr && below.next.empty())
+    {
+        if (level == "*")
+        {
+            node.any = nullptr;
+        }
+        else
+        {
+            node.next.erase(node.next.find(level));
+        }
+    }
+    return changed;
+}
+
+bool update_members(shared_ptr<const MemberList> &slot, NameId user, bool add)
+{
+    static const MemberList none;
+    const MemberList &members = (slot != nullptr) ? *slot : none;
+    auto pos = lower_bound(members.begin(), members.end(), user);
+    bool present = pos != members.end() && *pos == user;
+    if (present == add)
+    {
+        return false;
+    }
+
+    // published like a group's member list, a fan-out still walking the old one keeps it alive
+    auto updated = make_shared<MemberList>();
+    updated->reserve(members.size() + 1);
+    updated->insert(updated->end(), members.begin(), pos);
+    if (add)
+    {
+        updated->push_back(user);
+    }
+    updated->insert(updated->end(), add ? pos : pos + 1, members.end());
+    slot = updated->empty() ? nullptr : move(updated);
+    return true;
+}
+
+GroupStatus change_subscription(string_view pattern, NameId user, bool add)
+{
+    if (!valid_pattern(pattern))
+    {
+        return BAD_NAME;
+    }
+    unique_lock<shared_mutex> lock(topics.lock);
+    if (!update_pattern(topics.root, pattern, user, add))
+    {
+        return add ? ALREADY_MEMBER : NOT_MEMBER;
+    }
+    vector<string> &patterns = topics.by_user[user];
+    if (add)
+    {
+        patterns.emplace_back(pattern);
+        topics.subscriptions.fetch_add(1, memory_order_release);
+    }
+    else
+    {
+        patterns.erase(find(patterns.begin(), patterns.end(), pattern));
+        topics.subscriptions.fetch_sub(1, memory_order_release);
+        if (patterns.empty())
+        {
+            topics.by_user.erase(user);
+        }
+    }
+    // every cached match may have changed, they are matched again on their next group message
+    unique_lock<shared_mutex> cached(topics.cache_lock);
+    topics.matches.clear();
+    return GROUP_OK;
+}
+
+GroupStatus subscribe(string_view pattern, NameId user)
+{
+    return change_subscription(pattern, user, true);
+}
+
+GroupStatus unsubscribe(string_view pattern, NameId user)
+{
+    return change_subscription(pattern, user, false);
+}
+
+void match_topic(const TopicNode &node, string_view topic, vector<shared_ptr<const MemberList>> &found)
+{
+    if (node.rest != nullptr)
+    {
+        found.push_back(node.rest); // '#' matches the remaining levels
+    }
+    size_t dot = topic.find('.');
+    auto visit = [&](const TopicNode &below)
+    {
+        if (dot != string_view::npos)
+        {
+            match_topic(below, topic.substr(dot + 1), found);
+            return;
+        }
+        // the topic ends here, a '#' after this level matches no level at all
+        for (const shared_ptr<const MemberList> *members : {&below.here, &below.rest})
+        {
+            if (*members != nullptr)
+            {
+                found.push_back(*members);
+            }
+        }
+    };
+    auto entry = node.next.find(topic.substr(0, dot));
+    if (entry != node.next.end())
+    {
+        visit(*entry->second);
+    }
+    if (node.any != nullptr)
+    {
+        visit(*node.any);
+    }
+}
+
+shared_ptr<const MemberList> topic_subscribers(NameId group)
+{
+    if (topics.subscriptions.load(memory_order_acquire) == 0)
+    {
+        return nullptr;
+    }
+    shared_lock<shared_mutex> lock(topics.lock);
+    {
+        shared_lock<shared_mutex> cached(topics.cache_lock);
+        auto entry = topics.matches.find(group);
+        if (entry != topics.matches.end())
+        {
+            bump(my_metrics().topic_cache[0]);
+            return entry->second;
+        }
+    }
+    bump(my_metrics().topic_cache[1]);
+
+    vector<shared_ptr<const MemberList>> found;
+    match_topic(topics.root, name_of(group_names, group), found);
+    shared_ptr<const MemberList> subscribers;
+    if (found.size() == 1)
+    {
+        subscribers = move(found[0]); // a single pattern matched, its list is shared as it is
+    }
+    else if (found.size() > 1)
+    {
+        // a user with several matching patterns gets the message once
+        auto merged = make_shared<MemberList>();
+        for (auto &members : found)
+        {
+            size_t middle = merged->size();
+            merged->insert(merged->end(), members->begin(), members->end());
+            inplace_merge(merged->begin(), merged->begin() + middle, merged->end());
+        }
+        merged->erase(unique(merged->begin(), merged->end()), merged->end());
+        subscribers = move(merged);
+    }
+
+    // the shared lock on the trie keeps a subscribe from clearing the cache before this is added
+    unique_lock<shared_mutex> cached(topics.cache_lock);
+    if (topics.matches.size() >= TOPIC_CACHE_SZ)
+    {
+        topics.matches.clear();
+    }
+    topics.matches.emplace(group, subscribers);
+    return subscribers;
+}
+
+shared_ptr<const CredStore> load_credentials()
+{
+    auto store = make_shared<CredStore>();
+    int fd = open(CRED_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            // populated up front, logins never fault the table in
+            store->map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            store->map_size = st.st_size;
+        }
+        close(fd); // the mapping keeps the file alive
+        if (store->map == MAP_FAILED || !store->table.open((const char *)store->map, store->map_size))
+        {
+            cerr << "Error : " CRED_FILE " is not a valid credential file, rebuild it with make_credentials.\n";
+            return nullptr;
+        }
+        cout << "Loaded " << store->table.users() << " users from " CRED_FILE << endl;
+        return store;
+    }
+    if (errno != ENOENT)
+    {
+        perror("Error opening " CRED_FILE);
+        return nullptr;
+    }
+
+    // no precompiled file, hash the plain text one in memory
+    ifstream file(USERS_FILE);
+    if (!file)
+    {
+        perror("Error opening file.");
+    }
+    vector<pair<string, string>> users;
+    string line;
+    while (getline(file, line))
+    {
+        size_t pos = line.find(':');
+        if (pos != string ::npos)
+        {
+            users.emplace_back(line.substr(0, pos), line.substr(pos + 1));
+        }
+    }
+    // one PBKDF2 iteration is enough, the passwords are on disk in the clear anyway
+    store->image = build_credentials(users, 1, max(1u, thread::hardware_concurrency()));
+    if (!store->table.open(store->image.data(), store->image.size()))
+    {
+        cerr << "Error : could not hash the passwords of " USERS_FILE ".\n";
+        return nullptr;
+    }
+    cout << "Loaded " << store->table.users() << " users from " USERS_FILE << endl;
+    return store;
+}
+
+void signal_loop()
+{
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    for (int sig : {SIGHUP, SIGINT, SIGTERM})
+    {
+        sigaddset(&sigs, sig);
+    }
+    bool stopping = false;
+    int sig;
+    while (sigwait(&sigs, &sig) == 0)
+    {
+        if (sig == SIGHUP)
+        {
+            // the new table is complete before it is published, logins keep using the old one until then
+            shared_ptr<const CredStore> store = load_credentials();
+            if (store == nullptr)
+            {
+                cerr << "Keeping the current credentials.\n";
+                continue;
+            }
+            atomic_store(&credentials, store);
+            continue;
+        }
+        if (stopping)
+        {
+            // a second Ctrl+C does not wait for slow clients
+            cerr << "\nCaught signal " << sig << " again, exiting now.\n";
+            _exit(1);
+        }
+        stopping = true;
+        thread shutdown_thread(shut_down, sig);
+        shutdown_thread.detach();
+    }
+}
+
+void shut_down(int sig)
+{
+    lock_guard<mutex> lock(lifecycle_lock); // a hot upgrade in progress finishes or fails first
+    cout << "\nCaught signal " << sig << " (" << strsignal(sig) << "). Shutting down gracefully..." << endl;
+
+    // no new clients, the connected ones are told and get what was queued for them
+    set_reactor_mode(REACTOR_DRAIN);
+    broadcast("\033[93mThe server is shutting down.\033[0m", -1);
+    if (!wait_for_senders(DRAIN_MS, true))
+    {
+        cout << "Some clients did not read everything queued for them." << endl;
+    }
+
+    // nothing is read from here on, every socket is closed after its last message (and close_notify)
+    set_reactor_mode(REACTOR_PARK);
+    vector<int> sockets;
+    for (auto &shard : client_set)
+    {
+        lock_guard<mutex> shard_lock(shard.lock);
+        for (auto &[fd, stats] : shard.sockets)
+        {
+            sockets.push_back(fd);
+        }
+    }
+    for (int fd : sockets)
+    {
+        close_client(fd);
+    }
+    wait_for_senders(DRAIN_MS, false);
+    stop_log();
+    flush_trace();
+    cout << "Closed " << sockets.size() << " client sockets." << endl;
+    cout << "Message bytes copied: " << bytes_copied << ", shared by reference: " << bytes_referenced << endl;
+    cout << "Server shutdown complete." << endl;
+    _exit(0);
+}
+
+void set_reactor_mode(ReactorMode mode)
+{
+    unique_lock<mutex> lock(reactor_control.mtx);
+    for (Reactor *reactor : reactor_control.reactors)
+    {
+        reactor->mode = mode;
+        uint64_t one = 1;
+        ssize_t ret = write(reactor->event_fd, &one, sizeof(one));
+        (void)ret;
+    }
+    reactor_control.changed.notify_all();
+
+    // the caller may touch the sessions of parked reactors once every one of them is parked
+    if (mode == REACTOR_PARK)
+    {
+        reactor_control.changed.wait(lock, [] { return reactor_control.parked == reactor_control.reactors.size(); });
+    }
+}
+
+bool wait_for_senders(int timeout_ms, bool outboxes)
+{
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    while (1)
+    {
+        bool idle = true;
+        for (SenderWorker *worker : senders)
+        {
+            lock_guard<mutex> lock(worker->mtx);
+            idle = idle && worker->queue.empty() && !worker->busy;
+        }
+        for (size_t i = 0; i < NUM_SHARDS && idle && outboxes; i++)
+        {
+            lock_guard<mutex> lock(client_set[i].lock);
+            for (auto &[fd, stats] : client_set[i].sockets)
+            {
+                idle = idle && stats->bytes.load(memory_order_relaxed) == 0;
+            }
+        }
+        if (idle)
+        {
+            return true;
+        }
+        if (chrono::steady_clock::now() >= deadline)
+        {
+            return false;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+}
+
+void stop_log()
+{
+    submit_log({LOG_STOP, "", nullptr, -1, NO_NAME, NO_NAME, 0});
+    unique_lock<mutex> lock(log_queue.mtx);
+    log_queue.ended.wait(lock, [] { return !log_queue.running; });
+}
+
+void start_log()
+{
+    {
+        lock_guard<mutex> lock(log_queue.mtx);
+        log_queue.running = true;
+    }
+    thread log_thread(log_loop);
+    log_thread.detach();
+}
+
+bool lock_log_dir()
+{
+    string path = log_dir + "/server.lock";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror(("Error opening " + path).c_str());
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    log_lock_fd = fd;
+    return true;
+}
+
+bool adopt_log_lock(int fd)
+{
+    // the lock belongs to the open file, so the descriptor of the old process holds it for this one too
+    struct stat held, ours;
+    string path = log_dir + "/server.lock";
+    if (fd < 0 || fstat(fd, &held) < 0 || stat(path.c_str(), &ours) < 0 || held.st_dev != ours.st_dev ||
+        held.st_ino != ours.st_ino)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    log_lock_fd = fd;
+    return true;
+}
+
+int adopt_listener(int fd, int port)
+{
+    if (fd < 0)
+    {
+        return -1;
+    }
+    // a listener of the old process is only kept if this one serves the same port
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    if (port == 0 || getsockname(fd, (struct sockaddr *)&addr, &len) < 0 || addr.sin_family != AF_INET ||
+        ntohs(addr.sin_port) != port)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int create_control_listener()
+{
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("Control socket creation failed.");
+        return -1;
+    }
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, control_path.c_str());
+
+    // the path of an old process that handed over, or of one that crashed, is taken over
+    unlink(control_path.c_str());
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(control_path.c_str(), 0600) < 0 ||
+        listen(fd, 1) < 0)
+    {
+        perror(("Control socket binding error " + control_path).c_str());
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void upgrade_loop(int listen_fd)
+{
+    while (1)
+    {
+        int conn = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("Control socket accept failed");
+            return;
+        }
+
+        // only a process of the same user gets the sockets, and a stuck one is given up on
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid())
+        {
+            cerr << "Rejected a hot upgrade from another user.\n";
+            close(conn);
+            continue;
+        }
+        struct timeval timeout = {HANDOFF_TIMEOUT, 0};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        lock_guard<mutex> lock(lifecycle_lock);
+        cout << "Handing the server over to process " << cred.pid << "..." << endl;
+        if (!hand_off(conn))
+        {
+            cerr << "Process " << cred.pid << " did not take over, serving on.\n";
+        }
+        close(conn);
+    }
+}
+
+bool hand_off(int conn)
+{
+    // nothing reads from the clients or writes the log until the new process took over or gave up
+    set_reactor_mode(REACTOR_PARK);
+    stop_log();
+    flush_trace(); // the trace of this process ends here if the new one takes over
+    {
+        lock_guard<mutex> lock(handoff.mtx);
+        handoff.workers = 0;
+        handoff.boxes.clear();
+    }
+    for (int i = 0; i < num_senders; i++)
+    {
+        enqueue(i, nullptr, OUT_EXPORT); // socket i belongs to worker i
+    }
+    {
+        unique_lock<mutex> lock(handoff.mtx);
+        handoff.exported.wait(lock, [] { return handoff.workers == num_senders; });
+    }
+
+    // plain TCP sessions move, the keys of a TLS session cannot leave this process and a login in
+    // flight belongs to an auth worker, those clients have to connect again
+    vector<Session *> moving;
+    vector<Session *> staying;
+    unordered_set<NameId> left_behind;
+    for (Reactor *reactor : reactor_control.reactors)
+    {
+        for (Session *session : reactor->sessions)
+        {
+            bool moves = session->tls == nullptr && session->state != AUTHENTICATING;
+            (moves ? moving : staying).push_back(session);
+            if (!moves && session->state == ACTIVE)
+            {
+                left_behind.insert(session->user_id);
+            }
+        }
+    }
+
+    auto send_listener = [conn](ListenerKind kind, int fd)
+    {
+        string payload;
+        put_u32(payload, kind);
+        return fd < 0 || send_handoff(conn, HANDOFF_LISTENER, payload, fd);
+    };
+    auto send_chunks = [conn](uint8_t op, string_view bytes)
+    {
+        for (size_t off = 0; off < bytes.size(); off += HANDOFF_CHUNK_SZ)
+        {
+            if (!send_handoff(conn, op, bytes.substr(off, HANDOFF_CHUNK_SZ)))
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+    bool sent = true;
+    for (Reactor *reactor : reactor_control.reactors)
+    {
+        sent = sent && send_listener(LISTEN_CLIENT, reactor->listen_fd);
+    }
+    sent = sent && send_listener(LISTEN_PEER, peer_listen_fd) && send_listener(LISTEN_METRICS, metrics_listen_fd);
+    sent = sent && send_handoff(conn, HANDOFF_LOCK, "", log_lock_fd);
+    unsigned char keys[80];
+    if (sent && tls_ctx != nullptr && SSL_CTX_get_tlsext_ticket_keys(tls_ctx, keys, sizeof(keys)) == 1)
+    {
+        sent = send_handoff(conn, HANDOFF_TICKET_KEYS, string_view((char *)keys, sizeof(keys)));
+        OPENSSL_cleanse(keys, sizeof(keys));
+    }
+
+    // every group with its members, except the users that have to log in again
+    for (size_t i = 0; i < NUM_SHARDS && sent; i++)
+    {
+        vector<pair<NameId, shared_ptr<const MemberList>>> groups;
+        {
+            shared_lock<shared_mutex> lock(groupToMembers[i].lock);
+            groups.assign(groupToMembers[i].members.begin(), groupToMembers[i].members.end());
+        }
+        for (auto &[group, members] : groups)
+        {
+            string payload;
+            put_str(payload, name_of(group_names, group));
+            size_t head = payload.size();
+            for (NameId member : *members)
+            {
+                if (left_behind.contains(member))
+                {
+                    continue;
+                }
+                put_str(payload, name_of(user_names, member));
+                if (payload.size() >= HANDOFF_CHUNK_SZ)
+                {
+                    sent = sent && send_handoff(conn, HANDOFF_GROUP, payload);
+                    payload.resize(head);
+                }
+            }
+            sent = sent && send_handoff(conn, HANDOFF_GROUP, payload);
+        }
+    }
+    vector<pair<NameId, vector<string>>> subscriptions;
+    {
+        shared_lock<shared_mutex> lock(topics.lock);
+        subscriptions.assign(topics.by_user.begin(), topics.by_user.end());
+    }
+    for (auto &[user, patterns] : subscriptions)
+    {
+        for (const string &pattern : patterns)
+        {
+            if (sent && !left_behind.contains(user))
+            {
+                string payload;
+                put_str(payload, pattern);
+                put_str(payload, name_of(user_names, user));
+                sent = send_handoff(conn, HANDOFF_GROUP, payload);
+            }
+        }
+    }
+    vector<pair<NameId, int>> windows;
+    {
+        lock_guard<mutex> lock(presence.mtx);
+        windows.assign(presence.windows.begin(), presence.windows.end());
+    }
+    for (auto &[group, window] : windows)
+    {
+        string payload;
+        put_str(payload, name_of(group_names, group));
+        put_u32(payload, window);
+        sent = sent && send_handoff(conn, HANDOFF_PRESENCE, payload);
+    }
+
+    // each session with the input it left unhandled and the output queued for it
+    for (Session *session : moving)
+    {
+        auto box = handoff.boxes.find(session->fd);
+        string payload;
+        put_u32(payload, session->state);
+        put_u32(payload, session->framed);
+        put_u32(payload, box != handoff.boxes.end() && box->second.deflate);
+        put_u32(payload, session->addr);
+        put_str(payload, session->username);
+        RingBuffer &in = session->parser.buffer();
+        string input(in.size(), '\0');
+        in.peek(0, input.data(), input.size());
+        sent = sent && send_handoff(conn, HANDOFF_SESSION, payload, session->fd) && send_chunks(HANDOFF_INPUT, input) &&
+               (box == handoff.boxes.end() || send_chunks(HANDOFF_OUTPUT, box->second.bytes));
+    }
+    string end;
+    put_u32(end, moving.size());
+    sent = sent && send_handoff(conn, HANDOFF_END, end);
+
+    // the new process confirms, and is told in turn that this one will not resume
+    string buf;
+    Frame frame;
+    int fd = -1;
+    bool ready = sent && recv_handoff(conn, buf, frame, fd) && frame.opcode == HANDOFF_READY &&
+                 send_handoff(conn, HANDOFF_READY, "");
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (!ready)
+    {
+        for (auto &[client_sock, box] : handoff.boxes)
+        {
+            shared_ptr<QueueStats> stats = find_client(client_sock);
+            if (stats == nullptr)
+            {
+                continue;
+            }
+            enqueue(client_sock, make_payload(move(box.bytes)), OUT_RESTORE, move(stats));
+            if (box.framed)
+            {
+                set_framed(client_sock);
+            }
+            if (box.deflate)
+            {
+                enqueue(client_sock, nullptr, OUT_COMPRESS);
+            }
+        }
+        handoff.boxes.clear();
+        start_log();
+        set_reactor_mode(REACTOR_RUN);
+        return false;
+    }
+
+    // the sessions that could not move are told to come back, their new session is with the new process
+    for (Session *session : staying)
+    {
+        if (session->tls != nullptr && session->state != TLS_HANDSHAKE)
+        {
+            send_message(session->fd, "\033[93mThe server is restarting, please log in again.\033[0m");
+        }
+        close_client(session->fd);
+    }
+    wait_for_senders(DRAIN_MS, false);
+    cout << "Handed " << moving.size() << " sessions over, " << staying.size() << " have to log in again. Exiting."
+         << endl;
+    _exit(0);
+}
+
+bool take_over(Takeover &taken)
+{
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, control_path.c_str());
+    if (conn < 0 || connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        // nobody serves the path, a fresh start
+        if (conn >= 0)
+        {
+            close(conn);
+        }
+        return true;
+    }
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != geteuid())
+    {
+        cerr << "Error : " << control_path << " is served by another user.\n";
+        close(conn);
+        return false;
+    }
+    struct timeval timeout = {HANDOFF_TIMEOUT, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    cout << "Taking over from process " << cred.pid << "..." << endl;
+
+    string buf;
+    Frame frame;
+    int fd;
+    bool ended = false;
+    while (!ended && recv_handoff(conn, buf, frame, fd))
+    {
+        string_view in = frame.payload;
+        uint32_t kind, state, framed, deflate, client_addr;
+        string_view name;
+        if (frame.opcode == HANDOFF_LISTENER && fd >= 0 && get_u32(in, kind) && kind <= LISTEN_METRICS)
+        {
+            if (kind == LISTEN_CLIENT)
+            {
+                taken.clients.push_back(fd);
+            }
+            else
+            {
+                (kind == LISTEN_PEER ? taken.peer : taken.metrics) = fd;
+            }
+            fd = -1;
+        }
+        else if (frame.opcode == HANDOFF_LOCK && fd >= 0 && taken.lock < 0)
+        {
+            taken.lock = fd;
+            fd = -1;
+        }
+        else if (frame.opcode == HANDOFF_TICKET_KEYS)
+        {
+            if (tls_ctx != nullptr)
+            {
+                SSL_CTX_set_tlsext_ticket_keys(tls_ctx, (void *)frame.payload.data(), frame.payload.size());
+            }
+        }
+        else if (frame.opcode == HANDOFF_GROUP && get_str(in, name))
+        {
+            bool pattern = is_pattern(name); // a wildcard subscription
+            if (!pattern)
+            {
+                create_group(name, NO_NAME);
+            }
+            NameId group = pattern ? NO_NAME : lookup(group_names, name);
+            string_view member;
+            while ((pattern || group != NO_NAME) && get_str(in, member))
+            {
+                NameId user = intern(user_names, member);
+                pattern ? subscribe(name, user) : join_group(group, user);
+            }
+        }
+        else if (frame.opcode == HANDOFF_PRESENCE && get_str(in, name) && get_u32(in, kind))
+        {
+            NameId group = lookup(group_names, name);
+            if (group != NO_NAME && kind <= PRESENCE_MAX_MS)
+            {
+                set_presence_window(group, kind);
+            }
+        }
+        else if (frame.opcode == HANDOFF_SESSION && fd >= 0 && get_u32(in, state) && get_u32(in, framed) &&
+                 get_u32(in, deflate) && get_u32(in, client_addr) && get_str(in, name))
+        {
+            taken.sessions.push_back(new Session{fd, nullptr, client_addr, (SessionState)state, string(name), NO_NAME,
+                                                 framed != 0, FrameParser(), Arena(), nullptr});
+            taken.outputs.push_back({"", framed != 0, deflate != 0});
+            fd = -1;
+        }
+        else if (frame.opcode == HANDOFF_INPUT && !taken.sessions.empty())
+        {
+            RingBuffer &ring = taken.sessions.back()->parser.buffer();
+            auto [dst, space] = ring.write_space(frame.payload.size());
+            memcpy(dst, frame.payload.data(), frame.payload.size());
+            ring.commit(frame.payload.size());
+        }
+        else if (frame.opcode == HANDOFF_OUTPUT && !taken.sessions.empty())
+        {
+            taken.outputs.back().bytes.append(frame.payload);
+        }
+        else if (frame.opcode == HANDOFF_END)
+        {
+            ended = true;
+        }
+        else
+        {
+            break; // not something an old process sends
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    if (!ended)
+    {
+        // the old process serves on once this one is gone
+        cerr << "Error : the hand over from process " << cred.pid << " broke off.\n";
+        return false;
+    }
+    taken.conn = conn;
+    return true;
+}
+
+void adopt_sessions(Takeover &taken)
+{
+    size_t n = reactor_control.reactors.size();
+    for (size_t i = 0; i < taken.sessions.size(); i++)
+    {
+        Session *session = taken.sessions[i];
+        ExportedBox &box = taken.outputs[i];
+        auto stats = make_shared<QueueStats>();
+        add_client(session->fd, stats);
+        enqueue(session->fd, make_payload(move(box.bytes)), OUT_RESTORE, move(stats));
+        if (box.framed)
+        {
+            set_framed(session->fd);
+        }
+        if (box.deflate)
+        {
+            enqueue(session->fd, nullptr, OUT_COMPRESS);
+        }
+        if (session->state == ACTIVE)
+        {
+            session->user_id = intern(user_names, session->username);
+            add_user(session->user_id, session->fd);
+            trace_login(*session); // the trace of this process starts with the sessions it took over
+        }
+
+        // round robin, the reactors are not running yet
+        session->reactor = reactor_control.reactors[i % n];
+        if (!watch_session(session))
+        {
+            perror("epoll_ctl failed");
+            if (session->state == ACTIVE)
+            {
+                remove_user(session->user_id, session->fd);
+            }
+            end_session(session);
+            continue;
+        }
+        session->reactor->sessions.insert(session);
+    }
+    cout << "Took over " << taken.sessions.size() << " sessions." << endl;
+}
+
+void export_outboxes(SenderWorker *worker)
+{
+    unordered_map<int, ExportedBox> boxes;
+    for (auto it = worker->outboxes.begin(); it != worker->outboxes.end();)
+    {
+        int fd = it->first;
+        Outbox &box = it->second;
+        if (box.tls != nullptr)
+        {
+            ++it;
+            continue;
+        }
+
+        // whatever the socket takes right away is written here, the rest moves as bytes
+        if (!box.blocked && !box.failed && !flush_outbox(worker, fd, box))
+        {
+            fail_outbox(worker, fd, box);
+        }
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        ExportedBox &out = boxes[fd];
+        out.framed = box.framed;
+        out.deflate = box.deflate;
+        out.bytes.reserve(box.bytes + box.offset);
+        for (const Pending &pending : box.pending)
+        {
+            if (pending.opcode != 0)
+            {
+                unsigned char hdr[FRAME_HDR_SZ];
+                encode_frame_header(hdr, pending.opcode, pending.data->size());
+                out.bytes.append((char *)hdr, FRAME_HDR_SZ);
+            }
+            out.bytes.append(*pending.data);
+        }
+        out.bytes.erase(0, box.offset);
+        it = worker->outboxes.erase(it);
+    }
+    lock_guard<mutex> lock(handoff.mtx);
+    handoff.boxes.merge(boxes);
+    handoff.workers++;
+    handoff.exported.notify_all();
+}
+
+bool send_handoff(int conn, uint8_t op, string_view payload, int fd)
+{
+    string frame = encode_frame(op, payload);
+    struct iovec iov = {frame.data(), frame.size()};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    if (fd >= 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t sent;
+    while ((sent = sendmsg(conn, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+    {
+    }
+    return sent == (ssize_t)frame.size();
+}
+
+bool recv_handoff(int conn, string &buf, Frame &frame, int &fd)
+{
+    // a message is at most a chunk and a name longer than HANDOFF_CHUNK_SZ
+    buf.resize(FRAME_HDR_SZ + 2 * HANDOFF_CHUNK_SZ);
+    struct iovec iov = {buf.data(), buf.size()};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t len;
+    while ((len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    {
+    }
+    fd = -1;
+    struct cmsghdr *cmsg = (len >= 0) ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    const unsigned char *hdr = (const unsigned char *)buf.data();
+    uint32_t payload_len = (len < FRAME_HDR_SZ) ? 0 : ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) | ((uint32_t)hdr[2] << 8) | hdr[3];
+    if (len < FRAME_HDR_SZ || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || payload_len != len - FRAME_HDR_SZ)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        return false;
+    }
+    frame.opcode = hdr[4];
+    frame.payload = string_view(buf.data() + FRAME_HDR_SZ, payload_len);
+    return true;
+}
+
+void put_u32(string &out, uint32_t value)
+{
+    char bytes[4] = {(char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+    out.append(bytes, sizeof(bytes));
+}
+
+void put_str(string &out, string_view value)
+{
+    put_u32(out, value.size());
+    out.append(value);
+}
+
+bool get_u32(string_view &in, uint32_t &value)
+{
+    if (in.size() < 4)
+    {
+        return false;
+    }
+    const unsigned char *bytes = (const unsigned char *)in.data();
+    value = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    in.remove_prefix(4);
+    return true;
+}
+
+bool get_str(string_view &in, string_view &value)
+{
+    uint32_t len;
+    if (!get_u32(in, len) || in.size() < len)
+    {
+        return false;
+    }
+    value = in.substr(0, len);
+    in.remove_prefix(len);
+    return true;
+}
+void start_auth_workers()
+{
+    for (int i = 0; i < num_auth; i++)
+    {
+        thread auth_thread(auth_loop);
+        auth_thread.detach();
+    }
+}
+
+void auth_loop()
+{
+    while (1)
+    {
+        AuthRequest request;
+        {
+            unique_lock<mutex> lock(auth_queue.mtx);
+            auth_queue.not_empty.wait(lock, [] { return !auth_queue.requests.empty(); });
+            request = move(auth_queue.requests.front());
+            auth_queue.requests.pop_front();
+        }
+
+        // the expensive part, kept off the reactors so logins never delay chat traffic
+        bool ok;
+        if (request.tls != nullptr)
+        {
+            ok = handshake_step(request); // signing for the certificate costs about as much as a hash
+        }
+        else
+        {
+            shared_ptr<const CredStore> creds = atomic_load(&credentials);
+            uint64_t start = now_ns();
+            ok = creds->table.verify(request.username, request.password);
+            OPENSSL_cleanse(request.password.data(), request.password.size());
+            ThreadMetrics &metrics = my_metrics();
+            record(metrics.auth_ns, now_ns() - start);
+            bump(metrics.logins[ok ? LOGIN_OK : LOGIN_FAILED]);
+        }
+
+        Reactor *reactor = request.reactor;
+        bool was_empty;
+        {
+            lock_guard<mutex> lock(reactor->mtx);
+            was_empty = reactor->auth_done.empty();
+            reactor->auth_done.emplace_back(request.session, ok);
+        }
+        if (was_empty) // the reactor takes all verdicts per wakeup, only the first one needs to wake it
+        {
+            uint64_t one = 1;
+            ssize_t ret = write(reactor->event_fd, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+}
+
+bool allow_login(uint32_t addr)
+{
+    if (login_rate <= 0)
+    {
+        return true;
+    }
+    double burst = max((double)LOGIN_BURST, login_rate);
+    auto now = chrono::steady_clock::now();
+    auto refilled = [&](const LoginBucket &bucket)
+    {
+        return min(burst, bucket.tokens + chrono::duration<double>(now - bucket.last).count() * login_rate);
+    };
+
+    LoginShard &shard = login_limits[ntohl(addr) & (NUM_SHARDS - 1)];
+    lock_guard<mutex> lock(shard.mtx);
+    if (shard.buckets.size() >= shard.prune_at)
+    {
+        // a full bucket is the same as no bucket, forget those addresses
+        erase_if(shard.buckets, [&](auto &entry) { return refilled(entry.second) >= burst; });
+        shard.prune_at = max((size_t)LOGIN_SHARD_MAX, 2 * shard.buckets.size());
+    }
+    LoginBucket &bucket = shard.buckets.try_emplace(addr, LoginBucket{burst, now}).first->second;
+    bucket.tokens = refilled(bucket);
+    bucket.last = now;
+    if (bucket.tokens < 1)
+    {
+        return false;
+    }
+    bucket.tokens -= 1;
+    return true;
+}
+
+uint64_t take_tokens(RateBucket &bucket, const RateLimit &limit, double cost)
+{
+    if (limit.rate <= 0)
+    {
+        return 0;
+    }
+    double token_ns = 1e9 / limit.rate;
+    uint64_t need = min(cost, limit.burst) * token_ns; // a cost above the burst empties a full bucket
+    uint64_t window = limit.burst * token_ns;          // full_at is at most this far ahead of now
+    uint64_t now = now_ns();
+    uint64_t full_at = bucket.full_at.load(memory_order_relaxed);
+    while (1)
+    {
+        uint64_t next = max(full_at, now) + need;
+        if (next > now + window)
+        {
+            return next - now - window; // rejected without a write, a flood does not contend on the bucket
+        }
+        if (bucket.full_at.compare_exchange_weak(full_at, next, memory_order_relaxed))
+        {
+            return 0;
+        }
+    }
+}
+
+void return_tokens(RateBucket &bucket, const RateLimit &limit, double cost)
+{
+    if (limit.rate <= 0)
+    {
+        return;
+    }
+    uint64_t need = min(cost, limit.burst) * (1e9 / limit.rate);
+    uint64_t full_at = bucket.full_at.load(memory_order_relaxed);
+    while (!bucket.full_at.compare_exchange_weak(full_at, full_at - min(full_at, need), memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t take_group_tokens(NameId group)
+{
+    GroupShard &shard = groupToMembers[shard_of(group)];
+    shared_lock<shared_mutex> lock(shard.lock);
+    auto entry = shard.limits.find(group);
+    return (entry == shard.limits.end()) ? 0 : take_tokens(entry->second, group_limit, 1);
+}
+
+void return_group_tokens(NameId group)
+{
+    GroupShard &shard = groupToMembers[shard_of(group)];
+    shared_lock<shared_mutex> lock(shard.lock);
+    auto entry = shard.limits.find(group);
+    if (entry != shard.limits.end())
+    {
+        return_tokens(entry->second, group_limit, 1);
+    }
+}
+
+uint64_t rate_wait(Session &session, uint8_t opcode, string_view message, RateLimitKind &kind)
+{
+    if (opcode == OP_EXIT)
+    {
+        return 0; // leaving is never held back
+    }
+    kind = LIMIT_SESSION;
+    uint64_t wait = take_tokens(session.bucket, command_limit, 1);
+    if (wait != 0 || (opcode != OP_BROADCAST && opcode != OP_GROUP_MSG))
+    {
+        return wait;
+    }
+
+    // the recipients are counted before the fan-out, one over the limits never starts. A command that
+    // does not run gives back what it took, so a held back command pays every bucket once, when it runs.
+    size_t recipients = online_users.load(memory_order_relaxed);
+    NameId group = NO_NAME;
+    if (opcode == OP_GROUP_MSG)
+    {
+        string_view group_name = first_word(message);
+        group = isEmpty(group_name) ? NO_NAME : lookup(group_names, group_name);
+        if (group == NO_NAME)
+        {
+            return 0; // answered with an error, nothing is sent
+        }
+        kind = LIMIT_GROUP;
+        if ((wait = take_group_tokens(group)) != 0)
+        {
+            return_tokens(session.bucket, command_limit, 1);
+            return wait;
+        }
+        if (fanout_limit.rate <= 0)
+        {
+            return 0;
+        }
+        shared_ptr<const MemberList> members = group_snapshot(group);
+        shared_ptr<const MemberList> subscribers = topic_subscribers(group);
+        recipients = (members ? members->size() : 0) + (subscribers ? subscribers->size() : 0);
+    }
+    kind = LIMIT_FANOUT;
+    if ((wait = take_tokens(fanout_budget, fanout_limit, recipients)) != 0)
+    {
+        return_tokens(session.bucket, command_limit, 1);
+        if (group != NO_NAME)
+        {
+            return_group_tokens(group);
+        }
+    }
+    return wait;
+}
+
+bool rate_limited(Session &session, RateLimitKind kind, uint64_t wait)
+{
+    bump(my_metrics().rate_limited[kind]);
+    if (rate_penalty == PENALTY_DELAY)
+    {
+        delay_session(&session, now_ns() + wait);
+        return true;
+    }
+
+    const char *reasons[NUM_LIMITS] = {"You are sending too fast", "This group gets too many messages",
+                                       "The server is delivering too many messages"};
+    if (rate_penalty == PENALTY_DISCONNECT)
+    {
+        send_message(session.fd, concat({"\033[31mError : ", reasons[kind], ", disconnecting.\033[0m"}));
+        handle_exit(session.username, session.user_id, session.fd);
+        return false;
+    }
+    if (!session.limited) // a flood is told once, not once per command
+    {
+        session.limited = true;
+        send_message(session.fd, concat({"\033[31mError : ", reasons[kind], ", messages are dropped.\033[0m"}));
+    }
+    return true;
+}
+
+void delay_session(Session *session, uint64_t until)
+{
+    // the held back command stays buffered and is handled again, its frame is not consumed
+    Reactor *reactor = session->reactor;
+    session->delayed_until = until;
+    session->traced = true; // handled again later, without a second record
+    session->parser.retain();
+    if (session->receiving)
+    {
+        // io_uring: stop receiving, the socket fills up and slows the client down like with epoll
+        if (io_uring_sqe *sqe = reactor->ring->get_sqe())
+        {
+            Uring::prep_cancel(sqe, (uint64_t)session | RING_RECV, RING_CANCEL);
+        }
+    }
+    reactor->delayed.emplace(until, session);
+    if (reactor->delayed.begin()->second == session)
+    {
+        arm_timer(reactor);
+    }
+}
+
+void arm_timer(Reactor *reactor)
+{
+    uint64_t at = reactor->delayed.empty() ? 0 : reactor->delayed.begin()->first; // 0 disarms it
+    struct itimerspec when = {};
+    when.it_value.tv_sec = at / 1000000000;
+    when.it_value.tv_nsec = at % 1000000000;
+    timerfd_settime(reactor->timer_fd, TFD_TIMER_ABSTIME, &when, nullptr);
+}
+
+void resume_delayed(Reactor *reactor)
+{
+    uint64_t expirations;
+    ssize_t ret = read(reactor->timer_fd, &expirations, sizeof(expirations));
+    (void)ret;
+    uint64_t now = now_ns();
+    while (!reactor->delayed.empty() && reactor->delayed.begin()->first <= now)
+    {
+        Session *session = reactor->delayed.begin()->second;
+        reactor->delayed.erase(reactor->delayed.begin());
+        session->delayed_until = 0;
+        if (!process_input(*session))
+        {
+            end_session(session);
+        }
+        else if (session->delayed_until != 0)
+        {
+            continue; // held back again by the next command
+        }
+        else if (session->reactor->ring == nullptr || session->tls != nullptr)
+        {
+            read_client(session); // edge-triggered, what came meanwhile sends no new event
+        }
+        else if (session->input_closed)
+        {
+            hang_up(session, session->input_error);
+        }
+        else if (!session->receiving)
+        {
+            arm_receive(session);
+        }
+    }
+    arm_timer(reactor);
+}
+
+bool start_trace(const char *path)
+{
+    // one trace per process, a process taking over in a hot upgrade is given a file of its own
+    trace_state.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_state.fd < 0 || write(trace_state.fd, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != sizeof(TRACE_MAGIC))
+    {
+        perror((string("Error creating ") + path).c_str());
+        return false;
+    }
+    trace_state.start = now_ns();
+    thread trace_thread(trace_loop);
+    trace_thread.detach();
+    return true;
+}
+
+TraceRing &my_trace_ring()
+{
+    thread_local TraceRing *ring = nullptr;
+    if (ring == nullptr)
+    {
+        ring = new TraceRing();
+        lock_guard<mutex> lock(trace_state.mtx);
+        trace_state.rings.push_back(ring);
+    }
+    return *ring;
+}
+
+void trace(TraceKind kind, uint32_t session, uint8_t opcode, string_view payload)
+{
+    if (trace_state.fd < 0)
+    {
+        return;
+    }
+    TraceRecordHeader header = {};
+    header.time_ns = now_ns() - trace_state.start;
+    header.session = session;
+    header.len = min(payload.size(), (size_t)TRACE_MAX_RECORD);
+    header.kind = kind;
+    header.opcode = opcode;
+    // a full ring costs the record, never a wait on the trace thread
+    bump(my_metrics().traced[my_trace_ring().push(header, payload.substr(0, header.len)) ? 0 : 1]);
+}
+
+void trace_login(Session &session)
+{
+    if (trace_state.fd >= 0)
+    {
+        session.trace_id = trace_state.sessions.fetch_add(1, memory_order_relaxed) + 1;
+        trace(TRACE_LOGIN, session.trace_id, 0, session.username); // the password is never recorded
+    }
+}
+
+void trace_loop()
+{
+    while (1)
+    {
+        this_thread::sleep_for(chrono::milliseconds(TRACE_FLUSH_MS));
+        flush_trace();
+    }
+}
+
+void flush_trace()
+{
+    if (trace_state.fd < 0)
+    {
+        return;
+    }
+    lock_guard<mutex> lock(trace_state.mtx);
+    string out;
+    for (TraceRing *ring : trace_state.rings)
+    {
+        ring->drain(out);
+    }
+    size_t done = 0;
+    while (done < out.size())
+    {
+        ssize_t n = write(trace_state.fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            perror("Error writing the trace");
+            break;
+        }
+        done += n;
+    }
+}
+
+bool submit_login(Session &session, string_view passwd)
+{
+    unique_lock<mutex> lock(auth_queue.mtx);
+    if (auth_queue.requests.size() >= AUTH_QUEUE_SZ)
+    {
+        return false; // turned away at once, a login flood never blocks the reactor
+    }
+    auth_queue.requests.push_back({&session, session.reactor, session.username, string(passwd), nullptr});
+    lock.unlock();
+    auth_queue.not_empty.notify_one();
+    return true;
+}
+
+void finish_logins(Reactor *reactor)
+{
+    uint64_t count;
+    ssize_t ret = read(reactor->event_fd, &count, sizeof(count)); // reset the eventfd
+    (void)ret;
+
+    vector<pair<Session *, bool>> done;
+    {
+        lock_guard<mutex> lock(reactor->mtx);
+        done.swap(reactor->auth_done);
+    }
+    for (auto [session, ok] : done)
+    {
+        if (session->state == TLS_HANDSHAKE)
+        {
+            // a handshake step is done, the next step or the username follows
+            session->state = AWAIT_USERNAME;
+            if (!ok)
+            {
+                end_session(session);
+                continue;
+            }
+            read_client(session);
+            continue;
+        }
+        if (!ok)
+        {
+            send_message(session->fd, "Authentication failed.");
+        }
+        if (!ok || !login(*session) ||
+            (session->parser.buffer().size() > 0 && !process_input(*session)))
+        {
+            end_session(session);
+            continue;
+        }
+        read_client(session); // input that arrived during the verification, or the client hanging up
+    }
+}
+
+void start_senders()
+{
+    for (int i = 0; i < num_senders; i++)
+    {
+        SenderWorker *worker = new SenderWorker();
+        worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->event_fd < 0 || worker->epoll_fd < 0)
+        {
+            perror("Sender creation failed");
+            exit(1);
+        }
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = worker->event_fd;
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &ev);
+        if (io_backend == IO_URING)
+        {
+            worker->ring = new Uring();
+            if (!worker->ring->init(URING_ENTRIES))
+            {
+                perror("io_uring setup failed");
+                exit(1);
+            }
+            worker->slots.resize(URING_ENTRIES);
+        }
+        senders.push_back(worker);
+
+        thread sender_thread(sender_loop, worker);
+        sender_thread.detach();
+    }
+}
+
+void enqueue(int client_sock, Payload message, OutKind kind, shared_ptr<QueueStats> stats, shared_ptr<TlsConn> tls,
+             shared_ptr<DeflateCache> deflated)
+{
+    // a socket always maps to the same worker, so messages to one client stay in FIFO order
+    SenderWorker *worker = senders[client_sock % num_senders];
+    unique_lock<mutex> lock(worker->mtx);
+    worker->not_full.wait(lock, [worker] { return worker->queue.size() < SENDER_QUEUE_SZ; });
+    uint64_t locked = now_ns();
+    bool was_empty = worker->queue.empty();
+    worker->queue.push_back({client_sock, move(message), kind, move(stats), move(tls), move(deflated)});
+    lock.unlock();
+    record(my_metrics().lock_hold_ns, now_ns() - locked);
+
+    if (was_empty) // the worker drains the whole queue per wakeup, only the first message needs to wake it
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(worker->event_fd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+void sender_loop(SenderWorker *worker)
+{
+    vector<OutMsg> batch;
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        int n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait failed");
+            return;
+        }
+
+        // sockets that drained their socket buffer can take more data
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == worker->event_fd)
+            {
+                continue;
+            }
+            auto box = worker->outboxes.find(fd);
+            if (box != worker->outboxes.end() && box->second.blocked)
+            {
+                box->second.blocked = false;
+                if (!flush_outbox(worker, fd, box->second))
+                {
+                    fail_outbox(worker, fd, box->second);
+                }
+                if (!box->second.blocked)
+                {
+                    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                }
+            }
+        }
+
+        // take every queued message in one go
+        uint64_t count;
+        ssize_t ret = read(worker->event_fd, &count, sizeof(count));
+        (void)ret;
+        unique_lock<mutex> lock(worker->mtx);
+        uint64_t locked = now_ns();
+        batch.swap(worker->queue);
+        worker->busy = !batch.empty();
+        lock.unlock();
+        record(my_metrics().lock_hold_ns, now_ns() - locked);
+        worker->not_full.notify_all();
+        if (batch.empty())
+        {
+            continue;
+        }
+
+        // append to the outboxes first so each socket gets a single writev for the whole batch
+        vector<int> touched;
+        for (auto &msg : batch)
+        {
+            if (msg.kind == OUT_EXPORT)
+            {
+                export_outboxes(worker);
+                continue;
+            }
+            if (msg.kind == OUT_CLOSE)
+            {
+                // flush what can be written right away, then close
+                auto box = worker->outboxes.find(msg.fd);
+                if (box != worker->outboxes.end())
+                {
+                    Outbox &out = box->second;
+                    if (!out.blocked && !out.failed && flush_outbox(worker, msg.fd, out) && out.tls != nullptr &&
+                        !out.blocked)
+                    {
+                        // close_notify after the last message, so the client can tell the end from a cut connection
+                        {
+                            lock_guard<mutex> tls_lock(out.tls->mtx);
+                            if (SSL_is_init_finished(out.tls->ssl))
+                            {
+                                SSL_shutdown(out.tls->ssl);
+                            }
+                            ERR_clear_error();
+                        }
+                        flush_outbox(worker, msg.fd, out);
+                    }
+                    if (box->second.blocked)
+                    {
+                        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, msg.fd, nullptr);
+                    }
+                    worker->outboxes.erase(box);
+                }
+                close(msg.fd);
+                continue;
+            }
+            if (msg.kind == OUT_OPEN || msg.kind == OUT_RESTORE)
+            {
+                Outbox &box = worker->outboxes[msg.fd];
+                box = Outbox();
+                box.stats = move(msg.stats);
+                box.tls = move(msg.tls);
+                if (msg.kind == OUT_RESTORE && !msg.data->empty())
+                {
+                    // the old process's output is already framed, it goes out as it is
+                    box.bytes = msg.data->size();
+                    box.pending.push_back({move(msg.data), 0});
+                    touched.push_back(msg.fd);
+                }
+                continue;
+            }
+
+            // a message that raced with OUT_CLOSE has no outbox left, its socket is gone
+            auto entry = worker->outboxes.find(msg.fd);
+            if (entry == worker->outboxes.end())
+            {
+                continue;
+            }
+            Outbox &box = entry->second;
+            if (msg.kind == OUT_FRAMED)
+            {
+                box.framed = true;
+                continue;
+            }
+            if (msg.kind == OUT_COMPRESS && msg.data == nullptr)
+            {
+                box.deflate = true; // negotiated with the old process of a hot upgrade, acknowledged there
+                continue;
+            }
+            if (box.failed)
+            {
+                continue;
+            }
+            if (msg.kind == OUT_TLS)
+            {
+                // messages queued before the handshake finished are waiting for this too
+                if (!box.blocked)
+                {
+                    touched.push_back(msg.fd);
+                }
+                continue;
+            }
+            if (box.pending.empty() && !box.blocked)
+            {
+                touched.push_back(msg.fd);
+            }
+            if (msg.kind == OUT_COMPRESS)
+            {
+                // the acknowledgement itself is never compressed, the client reads it before it knows the answer
+                box.deflate = !msg.data->empty();
+                box.bytes += FRAME_HDR_SZ + msg.data->size();
+                box.pending.push_back({move(msg.data), OP_COMPRESS});
+                continue;
+            }
+            queue_message(worker, msg.fd, box, move(msg.data), msg.deflated);
+        }
+        batch.clear();
+
+        if (worker->ring != nullptr)
+        {
+            flush_batch(worker, touched);
+            touched.clear();
+        }
+        for (int fd : touched)
+        {
+            auto box = worker->outboxes.find(fd);
+            if (box == worker->outboxes.end() || box->second.blocked || box->second.failed)
+            {
+                continue;
+            }
+            if (!flush_outbox(worker, fd, box->second))
+            {
+                fail_outbox(worker, fd, box->second);
+            }
+        }
+        worker->busy = false;
+    }
+}
+
+bool flush_outbox(SenderWorker *worker, int client_sock, Outbox &box)
+{
+    if (box.tls != nullptr)
+    {
+        return flush_tls(worker, client_sock, box);
+    }
+
+    while (!box.pending.empty())
+    {
+        Gather gather;
+        ssize_t written = (gather_outbox(box, gather) > 0) ? writev(client_sock, gather.iov, gather.count) : 0;
+        if (gather.count > 0)
+        {
+            bump(my_metrics().io_calls[1]);
+        }
+        if (written > 0)
+        {
+            bump(my_metrics().bytes_out, written);
+        }
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                wait_writable(worker, client_sock, box);
+                return true;
+            }
+            return false; // client went away, the reactor cleans up
+        }
+        advance_outbox(box, written);
+        catch_up(box);
+    }
+    publish_stats(box);
+    return true;
+}
+
+void flush_batch(SenderWorker *worker, const vector<int> &touched)
+{
+    // one sendmsg per socket gathering what it has queued, as writev would, and a whole submission of
+    // them written with one io_uring_enter. MSG_DONTWAIT completes each at once, a full socket buffer
+    // with -EAGAIN, so no socket waits for another
+    Uring &ring = *worker->ring;
+    size_t next = 0;
+    while (next < touched.size())
+    {
+        size_t queued = 0;
+        for (; next < touched.size() && queued < worker->slots.size(); next++)
+        {
+            int fd = touched[next];
+            auto box = worker->outboxes.find(fd);
+            if (box == worker->outboxes.end() || box->second.blocked || box->second.failed || box->second.sending)
+            {
+                continue;
+            }
+            SendSlot &slot = worker->slots[queued];
+            if (box->second.tls != nullptr || gather_outbox(box->second, slot.gather) == 0)
+            {
+                if (!flush_outbox(worker, fd, box->second)) // TLS records are sealed and written as before
+                {
+                    fail_outbox(worker, fd, box->second);
+                }
+                continue;
+            }
+            box->second.sending = true;
+            slot.fd = fd;
+            slot.msg = {};
+            slot.msg.msg_iov = slot.gather.iov;
+            slot.msg.msg_iovlen = slot.gather.count;
+            Uring::prep_sendmsg(ring.get_sqe(), fd, &slot.msg, MSG_DONTWAIT | MSG_NOSIGNAL, queued);
+            queued++;
+        }
+
+        size_t done = 0;
+        while (done < queued)
+        {
+            if (ring.submit(queued - done) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                perror("io_uring_enter failed"); // the kernel may still be reading the slots, they cannot be reused
+                exit(1);
+            }
+            bump(my_metrics().io_calls[1]);
+            done += ring.drain([worker](const io_uring_cqe &cqe) { worker->slots[cqe.user_data].result = cqe.res; });
+        }
+
+        // the same accounting as flush_outbox, which writes what one sendmsg could not take
+        for (size_t i = 0; i < queued; i++)
+        {
+            SendSlot &slot = worker->slots[i];
+            Outbox &box = worker->outboxes[slot.fd];
+            box.sending = false;
+            if (slot.result > 0)
+            {
+                bump(my_metrics().bytes_out, slot.result);
+                advance_outbox(box, slot.result);
+                catch_up(box);
+            }
+            if (slot.result == -EAGAIN)
+            {
+                wait_writable(worker, slot.fd, box);
+            }
+            else if (slot.result < 0 && slot.result != -EINTR)
+            {
+                fail_outbox(worker, slot.fd, box); // client went away, the reactor cleans up
+            }
+            else if (!flush_outbox(worker, slot.fd, box))
+            {
+                fail_outbox(worker, slot.fd, box);
+            }
+        }
+    }
+}
+
+int gather_outbox(const Outbox &box, Gather &gather)
+{
+    // framed messages get their frame header in front, written from gather.headers
+    gather.count = 0;
+    int msg_cnt = 0;
+    for (auto it = box.pending.begin(); it != box.pending.end() && msg_cnt < MAX_IOV; ++it, ++msg_cnt)
+    {
+        size_t skip = (msg_cnt == 0) ? box.offset : 0;
+        size_t hdr_sz = it->opcode ? FRAME_HDR_SZ : 0;
+        if (skip < hdr_sz)
+        {
+            encode_frame_header(gather.headers[msg_cnt], it->opcode, it->data->size());
+            gather.iov[gather.count].iov_base = gather.headers[msg_cnt] + skip;
+            gather.iov[gather.count++].iov_len = hdr_sz - skip;
+            skip = 0;
+        }
+        else
+        {
+            skip -= hdr_sz;
+        }
+        if (it->data->size() > skip)
+        {
+            gather.iov[gather.count].iov_base = (void *)(it->data->data() + skip);
+            gather.iov[gather.count++].iov_len = it->data->size() - skip;
+        }
+    }
+    return gather.count;
+}
+
+void advance_outbox(Outbox &box, size_t written)
+{
+    // drop the fully written messages
+    box.bytes -= written;
+    size_t left = written;
+    while (!box.pending.empty())
+    {
+        Pending &front = box.pending.front();
+        size_t remaining = (front.opcode ? FRAME_HDR_SZ : 0) + front.data->size() - box.offset;
+        if (left < remaining)
+        {
+            box.offset += left;
+            break;
+        }
+        left -= remaining;
+        box.offset = 0;
+        box.pending.pop_front();
+    }
+}
+
+void wait_writable(SenderWorker *worker, int client_sock, Outbox &box)
+{
+    // wait until the client reads, later messages stay queued behind this one
+    struct epoll_event ev = {};
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.fd = client_sock;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_sock, &ev) < 0 && errno == EEXIST)
+    {
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, client_sock, &ev); // still registered from an earlier stall, re-arm
+    }
+    box.blocked = true;
+    publish_stats(box);
+}
+
+void catch_up(Outbox &box)
+{
+    // a coalescing client caught up, tell it how much it missed
+    if (box.coalescing && box.bytes <= low_watermark)
+    {
+        box.coalescing = false;
+        Payload notice = make_payload("\033[93m" + to_string(box.skipped) +
+                                      " messages were skipped because you were reading too slowly.\033[0m");
+        box.bytes += (box.framed ? FRAME_HDR_SZ : 0) + notice->size();
+        box.pending.push_back({move(notice), (uint8_t)(box.framed ? OP_TEXT : 0)});
+    }
+}
+
+void queue_message(SenderWorker *worker, int client_sock, Outbox &box, Payload data, const shared_ptr<DeflateCache> &deflated)
+{
+    if (box.coalescing)
+    {
+        box.skipped++;
+        box.stats->dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    uint8_t opcode = box.framed ? OP_TEXT : 0;
+    if (box.deflate)
+    {
+        if (Payload packed = deflate_payload(data, deflated))
+        {
+            data = move(packed);
+            opcode = OP_DEFLATE;
+        }
+    }
+    size_t size = (opcode ? FRAME_HDR_SZ : 0) + data->size();
+    if (box.bytes + size > high_watermark && !box.blocked && !box.pending.empty())
+    {
+        // a large batch for a client that keeps up is written out, only a full socket buffer makes a slow consumer
+        if (!flush_outbox(worker, client_sock, box))
+        {
+            fail_outbox(worker, client_sock, box);
+            return;
+        }
+    }
+
+    if (box.bytes + size > high_watermark && box.blocked)
+    {
+        if (slow_policy == DISCONNECT)
+        {
+            // the reactor sees the connection end and logs the client out
+            box.stats->dropped.fetch_add(box.pending.size() + 1, memory_order_relaxed);
+            fail_outbox(worker, client_sock, box);
+            shutdown(client_sock, SHUT_RDWR);
+            return;
+        }
+        if (slow_policy == COALESCE)
+        {
+            box.coalescing = true;
+            box.skipped = 1;
+            box.stats->dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+    }
 
-// Helper functions
-bool isEmpty(const char str[]);
-void send_message(int client_sock, string message);
-void group_mssg(string message, string group_name, int client_fd);
-void private_mssg(string message, int recv_fd);
-void broadcast(string message, int broadcast_fd);
+    box.pending.push_back({move(data), opcode});
+    box.bytes += size;
 
-// Handler functions
-void client_handle(int client_fd);                                              // handles all activities of a client
-void handle_msg(char *message, int client_fd, string &username);           // handles private messaging feature 
-void handle_broadcast(std::string &username, char *message, int &client_fd);    // handles broadcast messaging feature
-void handle_create_group(char *message, int &client_fd);                        // handles creating a new group feature
-void handle_join_group(char *message, int &client_fd, std::string &username);   // handles join group feature
-void handle_leave_group(char *message, int &client_fd, std::string &username);  // handles leave group feature
-void handle_group_msg(char *message, int &client_fd, string &username);         // handles group messaging feature
-void handle_exit(string &username, int &client_fd);                             // handles client exit feature
-void handle_sigint(int sig);                                                    // handles abrupt server shutdown
+    if (slow_policy == DROP_OLDEST && box.blocked && box.bytes > high_watermark)
+    {
+        // keep the partly written front message and the new one, drop from the oldest unsent one on
+        size_t first = (box.offset > 0) ? 1 : 0;
+        uint64_t dropped = 0;
+        while (box.bytes > low_watermark && box.pending.size() > first + 1)
+        {
+            Pending &oldest = box.pending[first];
+            box.bytes -= (oldest.opcode ? FRAME_HDR_SZ : 0) + oldest.data->size();
+            box.pending.erase(box.pending.begin() + first);
+            dropped++;
+        }
+        box.stats->dropped.fetch_add(dropped, memory_order_relaxed);
+    }
+    publish_stats(box);
+}
 
-// Additional functions
-void handle_list_all_members(int &client_fd);                                   // lists all members active on the server
-void handle_list_all_groups(int &client_fd);                                    // lists all groups active on the server
-void handle_list_group_members(char *message, int &client_fd);                  // lists all active members of the requested group
-void handle_help(int &client_fd);                                               // prints a help message for usage 
+Payload deflate_payload(const Payload &message, const shared_ptr<DeflateCache> &cache)
+{
+    // a fan-out is compressed by the first sender that needs it, the others wait for and share the result
+    if (cache != nullptr)
+    {
+        call_once(cache->once, [&] { cache->data = deflate_payload(message, nullptr); });
+        return cache->data;
+    }
+    thread_local Deflater deflater; // keeps its zlib state between messages
+    string packed;
+    if (!deflater.compress(*message, packed))
+    {
+        return nullptr;
+    }
+    ThreadMetrics &metrics = my_metrics();
+    bump(metrics.deflate_bytes[0], message->size());
+    bump(metrics.deflate_bytes[1], packed.size());
+    return make_shared<const string>(move(packed));
+}
 
-int main()
+void publish_stats(Outbox &box)
 {
-    signal(SIGINT, handle_sigint);
+    box.stats->depth.store(box.pending.size(), memory_order_relaxed);
+    box.stats->bytes.store(box.bytes, memory_order_relaxed);
+}
 
-    // populate user to password map (auth)
-    ifstream file("users.txt");
-    if (!file)
+void fail_outbox(SenderWorker *worker, int client_sock, Outbox &box)
+{
+    if (box.blocked)
     {
-        perror("Error opening file.");
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, client_sock, nullptr);
+        box.blocked = false;
     }
+    box.failed = true;
+    box.pending.clear();
+    box.offset = 0;
+    box.bytes = 0;
+    box.sealed.clear();
+    box.sealed_off = 0;
+    publish_stats(box);
+}
 
-    string line;
-    while (getline(file, line))
+ThreadMetrics &my_metrics()
+{
+    thread_local ThreadMetrics *metrics = nullptr;
+    if (metrics == nullptr)
     {
-        size_t pos = line.find(':');
-        if (pos != string ::npos)
+        metrics = new ThreadMetrics();
+        lock_guard<mutex> lock(metrics_lock);
+        thread_metrics.push_back(metrics);
+    }
+    return *metrics;
+}
+
+void bump(atomic<uint64_t> &counter, uint64_t n)
+{
+    // single writer, so no read-modify-write instruction is needed
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// bucket of a value: 0 and 1 have their own, then two per power of two
+size_t hist_bucket(uint64_t value)
+{
+    if (value < 2)
+    {
+        return value;
+    }
+    int e = 63 - __builtin_clzll(value);
+    return min((size_t)(2 * e + ((value >> (e - 1)) & 1)), (size_t)HIST_BUCKETS - 1);
+}
+
+// largest value that falls into a bucket
+uint64_t hist_upper(size_t bucket)
+{
+    if (bucket < 2)
+    {
+        return bucket;
+    }
+    int e = bucket / 2;
+    return (1ull << e) + ((bucket % 2 + 1) << (e - 1)) - 1;
+}
+
+void record(Histogram &hist, uint64_t value)
+{
+    bump(hist.counts[hist_bucket(value)]);
+    bump(hist.sum, value);
+}
+
+uint64_t now_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t action_slot(uint8_t opcode)
+{
+    return (opcode_action(opcode) != nullptr) ? opcode - OP_EXIT + 1 : 0;
+}
+
+int create_metrics_listener()
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("Metrics socket creation failed.");
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    // local only, the metrics are not meant for the chat clients
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(metrics_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+    {
+        perror("Metrics socket binding error.");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void metrics_loop(int listen_fd)
+{
+    // one scrape at a time, the endpoint has its own thread so a slow scraper never delays the chat
+    while (1)
+    {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("Metrics accept failed");
+            return;
+        }
+        struct timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char buffer[METRICS_REQ_SZ];
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        string_view request(buffer, max(n, (ssize_t)0));
+        string response;
+        if (request.starts_with("GET /metrics ") || request.starts_with("GET / "))
+        {
+            string body = render_metrics();
+            response = concat({"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ",
+                               to_string(body.size()), "\r\n\r\n", body});
+        }
+        else
+        {
+            response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        }
+        for (size_t sent = 0; sent < response.size();)
         {
-            string username = line.substr(0, pos);
-            string password = line.substr(pos + 1);
-            auth[username] = password;
+            ssize_t written = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (written <= 0)
+            {
+                break;
+            }
+            sent += written;
         }
+        close(fd);
     }
+}
 
-    // creating server socket
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd < 0)
+// appends a sample in the Prometheus text format, with help and type before the first sample of a
+// metric, a sample without a type belongs to a histogram whose header is already written
+void render_line(string &out, const char *name, const char *type, const char *help, string_view labels, double value)
+{
+    if (*type != '\0' && out.find(concat({"# TYPE ", name, " "})) == string::npos)
     {
-        perror("Socket creation failed.");
-        return 0;
+        out.append(concat({"# HELP ", name, " ", help, "\n# TYPE ", name, " ", type, "\n"}));
     }
+    char number[32];
+    snprintf(number, sizeof(number), "%.17g", value);
+    out.append(concat({name, labels.empty() ? "" : "{", labels, labels.empty() ? "" : "}", " ", number, "\n"}));
+}
 
-    // setting socket options
-    int opt = 1;
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+// appends a histogram summed over all threads, bucket bounds are multiplied by scale
+void render_histogram(string &out, const char *name, const char *help, string_view labels, double scale,
+                      const function<const Histogram &(const ThreadMetrics &)> &field)
+{
+    uint64_t counts[HIST_BUCKETS] = {};
+    uint64_t sum = 0;
+    for (ThreadMetrics *metrics : thread_metrics)
     {
-        perror("setsockopt failed");
-        close(sock_fd);
-        return 0;
+        const Histogram &hist = field(*metrics);
+        for (int i = 0; i < HIST_BUCKETS; i++)
+        {
+            counts[i] += hist.counts[i].load(memory_order_relaxed);
+        }
+        sum += hist.sum.load(memory_order_relaxed);
+    }
+    int last = HIST_BUCKETS - 1;
+    while (last >= 0 && counts[last] == 0)
+    {
+        last--;
+    }
+    if (last < 0)
+    {
+        return; // nothing recorded yet
     }
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    string bucket_name = concat({name, "_bucket"});
+    string sep = labels.empty() ? "" : ",";
+    uint64_t total = 0;
+    if (out.find(concat({"# TYPE ", name, " "})) == string::npos)
+    {
+        out.append(concat({"# HELP ", name, " ", help, "\n# TYPE ", name, " histogram\n"}));
+    }
+    for (int i = 0; i <= last; i++)
+    {
+        total += counts[i];
+        char le[32];
+        snprintf(le, sizeof(le), "%g", hist_upper(i) * scale);
+        string bucket_labels = concat({labels, sep, "le=\"", le, "\""});
+        render_line(out, bucket_name.c_str(), "", "", bucket_labels, total);
+    }
+    render_line(out, bucket_name.c_str(), "", "", concat({labels, sep, "le=\"+Inf\""}), total);
+    render_line(out, concat({name, "_sum"}).c_str(), "", "", labels, sum * scale);
+    render_line(out, concat({name, "_count"}).c_str(), "", "", labels, total);
+}
 
-    // binding socket to port
-    if (bind(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+string render_metrics()
+{
+    string out;
+    lock_guard<mutex> lock(metrics_lock);
+    auto total = [](const function<const atomic<uint64_t> &(const ThreadMetrics &)> &field)
     {
-        close(sock_fd);
-        perror("Socket binding error.");
+        uint64_t sum = 0;
+        for (ThreadMetrics *metrics : thread_metrics)
+        {
+            sum += field(*metrics).load(memory_order_relaxed);
+        }
+        return (double)sum;
+    };
+
+    for (size_t slot = 0; slot < NUM_ACTION_SLOTS; slot++)
+    {
+        const char *action = slot ? ACTION_NAMES[slot - 1] : "invalid";
+        string labels = concat({"action=\"", action, "\""});
+        render_line(out, "shadow_room_commands_total", "counter", "Chat actions handled.", labels,
+                    total([slot](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.commands[slot]; }));
+    }
+    for (size_t slot = 0; slot < NUM_ACTION_SLOTS; slot++)
+    {
+        const char *action = slot ? ACTION_NAMES[slot - 1] : "invalid";
+        render_histogram(out, "shadow_room_command_duration_seconds", "Time to handle a chat action.",
+                         concat({"action=\"", action, "\""}), 1e-9,
+                         [slot](const ThreadMetrics &m) -> const Histogram & { return m.command_ns[slot]; });
+    }
+    const char *fanout_names[NUM_FANOUT_KINDS] = {"group", "broadcast", "presence"};
+    for (int kind = 0; kind < NUM_FANOUT_KINDS; kind++)
+    {
+        render_histogram(out, "shadow_room_fanout_recipients", "Recipients of one group message, broadcast or presence digest.",
+                         concat({"kind=\"", fanout_names[kind], "\""}), 1,
+                         [kind](const ThreadMetrics &m) -> const Histogram & { return m.fanout[kind]; });
+    }
+    const char *presence_names[2] = {"notice", "digest"};
+    for (int stage = 0; stage < 2; stage++)
+    {
+        render_line(out, "shadow_room_presence_total", "counter",
+                    "Join and leave notices collected, and the digests they were sent in.",
+                    concat({"kind=\"", presence_names[stage], "\""}),
+                    total([stage](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.presence[stage]; }));
     }
 
-    // listening on server socket
-    if (listen(sock_fd, 10) < 0)
+    const char *login_names[NUM_LOGIN_RESULTS] = {"ok", "failed", "unknown_user", "rate_limited", "busy"};
+    for (int result = 0; result < NUM_LOGIN_RESULTS; result++)
     {
-        close(sock_fd);
-        perror("listing failed.");
+        render_line(out, "shadow_room_logins_total", "counter", "Login attempts by outcome.",
+                    concat({"result=\"", login_names[result], "\""}),
+                    total([result](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.logins[result]; }));
+    }
+    render_histogram(out, "shadow_room_auth_duration_seconds", "Time to verify a password on an auth worker.", "",
+                     1e-9, [](const ThreadMetrics &m) -> const Histogram & { return m.auth_ns; });
+    if (tls_ctx != nullptr)
+    {
+        const char *handshake_names[2] = {"full", "resumed"};
+        for (int kind = 0; kind < 2; kind++)
+        {
+            render_line(out, "shadow_room_tls_handshakes_total", "counter", "Completed TLS handshakes.",
+                        concat({"kind=\"", handshake_names[kind], "\""}),
+                        total([kind](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.tls_handshakes[kind]; }));
+        }
+        render_histogram(out, "shadow_room_tls_handshake_step_seconds", "Time of one TLS handshake step on an auth worker.",
+                         "", 1e-9, [](const ThreadMetrics &m) -> const Histogram & { return m.tls_handshake_ns; });
+        render_histogram(out, "shadow_room_tls_record_messages", "Messages packed into one TLS record.", "", 1,
+                         [](const ThreadMetrics &m) -> const Histogram & { return m.tls_record_messages; });
+    }
+    const char *deflate_names[2] = {"plain", "compressed"};
+    for (int stage = 0; stage < 2; stage++)
+    {
+        render_line(out, "shadow_room_deflate_bytes_total", "counter",
+                    "Message bytes compressed for compressing clients, once per message, before and after.",
+                    concat({"stage=\"", deflate_names[stage], "\""}),
+                    total([stage](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.deflate_bytes[stage]; }));
     }
-    cout << "\033[32mTCP server listing on PORT : \033[93m" << PORT << "\033[0m" << endl;
+    render_histogram(out, "shadow_room_sender_lock_hold_seconds", "Time a sender worker queue lock is held.", "",
+                     1e-9, [](const ThreadMetrics &m) -> const Histogram & { return m.lock_hold_ns; });
 
-    // accepting multiple clients
-    while (1)
+    render_histogram(out, "shadow_room_log_commit_seconds", "Time to write and sync one batch of the message log.",
+                     "", 1e-9, [](const ThreadMetrics &m) -> const Histogram & { return m.log_commit_ns; });
+    render_histogram(out, "shadow_room_log_batch_records", "Records made durable by one sync of the message log.",
+                     "", 1, [](const ThreadMetrics &m) -> const Histogram & { return m.log_batch; });
+    render_line(out, "shadow_room_log_dropped_total", "counter", "Group messages not logged, the log queue was full.",
+                "", total([](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.log_dropped; }));
+
+    render_line(out, "shadow_room_received_bytes_total", "counter", "Bytes received from clients.", "",
+                total([](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.bytes_in; }));
+    render_line(out, "shadow_room_sent_bytes_total", "counter", "Bytes written to clients.", "",
+                total([](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.bytes_out; }));
+    const char *io_names[2] = {"receive", "send"};
+    for (int path = 0; path < 2; path++)
     {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_sock;
-        client_sock = accept(sock_fd, (struct sockaddr *)(&client_addr), &client_len);
-        if (client_sock < 0)
+        render_line(out, "shadow_room_io_calls_total", "counter",
+                    "System calls receiving from clients (waits, accepts and reads) and writing to them.",
+                    concat({"path=\"", io_names[path], "\""}),
+                    total([path](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.io_calls[path]; }));
+    }
+    const char *limit_names[NUM_LIMITS] = {"session", "group", "fanout"};
+    const char *penalty_names[NUM_PENALTIES] = {"delay", "drop", "disconnect"};
+    for (int limit = 0; limit < NUM_LIMITS; limit++)
+    {
+        render_line(out, "shadow_room_rate_limited_total", "counter",
+                    "Commands over a rate limit, by the limit, and the penalty set with -e.",
+                    concat({"limit=\"", limit_names[limit], "\",penalty=\"", penalty_names[rate_penalty], "\""}),
+                    total([limit](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.rate_limited[limit]; }));
+    }
+    const char *cache_names[2] = {"hit", "miss"};
+    for (int result = 0; result < 2; result++)
+    {
+        render_line(out, "shadow_room_topic_cache_total", "counter",
+                    "Group messages whose wildcard subscribers were cached (hit) or matched against the trie (miss).",
+                    concat({"result=\"", cache_names[result], "\""}),
+                    total([result](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.topic_cache[result]; }));
+    }
+    const char *trace_names[2] = {"recorded", "dropped"};
+    for (int result = 0; result < 2; result++)
+    {
+        render_line(out, "shadow_room_trace_records_total", "counter",
+                    "Records of the trace (-t), kept or dropped because the ring of their thread was full.",
+                    concat({"result=\"", trace_names[result], "\""}),
+                    total([result](const ThreadMetrics &m) -> const atomic<uint64_t> & { return m.traced[result]; }));
+    }
+    render_line(out, "shadow_room_io_backend_info", "gauge", "Socket I/O backend of the reactors and senders.",
+                concat({"backend=\"", io_backend == IO_URING ? "io_uring" : "epoll", "\""}), 1);
+    render_line(out, "shadow_room_payload_copied_bytes_total", "counter", "Message bytes copied into a payload.", "",
+                bytes_copied.load(memory_order_relaxed));
+    render_line(out, "shadow_room_payload_shared_bytes_total", "counter",
+                "Message bytes queued for a recipient by sharing a payload.", "",
+                bytes_referenced.load(memory_order_relaxed));
+
+    // gauges are read now, none of them is kept up to date on the hot path for the endpoint's sake
+    for (int i = 0; i < num_senders; i++)
+    {
+        size_t depth;
         {
-            perror("Connection failed!");
-            continue;
+            lock_guard<mutex> sender_lock(senders[i]->mtx);
+            depth = senders[i]->queue.size();
         }
-        unique_lock<mutex> lock(mtx);
-        client_set.insert(client_sock);
-        lock.unlock();
-        
-        // thread to handle activities of that client
-        thread client_thread(client_handle, client_sock);
-        client_thread.detach();
+        render_line(out, "shadow_room_sender_queue_depth", "gauge", "Messages waiting in a sender worker's inbox.",
+                    concat({"worker=\"", to_string(i), "\""}), depth);
     }
-    return 0;
+    size_t auth_depth;
+    {
+        lock_guard<mutex> auth_lock(auth_queue.mtx);
+        auth_depth = auth_queue.requests.size();
+    }
+    render_line(out, "shadow_room_auth_queue_depth", "gauge", "Logins waiting for an auth worker.", "", auth_depth);
+    size_t log_depth;
+    {
+        lock_guard<mutex> log_lock(log_queue.mtx);
+        log_depth = log_queue.requests.size();
+    }
+    render_line(out, "shadow_room_log_queue_depth", "gauge", "Requests waiting for the log thread.", "", log_depth);
+    vector<pair<bool, size_t>> links; // up and queued frames of each node, the lines of a metric stay together
+    for (PeerLink *link : peers)
+    {
+        lock_guard<mutex> peer_lock(link->mtx);
+        links.push_back({link->up, link->queue.size()});
+    }
+    for (size_t i = 0; i < peers.size(); i++)
+    {
+        render_line(out, "shadow_room_peer_up", "gauge", "1 while the link to another node is connected.",
+                    concat({"node=\"", peers[i]->name, "\""}), links[i].first);
+    }
+    for (size_t i = 0; i < peers.size(); i++)
+    {
+        render_line(out, "shadow_room_peer_queue_depth", "gauge", "Frames waiting for the link to another node.",
+                    concat({"node=\"", peers[i]->name, "\""}), links[i].second);
+    }
+
+    uint64_t clients = 0, depth = 0, bytes = 0, dropped = 0;
+    for (auto &shard : client_set)
+    {
+        lock_guard<mutex> shard_lock(shard.lock);
+        clients += shard.sockets.size();
+        for (auto &[fd, stats] : shard.sockets)
+        {
+            depth += stats->depth.load(memory_order_relaxed);
+            bytes += stats->bytes.load(memory_order_relaxed);
+            dropped += stats->dropped.load(memory_order_relaxed);
+        }
+    }
+    render_line(out, "shadow_room_connected_clients", "gauge", "Connected client sockets.", "", clients);
+    render_line(out, "shadow_room_outbox_messages", "gauge", "Messages queued for connected clients.", "", depth);
+    render_line(out, "shadow_room_outbox_bytes", "gauge", "Bytes queued for connected clients.", "", bytes);
+    render_line(out, "shadow_room_outbox_dropped_total", "counter",
+                "Messages dropped by the slow consumer policy for connected clients.", "", dropped);
+    return out;
 }
 
-void client_handle(int client_fd)
+string stream_dir(char kind, string_view name)
 {
-    const char *wel_msg = "Welcome to Shadow Room!\nEnter your username: ";
-    send(client_fd, wel_msg, strlen(wel_msg), 0);
-    char username_buff[BUFF_SZ] = {0};
-    char passwd_buff[BUFF_SZ] = {0};
-    string username;
-    if (recv(client_fd, username_buff, BUFF_SZ, 0) <= 0) // receive username
+    // names may hold any character but a space, hex keeps them safe as file names
+    static const char digits[] = "0123456789abcdef";
+    string dir = concat({log_dir, "/", string_view(&kind, 1), "-"});
+    for (unsigned char c : name)
     {
-        close(client_fd);
-        perror("TCP receive failed");
-        return;
+        dir.push_back(digits[c >> 4]);
+        dir.push_back(digits[c & 15]);
     }
-    else
+    return dir;
+}
+
+bool submit_log(LogRequest request)
+{
+    unique_lock<mutex> lock(log_queue.mtx);
+    if (log_queue.requests.size() >= LOG_QUEUE_SZ && request.op != LOG_REPLAY && request.op != LOG_STOP)
     {
-        username = username_buff;
-        const char *passwd = "Enter your password: ";
-        send(client_fd, passwd, strlen(passwd), 0);
-        if (recv(client_fd, passwd_buff, BUFF_SZ, 0) <= 0) // receive password
-        { 
-            close(client_fd);
-            perror("TCP receive failed");
-            return;
+        return false; // never blocks a reactor, a replay is accepted anyway so no inbox is forgotten
+    }
+    log_queue.requests.push_back(move(request));
+    lock.unlock();
+    log_queue.not_empty.notify_one();
+    return true;
+}
+
+void log_loop()
+{
+    deque<LogRequest> batch;
+    uint64_t batches = 0;
+    while (1)
+    {
+        {
+            unique_lock<mutex> lock(log_queue.mtx);
+            log_queue.not_empty.wait(lock, [] { return !log_queue.requests.empty(); });
+            batch.swap(log_queue.requests);
         }
+        batches++;
 
-        // Authenticate
-        if (auth.find(username) != auth.end() && (string)passwd_buff == auth[username])
+        // write every record of the batch first, then one sync per stream makes them all durable
+        // (group commit), requests that arrive meanwhile form the next batch
+        uint64_t start = now_ns();
+        int64_t time = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        vector<string> touched;
+        unordered_set<string> failed; // streams whose records of this batch may be lost
+        uint64_t appended = 0;
+        for (LogRequest &request : batch)
         {
-            send(client_fd, banner, strlen(banner), 0);
-            // Notify all the users
-            thread broadcast_thread(broadcast, "\033[093m" + username + " has joined the chat!\033[0m", client_fd);
-            broadcast_thread.detach();
+            if ((request.op != LOG_GROUP && request.op != LOG_OFFLINE) || failed.contains(request.stream))
+            {
+                continue;
+            }
+            LogStream *stream = log_stream(request.stream, true);
+            if (stream != nullptr && !stream->has_pending())
+            {
+                touched.push_back(request.stream);
+            }
+            request.stored = stream != nullptr && stream->append(*request.message, time);
+            if (!request.stored)
+            {
+                // closed, opening it again cuts off the torn record
+                perror(("Error writing the message log " + request.stream).c_str());
+                failed.insert(request.stream);
+                log_streams.erase(request.stream);
+                continue;
+            }
+            log_streams[request.stream].last_use = batches;
+            appended++;
         }
-        else
+        for (const string &dir : touched)
         {
-            const char *auth_failed = "Authentication failed.";
-            send(client_fd, auth_failed, strlen(auth_failed), 0);
-            close(client_fd);
+            auto it = log_streams.find(dir);
+            if (it != log_streams.end() && !it->second.stream->commit())
+            {
+                perror(("Error syncing the message log " + dir).c_str());
+                failed.insert(dir);
+                log_streams.erase(it);
+            }
+        }
+        if (appended > 0)
+        {
+            ThreadMetrics &metrics = my_metrics();
+            record(metrics.log_commit_ns, now_ns() - start);
+            record(metrics.log_batch, appended);
+        }
+
+        // answer in queue order, every record of the batch is durable by now
+        for (LogRequest &request : batch)
+        {
+            bool stored = request.stored && !failed.contains(request.stream);
+            if (request.op == LOG_OFFLINE)
+            {
+                int recv_fd = find_user(request.recipient);
+                LogStream *inbox = stored ? log_stream(request.stream, false) : nullptr;
+                if (!stored || inbox == nullptr)
+                {
+                    log_reply(request, "\033[31mError : The message could not be stored.\033[0m");
+                }
+                else if (recv_fd >= 0) // logged in meanwhile, the replay of their login was answered already
+                {
+                    deliver_inbox(*inbox, recv_fd);
+                }
+                else
+                {
+                    log_reply(request, "\033[93mRecipient is offline, the message will be delivered when they log in.\033[0m");
+                }
+            }
+            else if (request.op == LOG_REPLAY && find_user(request.user) == request.client_sock)
+            {
+                LogStream *inbox = log_stream(request.stream, false);
+                if (inbox != nullptr)
+                {
+                    deliver_inbox(*inbox, request.client_sock);
+                }
+            }
+            else if (request.op == LOG_HISTORY)
+            {
+                send_history(request);
+            }
+        }
+        bool stop = any_of(batch.begin(), batch.end(), [](const LogRequest &request) { return request.op == LOG_STOP; });
+        batch.clear();
+        if (stop)
+        {
+            // every stream is closed before another process may open it
+            log_streams.clear();
+            lock_guard<mutex> lock(log_queue.mtx);
+            log_queue.running = false;
+            log_queue.ended.notify_all();
             return;
         }
     }
+}
+
+LogStream *log_stream(const string &dir, bool create)
+{
+    auto it = log_streams.find(dir);
+    if (it != log_streams.end())
+    {
+        return it->second.stream.get();
+    }
+    auto stream = make_unique<LogStream>();
+    if (!stream->open(dir, create))
+    {
+        if (create || errno != ENOENT)
+        {
+            perror(("Error opening the message log " + dir).c_str());
+        }
+        return nullptr;
+    }
 
-    // update the data structures
-    unique_lock<mutex> lock(mtx);
-    userToSocket[username] = client_fd;
-    socketToUser[client_fd] = username;
-    lock.unlock();
+    // close the least recently used stream that has nothing to commit
+    if (log_streams.size() >= LOG_MAX_STREAMS)
+    {
+        auto victim = log_streams.end();
+        for (auto open = log_streams.begin(); open != log_streams.end(); ++open)
+        {
+            if (!open->second.stream->has_pending() &&
+                (victim == log_streams.end() || open->second.last_use < victim->second.last_use))
+            {
+                victim = open;
+            }
+        }
+        if (victim != log_streams.end())
+        {
+            log_streams.erase(victim);
+        }
+    }
+    return log_streams.emplace(dir, OpenStream{move(stream), 0}).first->second.stream.get();
+}
+
+void log_reply(const LogRequest &request, string message)
+{
+    // the socket may belong to another client by now, answer only the user who asked (none for
+    // a message another node forwarded)
+    if (request.client_sock >= 0 && find_user(request.user) == request.client_sock)
+    {
+        send_message(request.client_sock, move(message));
+    }
+}
+
+void deliver_inbox(LogStream &inbox, int client_sock)
+{
+    string message;
+    int64_t time;
+    for (uint64_t seq = inbox.delivered(); seq < inbox.committed() && inbox.read(seq, message, time); seq++)
+    {
+        send_message(client_sock, log_line(message, time));
+        inbox.set_delivered(seq + 1);
+    }
+}
+
+void send_history(const LogRequest &request)
+{
+    LogStream *stream = log_stream(request.stream, false);
+    uint64_t end = (stream == nullptr) ? 0 : stream->committed();
+    uint64_t begin = end - min(end, (uint64_t)request.count);
+    vector<string> lines;
+    string message;
+    int64_t time;
+    for (uint64_t seq = begin; seq < end && stream->read(seq, message, time); seq++)
+    {
+        lines.push_back(log_line(message, time));
+    }
+    if (lines.empty())
+    {
+        log_reply(request, "\033[93mNo messages were sent to this group yet.\033[0m");
+        return;
+    }
+    vector<string_view> views(lines.begin(), lines.end());
+    log_reply(request, join_lines(views.data(), views.size(), "", ""));
+}
+
+string log_line(string_view message, int64_t time)
+{
+    time_t seconds = time / 1000;
+    struct tm local;
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &local));
+    return concat({"\033[90m(", stamp, ")\033[0m ", message});
+}
+
+bool add_peer(const char *address)
+{
+    string_view addr(address);
+    size_t colon = addr.rfind(':');
+    PeerLink *link = new PeerLink();
+    link->name = address;
+    link->addr.sin_family = AF_INET;
+    int port = (colon == string_view::npos) ? 0 : atoi(address + colon + 1);
+    if (colon == string_view::npos || port <= 0 || port >= 65536 || peers.size() >= MAX_PEERS ||
+        inet_pton(AF_INET, string(addr.substr(0, colon)).c_str(), &link->addr.sin_addr) != 1)
+    {
+        delete link;
+        return false;
+    }
+    link->addr.sin_port = htons(port);
+    peers.push_back(link);
+    return true;
+}
+
+int create_peer_listener()
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("Cluster socket creation failed.");
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
-    handle_help(client_fd); // print help/usage message
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cluster_port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, MAX_PEERS) < 0)
+    {
+        perror("Cluster socket binding error.");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    while (1) // handle client actions
+void start_cluster(int listen_fd)
+{
+    thread accept_thread(peer_accept_loop, listen_fd);
+    accept_thread.detach();
+    for (PeerLink *link : peers)
     {
-        char msg[MSG_SZ] = {0};
-        int bytes_received = recv(client_fd, msg, MSG_SZ, 0);
+        thread link_thread(peer_link_loop, link);
+        link_thread.detach();
+    }
+    cout << "Cluster port " << cluster_port << ", " << peers.size() << " other node" << (peers.size() == 1 ? "" : "s")
+         << endl;
+}
 
-        // handle abrupt client shutdown
-        if (bytes_received == 0)
-        {
-            // Client disconnected
-            cout << username << " disconnected.\n";
-            handle_exit(username, client_fd);
-            return;
-        }
-        else if (bytes_received < 0)
+void peer_accept_loop(int listen_fd)
+{
+    // a handful of long-lived links, one blocking reader thread each
+    while (1)
+    {
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        int fd = accept4(listen_fd, (struct sockaddr *)&from, &len, SOCK_CLOEXEC);
+        if (fd < 0)
         {
-            perror("Error receiving data");
-            handle_exit(username, client_fd);
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("Cluster accept failed");
             return;
         }
+        thread reader(peer_read_loop, fd, from.sin_addr.s_addr);
+        reader.detach();
+    }
+}
 
-        // parse received message
-        char *action = NULL;
-        char *message = NULL;
-        char *sep = strchr(msg, ' ');
-        if (sep != NULL)
-        {
-            size_t len1 = sep - msg;
-            action = (char *)malloc(len1 + 1);
-            strncpy(action, msg, len1);
-            action[len1] = '\0';
-            message = strdup(sep + 1);
-        }
-        else
+void peer_read_loop(int fd, in_addr_t from)
+{
+    FrameParser parser;
+    Frame frame;
+    int node = -1;       // index of the node in peers, known after its PEER_HELLO
+    uint64_t generation = 0;
+    bool open = true;
+    while (open)
+    {
+        RingBuffer &in = parser.buffer();
+        auto [buf, space] = in.write_space(MSG_SZ);
+        ssize_t bytes_received = recv(fd, buf, space, 0);
+        if (bytes_received <= 0)
         {
-            action = strdup(msg);
-            message = strdup("");
+            open = (bytes_received < 0 && errno == EINTR);
+            continue;
         }
+        in.commit(bytes_received);
 
-        if ((string)action == "/exit")
+        FrameStatus status;
+        while (open && (status = parser.next(frame)) == FRAME_OK)
         {
-            if (!isEmpty(message) || sep != NULL) // appropriate usage message for "/exit" function
+            if (node >= 0)
             {
-                const char *err_msg = "\033[93mUsage : /exit\n(Do not add any whitespace or other characters)\n\033[0m";
-                send(client_fd, err_msg, strlen(err_msg), 0);
+                apply_peer_frame(node, frame);
                 continue;
             }
-            handle_exit(username, client_fd);
-            return;
-        }
-        else if ((string)action == "/msg") 
-        {
-            handle_msg(message, client_fd, username);
-        }
-        else if ((string)action == "/broadcast") 
-        {
-            handle_broadcast(username, message, client_fd);
+            // the first frame names the cluster port of the node, it must be one given with -N
+            int port = (frame.opcode == PEER_HELLO) ? atoi(string(frame.payload).c_str()) : 0;
+            for (size_t i = 0; i < peers.size() && node < 0; i++)
+            {
+                if (peers[i]->addr.sin_addr.s_addr == from && ntohs(peers[i]->addr.sin_port) == port)
+                {
+                    node = i;
+                }
+            }
+            if (node < 0)
+            {
+                cerr << "Rejected a link from an unknown node (cluster port " << port << ").\n";
+                open = false;
+                break;
+            }
+            lock_guard<mutex> lock(peers[node]->mtx);
+            generation = ++peers[node]->inbound;
         }
-        else if ((string)action == "/create_group")
+        open = open && status != FRAME_ERROR;
+    }
+    close(fd);
+
+    // a node that reconnected already replaced this link, its users are still there
+    if (node >= 0)
+    {
+        unique_lock<mutex> lock(peers[node]->mtx);
+        bool current = peers[node]->inbound == generation;
+        lock.unlock();
+        if (current)
         {
-            handle_create_group(message, client_fd);
+            cout << "Lost the link from node " << peers[node]->name << endl;
+            forget_node(node);
         }
-        else if ((string)action == "/join_group")
+    }
+}
+
+void peer_link_loop(PeerLink *link)
+{
+    while (1)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&link->addr, sizeof(link->addr)) < 0)
         {
-            handle_join_group(message, client_fd, username);
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            this_thread::sleep_for(chrono::milliseconds(PEER_RETRY_MS));
+            continue;
         }
-        else if ((string)action == "/leave_group")
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)); // batches are written whole, never wait for an ACK
+        struct timeval timeout = {PEER_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // frames queued from now on follow the snapshot, anything they repeat is applied twice harmlessly
         {
-            handle_leave_group(message, client_fd, username);
+            lock_guard<mutex> lock(link->mtx);
+            link->queue.clear();
+            link->up = true;
         }
-        else if ((string)action == "/group_msg")
+        cout << "Linked to node " << link->name << endl;
+
+        vector<string> batch = peer_snapshot();
+        while (write_frames(fd, batch))
         {
-            handle_group_msg(message, client_fd, username);
+            batch.clear();
+            unique_lock<mutex> lock(link->mtx);
+            link->not_empty.wait_for(lock, chrono::seconds(1), [link] { return !link->queue.empty(); });
+            batch.swap(link->queue);
+            lock.unlock();
+
+            // the node never writes on this link, a readable socket means it closed or reset it
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 0) != 0)
+            {
+                break;
+            }
         }
-        else if ((string)action == "/list_all_members")
         {
-            handle_list_all_members(client_fd);
+            lock_guard<mutex> lock(link->mtx);
+            link->up = false;
+            link->queue.clear();
         }
-        else if ((string)action == "/list_all_groups")
+        close(fd);
+        cout << "Lost the link to node " << link->name << endl;
+    }
+}
+
+bool write_frames(int fd, const vector<string> &frames)
+{
+    struct iovec iov[MAX_IOV];
+    size_t next = 0;   // first frame not completely written
+    size_t offset = 0; // bytes of that frame already written
+    while (next < frames.size())
+    {
+        int iov_cnt = 0;
+        for (size_t i = next; i < frames.size() && iov_cnt < MAX_IOV; i++)
         {
-            handle_list_all_groups(client_fd);
+            size_t skip = (i == next) ? offset : 0;
+            iov[iov_cnt++] = {(void *)(frames[i].data() + skip), frames[i].size() - skip};
         }
-        else if ((string)action == "/list_group_members")
+        ssize_t written = writev(fd, iov, iov_cnt);
+        if (written < 0 && errno == EINTR)
         {
-            handle_list_group_members(message, client_fd);
+            continue;
         }
-        else if ((string)action == "/help")
+        if (written <= 0)
         {
-            handle_help(client_fd);
+            return false;
         }
-        else  // error if none of the above actions
+        bump(my_metrics().bytes_out, written);
+        for (offset += written; next < frames.size() && offset >= frames[next].size(); next++)
         {
-            const char *err_msg = "\033[31mError : Invalid Action.\033[0m";
-            send(client_fd, err_msg, strlen(err_msg), 0);
-            continue;
+            offset -= frames[next].size();
         }
     }
+    return true;
 }
 
-void handle_msg(char *message, int client_fd, std::string &username)
+vector<string> peer_snapshot()
 {
-    // parse message to extract username
-    char recpt[BUFF_SZ];
-    int j = 0;
-    while (message[j] != '\0' && message[j] != ' ')
-    {
-        recpt[j] = message[j];
-        j++;
-    }
-    recpt[j] = '\0';
-
-
-    if (isEmpty(recpt)) // Send usage message  if username is empty
-    {
-        const char *err_msg = "\033[93mUsage : /msg <recipient_username> <message>\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
-    }
-    else if (userToSocket.find((string)recpt) == userToSocket.end()) // Send error message if username does not exist in the chat
-    {
-        const char *err_msg = "\033[31mError : Recipient not found in network.\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
-    }
-    else // Send the message if everything is correct
+    vector<string> frames;
+    frames.push_back(encode_frame(PEER_HELLO, to_string(cluster_port)));
+    for (auto &shard : userToSocket)
     {
-        int recv_fd = userToSocket[(string)recpt];
-        thread private_thread(private_mssg, (string)("[" + username + "]: " + message), recv_fd);
-        private_thread.detach();
+        shared_ptr<const UserList> users = user_snapshot(shard); // keeps the snapshot alive during the walk
+        for (auto &[user, socket] : *users)
+        {
+            frames.push_back(encode_frame(PEER_USER_UP, name_of(user_names, user)));
+        }
     }
-}
-
-void handle_broadcast(std::string &username, char *message, int &client_fd)
-{
-    // Create a thread to broadcast the message to all members except that client
-    thread broadcast_thread(broadcast, (string)("[" + username + " on broadcast]: " + message), client_fd);
-    broadcast_thread.detach();
-}
 
-void handle_create_group(char *message, int &client_fd)
-{
-    // parse the message to extract group name
-    // group name does not contain whitespaces
-    char group_name[BUFF_SZ];
-    int j = 0;
-    while (message[j] != '\0' && message[j] != ' ')
+    // every group, and which of this node's users are members
+    for (auto &shard : groupToMembers)
     {
-        group_name[j] = message[j];
-        j++;
+        vector<pair<NameId, shared_ptr<const MemberList>>> groups;
+        {
+            shared_lock<shared_mutex> lock(shard.lock);
+            groups.assign(shard.members.begin(), shard.members.end());
+        }
+        for (auto &[group, members] : groups)
+        {
+            const string &group_name = name_of(group_names, group);
+            frames.push_back(encode_frame(PEER_CREATE_GROUP, group_name));
+            for (NameId member : *members)
+            {
+                if (find_user(member) >= 0)
+                {
+                    frames.push_back(encode_frame(PEER_JOIN_GROUP, concat({group_name, " ", name_of(user_names, member)})));
+                }
+            }
+        }
     }
-    group_name[j] = '\0'; 
-
-    if (isEmpty(group_name)) // Send usage message if group name is empty
+    // and the patterns they subscribed to
+    vector<pair<NameId, vector<string>>> subscriptions;
     {
-        const char *err_msg = "\033[93mUsage : /create_group <group_name>\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
+        shared_lock<shared_mutex> lock(topics.lock);
+        subscriptions.assign(topics.by_user.begin(), topics.by_user.end());
     }
-    else if (groupToMembers.find((string)group_name) != groupToMembers.end()) // Send error message if group already exists
+    for (auto &[user, patterns] : subscriptions)
     {
-        const char *err_msg = "\033[31mError : This group already exists!\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
+        for (const string &pattern : patterns)
+        {
+            if (find_user(user) >= 0)
+            {
+                frames.push_back(encode_frame(PEER_JOIN_GROUP, concat({pattern, " ", name_of(user_names, user)})));
+            }
+        }
     }
-    else // Create the group and update groupToMembers map 
+    lock_guard<mutex> lock(presence.mtx);
+    for (auto &[group, window] : presence.windows)
     {
-        unique_lock<mutex> lock(mtx);
-        groupToMembers[group_name] = {socketToUser[client_fd]};
-        lock.unlock();
-        const char *server_msg = "\033[93mGroup created.\033[0m";
-        send(client_fd, server_msg, strlen(server_msg), 0);
+        frames.push_back(encode_frame(PEER_PRESENCE, concat({name_of(group_names, group), " ", to_string(window)})));
     }
+    return frames;
 }
 
-void handle_join_group(char *message, int &client_fd, string &username)
+void apply_peer_frame(int node, const Frame &frame)
 {
-    // parse the message to extract group name
-    char group_name[BUFF_SZ];
-    int j = 0;
-    while (message[j] != '\0' && message[j] != ' ')
+    // takes the next space separated field off the payload
+    string_view rest = frame.payload;
+    auto field = [&rest]()
     {
-        group_name[j] = message[j];
-        j++;
-    }
-    group_name[j] = '\0';
-
-    if (isEmpty(group_name)) // Send usage message if group name is empty
+        string_view word = first_word(rest);
+        rest.remove_prefix(min(rest.size(), word.size() + 1));
+        return word;
+    };
+    switch (frame.opcode)
     {
-        const char *err_msg = "\033[93mUsage : /join_group <group_name>\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
-    }
-    else if (groupToMembers.find((string)group_name) == groupToMembers.end()) // Send error message if group does not exist
+    case PEER_USER_UP:
     {
-        const char *err_msg = "\033[31mError : This group does not exists!\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
+        NameId user = intern(user_names, frame.payload);
+        RemoteShard &shard = remote_users[shard_of(user)];
+        unique_lock<shared_mutex> lock(shard.lock);
+        shard.nodes[user] = node;
+        break;
     }
-    else if (groupToMembers[group_name].find(socketToUser[client_fd]) != groupToMembers[group_name].end()) // Send error message if the client is already in that group
+    case PEER_USER_DOWN:
     {
-        const char *server_msg = "\033[93mYou are already in this group.\033[0m";
-        send(client_fd, server_msg, strlen(server_msg), 0);
+        NameId user = lookup(user_names, frame.payload);
+        if (user == NO_NAME)
+        {
+            break;
+        }
+        {
+            RemoteShard &shard = remote_users[shard_of(user)];
+            unique_lock<shared_mutex> lock(shard.lock);
+            auto entry = shard.nodes.find(user);
+            if (entry != shard.nodes.end() && entry->second == node)
+            {
+                shard.nodes.erase(entry);
+            }
+        }
+        if (find_user(user) < 0) // its node already told the members it left
+        {
+            leave_all_groups(user);
+        }
+        break;
     }
-    else  // add the client to that group and notify all existing members of that group about the new member 
+    case PEER_MSG:
     {
-        unique_lock<mutex> lock(mtx);
-        groupToMembers[group_name].insert(socketToUser[client_fd]);
-        lock.unlock();
-        string server_msg = "\033[93mYou joined " + (string)group_name + ".\033[0m";
-        thread send_thread(send_message, client_fd, server_msg);
-        send_thread.detach();
-        server_msg = "\033[93m" + username + " joined " + (string)group_name + ".\033[0m";
-        thread group_mssg_thread(group_mssg, server_msg, (string)group_name, client_fd);
-        group_mssg_thread.detach();
+        string_view recpt = field();
+        NameId recipient = lookup(user_names, recpt);
+        int recv_fd = (recipient == NO_NAME) ? -1 : find_user(recipient);
+        if (recv_fd >= 0)
+        {
+            private_mssg(string(rest), recv_fd);
+        }
+        // logged out meanwhile, kept in the inbox on this node
+        else if ((recipient = intern(user_names, recpt)) != NO_NAME)
+        {
+            submit_log({LOG_OFFLINE, stream_dir('u', recpt), make_payload(string(rest)), -1, NO_NAME, recipient, 0});
+        }
+        break;
     }
-}
-
-void handle_leave_group(char *message, int &client_fd, string &username)
-{
-    // parse the message to extract group name
-    char group_name[BUFF_SZ];
-    int j = 0;
-    while (message[j] != '\0' && message[j] != ' ')
+    case PEER_GROUP_MSG:
     {
-        group_name[j] = message[j];
-        j++;
+        NameId group = lookup(group_names, field());
+        bool logged = field() == "1";
+        if (group != NO_NAME)
+        {
+            group_mssg(string(rest), group, -1, logged);
+        }
+        break;
     }
-    group_name[j] = '\0';
-    if (isEmpty(group_name)) // Send usage message if group name is empty
+    case PEER_BROADCAST:
+        broadcast(string(frame.payload), -1);
+        break;
+    case PEER_CREATE_GROUP:
     {
-        const char *err_msg = "\033[93mUsage : /leave_group <group_name>\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
+        string_view group_name = field();
+        string_view creator = field();
+        NameId user = creator.empty() ? NO_NAME : intern(user_names, creator);
+        if (create_group(group_name, user) == GROUP_EXISTS && user != NO_NAME)
+        {
+            join_group(lookup(group_names, group_name), user); // created on two nodes at once
+        }
+        break;
     }
-    else if (groupToMembers.find((string)group_name) == groupToMembers.end()) // Send error message if group does not exist
+    case PEER_PRESENCE:
     {
-        const char *err_msg = "\033[31mError : This group does not exists!\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
+        NameId group = lookup(group_names, field());
+        string_view window_arg = field();
+        int window;
+        auto [end, err] = from_chars(window_arg.data(), window_arg.data() + window_arg.size(), window);
+        if (group != NO_NAME && err == errc() && window >= 0 && window <= PRESENCE_MAX_MS)
+        {
+            set_presence_window(group, window);
+        }
+        break;
     }
-    else if (groupToMembers[group_name].find(socketToUser[client_fd]) == groupToMembers[group_name].end()) // Send error message if the client is not in that group
+    case PEER_JOIN_GROUP:
+    case PEER_LEAVE_GROUP:
     {
-        const char *server_msg = "\033[31mError : You are not in this group.\033[0m";
-        send(client_fd, server_msg, strlen(server_msg), 0);
+        string_view group_name = field();
+        NameId group = lookup(group_names, group_name);
+        NameId user = intern(user_names, field());
+        if (is_pattern(group_name) && user != NO_NAME)
+        {
+            (frame.opcode == PEER_JOIN_GROUP) ? subscribe(group_name, user) : unsubscribe(group_name, user);
+        }
+        else if (group != NO_NAME && user != NO_NAME)
+        {
+            (frame.opcode == PEER_JOIN_GROUP) ? join_group(group, user) : leave_group(group, user);
+        }
+        break;
     }
-    else // remove the client from that group and notify all existing members of that group about the exit member
-    {
-        unique_lock<mutex> lock(mtx);
-        groupToMembers[group_name].erase(socketToUser[client_fd]);
-        lock.unlock();
-        string server_msg = "\033[93mYou left " + (string)group_name + ".\033[0m";
-        thread send_thread(send_message, client_fd, server_msg);
-        send_thread.detach();
-        server_msg = "\033[93m" + username + " left " + (string)group_name + ".\033[0m";
-        thread group_mssg_thread(group_mssg, server_msg, (string)group_name, client_fd);
-        group_mssg_thread.detach();
+    default:
+        break;
     }
 }
 
-void handle_group_msg(char *message, int &client_fd, string &username)
+void peer_send(int node, uint8_t op, string_view payload)
 {
-    // parse the message to extract group name
-    char group_name[BUFF_SZ];
-    int j = 0;
-    while (message[j] != '\0' && message[j] != ' ')
+    PeerLink *link = peers[node];
+    unique_lock<mutex> lock(link->mtx);
+    if (!link->up || link->queue.size() >= PEER_QUEUE_SZ)
     {
-        group_name[j] = message[j];
-        j++;
+        return; // the node gets a fresh snapshot when its link comes back
     }
-    group_name[j] = '\0';
-
-    // parse the message to extract message body
-    char message_body[MSG_SZ];
-    int k = 0;
-    while (message[j] != '\0')
+    bool was_empty = link->queue.empty();
+    link->queue.push_back(encode_frame(op, payload));
+    lock.unlock();
+    if (was_empty)
     {
-        message_body[k++] = message[j++];
+        link->not_empty.notify_one();
     }
-    message_body[k] = '\0';
+}
 
-    if (isEmpty(group_name)) // Send usage message if group name is empty
-    {
-        const char *err_msg = "\033[93mUsage : /group_msg <group_name> <message>\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
-    }
-    else if (groupToMembers.find((string)group_name) == groupToMembers.end()) // Send error message if group does not exist
-    {
-        const char *err_msg = "\033[31mError : This group does not exist!\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
-    }
-    else // Create a thread to send the message to all members of the group except that client
+void peer_send_all(uint8_t op, string_view payload)
+{
+    for (size_t node = 0; node < peers.size(); node++)
     {
-        string group_msg = "[" + username + " on Group " + (string)group_name + "]: " + (string)message_body;
-        thread group_mssg_thread(group_mssg, group_msg, (string)group_name, client_fd);
-        group_mssg_thread.detach();
+        peer_send(node, op, payload);
     }
 }
 
-void handle_exit(string &username, int &client_fd)
+int find_remote(NameId user)
 {
-    // update the data structures to remove that client
-    unique_lock<mutex> lock(mtx);
-    userToSocket.erase(userToSocket.find(username));
-    socketToUser.erase(socketToUser.find(client_fd));
-
-    client_set.erase(client_fd);
+    RemoteShard &shard = remote_users[shard_of(user)];
+    shared_lock<shared_mutex> lock(shard.lock);
+    auto entry = shard.nodes.find(user);
+    return (entry == shard.nodes.end()) ? -1 : entry->second;
+}
 
-    // remove that client from the groups it was joined in
-    for (auto &[group_name, members] : groupToMembers)
+void forget_node(int node)
+{
+    vector<NameId> gone;
+    for (auto &shard : remote_users)
     {
-        if (members.find(username) != members.end())
+        unique_lock<shared_mutex> lock(shard.lock);
+        erase_if(shard.nodes, [&](const auto &entry)
+                 {
+                     if (entry.second == node)
+                     {
+                         gone.push_back(entry.first);
+                     }
+                     return entry.second == node;
+                 });
+    }
+    for (NameId user : gone)
+    {
+        if (find_user(user) < 0)
         {
-            string server_msg = "\033[93m" + username + " left " + (string)group_name + ".\033[0m";
-            thread group_mssg_thread(group_mssg, server_msg, (string)group_name, client_fd);
-            group_mssg_thread.detach();
+            leave_all_groups(user);
         }
     }
-    close(client_fd);
-    lock.unlock();
-    
-    // Notify all clients about that client leaving
-    thread broadcast_thread(broadcast, "\033[093m" + username + " has left the chat! \033[0m", client_fd);
-    broadcast_thread.detach();
-    return;
 }
 
-void handle_list_all_members(int &client_fd)
+SSL_CTX *create_tls_context(const char *cert_file, const char *key_file)
 {
-    // print list of all clients active on the server
-    stringstream ss;
-    ss << "\033[93m";
-    unique_lock<mutex> lock(mtx);
-    for (auto &[username, socket] : userToSocket)
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == nullptr || SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) != 1 ||
+        SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1)
     {
-        ss << username << "\n";
+        cerr << "Error loading the TLS certificate " << cert_file << " and key " << key_file << ":\n";
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return nullptr;
     }
-    lock.unlock();
-    ss << "\033[0m";
-    string user_list = ss.str();
-    send_message(client_fd, user_list);
+
+    // a reconnecting client presents its session ticket and skips the certificate signature. Tickets
+    // are sealed with a key of this process, so the server keeps no per-session state for them.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(ctx, TLS_TICKETS);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+    return ctx;
 }
 
-void handle_list_all_groups(int &client_fd)
+shared_ptr<TlsConn> new_tls_conn()
 {
-    // print list of all groups active on the server
-    stringstream ss;
-    ss << "\033[93m";
-    unique_lock<mutex> lock(mtx);
-    for (auto &[group_name, members] : groupToMembers)
+    auto tls = make_shared<TlsConn>();
+    BIO *rbio = BIO_new(BIO_s_mem());
+    BIO *wbio = BIO_new(BIO_s_mem());
+    tls->ssl = SSL_new(tls_ctx);
+    if (tls->ssl == nullptr || rbio == nullptr || wbio == nullptr)
     {
-        ss << group_name << "\n";
+        BIO_free(rbio);
+        BIO_free(wbio);
+        ERR_clear_error();
+        return nullptr;
     }
-    lock.unlock();
-    ss << "\033[0m";
-    string group_list = ss.str();
-    send_message(client_fd, group_list);
+    SSL_set_bio(tls->ssl, rbio, wbio); // owned by ssl from now on
+    SSL_set_accept_state(tls->ssl);
+    return tls;
 }
 
-void handle_list_group_members(char *message, int &client_fd)
+ssize_t tls_recv(Session &session, char *buf, size_t len)
 {
-    // print list of all members of a particular group on the server
-    char group_name[BUFF_SZ];
-    int j = 0;
-    while (message[j] != '\0' && message[j] != ' ')
+    TlsConn &tls = *session.tls;
+    while (1)
     {
-        group_name[j] = message[j];
-        j++;
-    }
-    group_name[j] = '\0';
+        unique_lock<mutex> lock(tls.mtx);
+        if (SSL_is_init_finished(tls.ssl))
+        {
+            int n = SSL_read(tls.ssl, buf, len);
+            int err = (n > 0) ? SSL_ERROR_NONE : SSL_get_error(tls.ssl, n);
+            bool output = BIO_ctrl_pending(SSL_get_wbio(tls.ssl)) > 0; // a key update answer or an alert
+            ERR_clear_error();
+            lock.unlock();
+            if (output)
+            {
+                send_tls_output(session.fd);
+            }
+            if (err == SSL_ERROR_NONE)
+            {
+                return n;
+            }
+            if (err == SSL_ERROR_ZERO_RETURN)
+            {
+                return 0; // close_notify
+            }
+            if (err != SSL_ERROR_WANT_READ)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+        }
+        else
+        {
+            lock.unlock();
+        }
 
-    if (isEmpty(group_name)) // Send usage message if group name is empty
-    {
-        const char *err_msg = "\033[93mUsage : /list_group_members <group_name>\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
-    }
-    else if (groupToMembers.find((string)group_name) == groupToMembers.end()) // Send error message if group does not exist
-    {
-        const char *err_msg = "\033[31mError : This group does not exist!\033[0m";
-        send(client_fd, err_msg, strlen(err_msg), 0);
-    }
-    else
-    {
-        stringstream ss;
-        unique_lock<mutex> lock(mtx);
-        for (auto &member : groupToMembers[group_name])
+        // the buffered records are used up, feed the next ones from the socket
+        char cipher[TLS_READ_SZ];
+        ssize_t received = recv(session.fd, cipher, sizeof(cipher), 0);
+        bump(my_metrics().io_calls[0]);
+        if (received <= 0)
         {
-            ss << member << "\n";
+            return received;
         }
+        lock.lock();
+        BIO_write(SSL_get_rbio(tls.ssl), cipher, received);
+        bool handshaking = !SSL_is_init_finished(tls.ssl);
         lock.unlock();
-        string member_list = ss.str();
-        send_message(client_fd, member_list);
-
+        if (handshaking)
+        {
+            // the crypto of a handshake runs on an auth worker, finish_logins reads on when it is done
+            if (!submit_handshake(session))
+            {
+                errno = EBUSY;
+                return -1;
+            }
+            errno = EAGAIN;
+            return -1;
+        }
     }
 }
 
-void handle_help(int &client_fd)
-{
-    // print help message 
-    stringstream ss;
-    ss << "\033[32mList of availabe actions : \033[0m\n"
-       << "\033[93m/msg <recipient's username> <message>\033[0m\tSend a private message to another user in the chat\n"
-       << "\033[93m/broadcast <message>\033[0m\t\t\tSend a message to all the users in the chat\n"
-       << "\033[93m/create_group <group_name>\033[0m\t\tCreate a group for messaging\n"
-       << "\033[93m/join_group <group_name>\033[0m\t\tJoin an existing group\n"
-       << "\033[93m/group_msg <group_name> <message>\033[0m\tSend a message to all the members of the group\n"
-       << "\033[93m/leave_group <group_name>\033[0m\t\tLeave a group\n"
-       << "\033[93m/list_all_members\033[0m\t\t\tPrint a list of all members present in the chat\n"
-       << "\033[93m/list_all_groups\033[0m\t\t\tPrint a list of all groups in the chat\n"
-       << "\033[93m/list_group_members <group_name>\033[0m\tPrint a list of all members in a group\n"
-       << "\033[93m/help\033[0m\t\t\t\t\tPrint this help message\n"
-       << "\033[93m/exit\033[0m\t\t\t\t\tExit the chat\n";
-    string help_msg = ss.str();
-    send_message(client_fd, help_msg);
-}
-
-void handle_sigint(int sig) // handle abrupt shutdown
+bool submit_handshake(Session &session)
 {
-    printf("\nCaught signal %d (SIGINT). Shutting down gracefully...\n", sig);
-    unique_lock<mutex> lock(mtx);
-    // Close the server socket
-    for (auto fd : client_set)
+    unique_lock<mutex> lock(auth_queue.mtx);
+    if (auth_queue.requests.size() >= AUTH_QUEUE_SZ)
     {
-        close(fd);
+        return false; // a handshake storm is turned away like a login flood
     }
+    session.state = TLS_HANDSHAKE;
+    auth_queue.requests.push_back({&session, session.reactor, "", "", session.tls});
     lock.unlock();
-    if (sock_fd != -1)
-    {
-        close(sock_fd);
-        printf("Server socket closed.\n");
-    }
-
-    // Perform other cleanup if necessary
-    printf("Server shutdown complete.\n");
-    exit(0); // Exit the program
+    auth_queue.not_empty.notify_one();
+    return true;
 }
 
-bool isEmpty(const char str[]) // returns true if a string is empty or has just whitespaces, else false
+bool handshake_step(AuthRequest &request)
 {
-    for (int i = 0; str[i] != '\0'; i++)
+    TlsConn &tls = *request.tls;
+    ThreadMetrics &metrics = my_metrics();
+    uint64_t start = now_ns();
+    bool ok;
     {
-        if (!isspace(str[i]))
+        lock_guard<mutex> lock(tls.mtx);
+        int ret = SSL_do_handshake(tls.ssl);
+        ok = ret == 1 || SSL_get_error(tls.ssl, ret) == SSL_ERROR_WANT_READ;
+        if (ret == 1)
         {
-            return false;
+            bump(metrics.tls_handshakes[SSL_session_reused(tls.ssl) ? 1 : 0]);
         }
+        ERR_clear_error();
     }
-    return true;
+    record(metrics.tls_handshake_ns, now_ns() - start);
+    send_tls_output(request.session->fd); // the server's flight, or the alert of a failed handshake
+    return ok;
 }
 
-void send_message(int client_sock, string message) // send message to a particular client socket
+void send_tls_output(int client_sock)
 {
-    send(client_sock, message.c_str(), message.length(), 0);
+    enqueue(client_sock, nullptr, OUT_TLS);
 }
 
-void group_mssg(string message, string group_name, int client_fd) // send message to all members of a group except the sending client
+bool flush_tls(SenderWorker *worker, int client_sock, Outbox &box)
 {
-    unique_lock<mutex> lock(mtx);
-    for (auto it = groupToMembers[group_name].begin(); it != groupToMembers[group_name].end(); ++it)
+    while (1)
     {
-        if (userToSocket[*it] != client_fd)
+        if (box.sealed_off == box.sealed.size())
+        {
+            box.sealed.clear();
+            box.sealed_off = 0;
+            if (!seal_records(box))
+            {
+                return false;
+            }
+            catch_up(box);
+            if (box.sealed.empty())
+            {
+                break; // nothing left, or the handshake is not done yet
+            }
+        }
+        ssize_t written = write(client_sock, box.sealed.data() + box.sealed_off, box.sealed.size() - box.sealed_off);
+        bump(my_metrics().io_calls[1]);
+        if (written < 0)
         {
-            thread client_thread(send_message, userToSocket[*it], message);
-            client_thread.detach();
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                wait_writable(worker, client_sock, box);
+                return true;
+            }
+            return false;
         }
+        bump(my_metrics().bytes_out, written);
+        box.sealed_off += written;
     }
-    lock.unlock();
-}
-
-void private_mssg(string message, int recv_fd) // send message to a particular client 
-{ 
-    unique_lock<mutex> lock(mtx);
-    thread pvt_mssg_thread(send_message, recv_fd, message);
-    pvt_mssg_thread.detach();
-    lock.unlock();
+    publish_stats(box);
+    return true;
 }
 
-void broadcast(string message, int broadcast_fd) // send message to all active members on the server except the sending client
+bool seal_records(Outbox &box)
 {
-    unique_lock<mutex> lock(mtx);
-    for (auto it = userToSocket.begin(); it != userToSocket.end(); ++it)
+    TlsConn &tls = *box.tls;
+    lock_guard<mutex> lock(tls.mtx);
+    if (SSL_is_init_finished(tls.ssl) && !box.pending.empty())
     {
-        if (it->second != broadcast_fd)
+        // pack the pending messages into one record instead of paying a record header and tag for each,
+        // a large message continues in the next record
+        char plain[TLS_RECORD_SZ];
+        size_t len = 0;
+        uint64_t messages = 0;
+        while (!box.pending.empty() && len < TLS_RECORD_SZ)
+        {
+            Pending &front = box.pending.front();
+            unsigned char header[FRAME_HDR_SZ];
+            size_t hdr_sz = front.opcode ? FRAME_HDR_SZ : 0;
+            if (front.opcode)
+            {
+                encode_frame_header(header, front.opcode, front.data->size());
+            }
+            size_t total = hdr_sz + front.data->size();
+            size_t end = box.offset + min(total - box.offset, TLS_RECORD_SZ - len);
+            if (box.offset < hdr_sz)
+            {
+                memcpy(plain + len, header + box.offset, min(end, hdr_sz) - box.offset);
+            }
+            if (end > hdr_sz)
+            {
+                size_t from = max(box.offset, hdr_sz);
+                memcpy(plain + len + (from - box.offset), front.data->data() + (from - hdr_sz), end - from);
+            }
+            len += end - box.offset;
+            box.bytes -= end - box.offset;
+            box.offset = end;
+            messages++;
+            if (end == total)
+            {
+                box.offset = 0;
+                box.pending.pop_front();
+            }
+        }
+        // memory BIOs take everything, a short write is an error of the session
+        if (SSL_write(tls.ssl, plain, len) != (int)len)
         {
-            thread client_thread(send_message, it->second, message);
-            client_thread.detach();
+            ERR_clear_error();
+            return false;
         }
+        record(my_metrics().tls_record_messages, messages);
     }
-    lock.unlock();
+
+    // everything the TLS layer produced, handshake messages and records in the order they were made
+    BIO *wbio = SSL_get_wbio(tls.ssl);
+    box.sealed.resize(BIO_ctrl_pending(wbio));
+    return box.sealed.empty() || BIO_read(wbio, box.sealed.data(), box.sealed.size()) == (int)box.sealed.size();
 }
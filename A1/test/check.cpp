@@ -0,0 +1,318 @@
+// Regression checks of the storage and framing code that server_grp, chat_client.h and the test tools
+// share: LogStream (message_log.h) and FrameParser (framing.h). Run by "make check", prints every
+// failed check and exits with 1 if there was one.
+//
+// A crash is simulated by dropping a LogStream without commit(), its appends are then in the segment
+// but not in the index, and by truncating or corrupting the segment file behind it.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../framing.h"
+#include "../message_log.h"
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond)                                                                          \
+    do {                                                                                     \
+        checks++;                                                                            \
+        if (!(cond)) {                                                                       \
+            failures++;                                                                      \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n";      \
+        }                                                                                    \
+    } while (0)
+
+// payload of record seq, of len bytes, so a read can be told apart from any other record
+std::string record(uint64_t seq, size_t len = 40) {
+    std::string payload = "record " + std::to_string(seq) + " ";
+    payload.resize(std::max(len, payload.size()), (char)('a' + seq % 26));
+    return payload;
+}
+
+// true if record seq of the stream reads back as record(seq, len) with time seq
+bool reads_back(const LogStream &stream, uint64_t seq, size_t len = 40) {
+    std::string payload;
+    int64_t time = -1;
+    return stream.read(seq, payload, time) && payload == record(seq, len) && time == (int64_t)seq;
+}
+
+std::unique_ptr<LogStream> open_stream(const std::string &dir) {
+    auto stream = std::make_unique<LogStream>();
+    return stream->open(dir, true) ? std::move(stream) : nullptr;
+}
+
+std::string segment_path(const std::string &dir, uint32_t number) {
+    char name[16];
+    snprintf(name, sizeof(name), "%08u.seg", number);
+    return dir + "/" + name;
+}
+
+off_t file_size(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+void remove_dir(const std::string &dir) {
+    if (DIR *d = opendir(dir.c_str())) {
+        while (struct dirent *entry = readdir(d)) {
+            if (entry->d_name[0] != '.') {
+                unlink((dir + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+}
+
+// appends records [from, to) and commits them
+bool append_committed(LogStream &stream, uint64_t from, uint64_t to, size_t len = 40) {
+    for (uint64_t seq = from; seq < to; seq++) {
+        if (!stream.append(record(seq, len), seq)) {
+            return false;
+        }
+    }
+    return stream.commit();
+}
+
+void check_log_commit(const std::string &dir) {
+    auto stream = open_stream(dir);
+    CHECK(stream != nullptr);
+    if (stream == nullptr) {
+        return;
+    }
+    CHECK(stream->committed() == 0);
+    CHECK(append_committed(*stream, 0, 3));
+    CHECK(stream->committed() == 3);
+    CHECK(reads_back(*stream, 0) && reads_back(*stream, 1) && reads_back(*stream, 2));
+
+    // an append is readable only once committed
+    CHECK(stream->append(record(3), 3));
+    CHECK(stream->committed() == 3 && stream->next_seq() == 4 && stream->has_pending());
+    std::string payload;
+    int64_t time;
+    CHECK(!stream->read(3, payload, time));
+    CHECK(stream->commit());
+    CHECK(stream->committed() == 4 && reads_back(*stream, 3));
+
+    stream = open_stream(dir);
+    CHECK(stream != nullptr && stream->committed() == 4 && reads_back(*stream, 0) && reads_back(*stream, 3));
+}
+
+void check_log_recover(const std::string &dir) {
+    auto stream = open_stream(dir);
+    CHECK(stream != nullptr && append_committed(*stream, 0, 5));
+
+    // synced records the index missed are indexed again at the next open
+    CHECK(stream->append(record(5), 5) && stream->append(record(6), 6));
+    stream.reset();
+    stream = open_stream(dir);
+    CHECK(stream != nullptr && stream->committed() == 7);
+    CHECK(stream != nullptr && reads_back(*stream, 5) && reads_back(*stream, 6));
+
+    // a record torn in the middle is cut off, the stream goes on where it ended
+    off_t complete = file_size(segment_path(dir, 0));
+    CHECK(stream->append(record(7, 200), 7));
+    stream.reset();
+    CHECK(truncate(segment_path(dir, 0).c_str(), complete + sizeof(LogRecordHeader) + 100) == 0);
+    stream = open_stream(dir);
+    CHECK(stream != nullptr && stream->committed() == 7);
+    CHECK(file_size(segment_path(dir, 0)) == complete);
+    CHECK(stream != nullptr && append_committed(*stream, 7, 8));
+    CHECK(stream != nullptr && stream->committed() == 8 && reads_back(*stream, 7) && reads_back(*stream, 6));
+
+    // so is one whose payload does not match its checksum
+    complete = file_size(segment_path(dir, 0));
+    CHECK(stream->append(record(8), 8));
+    stream.reset();
+    FILE *seg = fopen(segment_path(dir, 0).c_str(), "r+b");
+    CHECK(seg != nullptr);
+    if (seg != nullptr) {
+        fseek(seg, complete + sizeof(LogRecordHeader) + 3, SEEK_SET);
+        fputc('#', seg);
+        fclose(seg);
+    }
+    stream = open_stream(dir);
+    CHECK(stream != nullptr && stream->committed() == 8);
+    CHECK(file_size(segment_path(dir, 0)) == complete);
+
+    // a torn header too
+    CHECK(stream->append(record(8), 8));
+    stream.reset();
+    CHECK(truncate(segment_path(dir, 0).c_str(), complete + sizeof(LogRecordHeader) / 2) == 0);
+    stream = open_stream(dir);
+    CHECK(stream != nullptr && stream->committed() == 8 && reads_back(*stream, 7));
+}
+
+void check_log_index_growth(const std::string &dir) {
+    // the index starts with room for LOG_INDEX_GROW entries and is mapped again as it grows
+    uint64_t total = 2 * LOG_INDEX_GROW + 10;
+    auto stream = open_stream(dir);
+    CHECK(stream != nullptr);
+    if (stream == nullptr) {
+        return;
+    }
+    for (uint64_t seq = 0; seq < total; seq += 1000) {
+        CHECK(append_committed(*stream, seq, std::min(total, seq + 1000), 8));
+    }
+    CHECK(stream->committed() == total);
+    CHECK(reads_back(*stream, 0, 8) && reads_back(*stream, LOG_INDEX_GROW, 8) && reads_back(*stream, total - 1, 8));
+    CHECK(file_size(dir + "/index") ==
+          (off_t)(sizeof(LogIndexHeader) + 3 * LOG_INDEX_GROW * sizeof(LogIndexEntry)));
+
+    // recovery grows it as well, for records past the end of an index that is full
+    stream = open_stream(dir);
+    CHECK(stream != nullptr && stream->committed() == total);
+    uint64_t more = LOG_INDEX_GROW + 1000; // past the last page of the mapping as well
+    bool appended = stream != nullptr;
+    for (uint64_t seq = total; seq < total + more && appended; seq++) {
+        appended = stream->append(record(seq, 8), seq);
+    }
+    CHECK(appended);
+    stream.reset();
+    stream = open_stream(dir);
+    CHECK(stream != nullptr && stream->committed() == total + more);
+    CHECK(file_size(dir + "/index") ==
+          (off_t)(sizeof(LogIndexHeader) + 4 * LOG_INDEX_GROW * sizeof(LogIndexEntry)));
+    CHECK(stream != nullptr && reads_back(*stream, total + more - 1, 8) && reads_back(*stream, total - 1, 8));
+}
+
+void check_log_segments(const std::string &dir) {
+    // records of 64 KiB fill a segment of LOG_SEGMENT_SZ after 128 of them
+    const size_t len = 64 << 10;
+    const uint64_t per_segment = LOG_SEGMENT_SZ / (len + sizeof(LogRecordHeader)) + 1;
+    auto stream = open_stream(dir);
+    CHECK(stream != nullptr && append_committed(*stream, 0, per_segment + 5, len));
+    CHECK(file_size(segment_path(dir, 1)) > 0 && file_size(segment_path(dir, 2)) < 0);
+    CHECK(stream != nullptr && reads_back(*stream, 0, len) && reads_back(*stream, per_segment - 1, len) &&
+          reads_back(*stream, per_segment + 4, len));
+
+    // records lost by the index are found across the segment boundary
+    CHECK(stream->append(record(per_segment + 5, len), per_segment + 5));
+    for (uint64_t seq = per_segment + 6; seq < 2 * per_segment + 3; seq++) {
+        CHECK(stream->append(record(seq, len), seq));
+    }
+    CHECK(file_size(segment_path(dir, 2)) > 0);
+    stream.reset();
+    stream = open_stream(dir);
+    CHECK(stream != nullptr && stream->committed() == 2 * per_segment + 3);
+    CHECK(stream != nullptr && reads_back(*stream, 2 * per_segment + 2, len) && reads_back(*stream, per_segment + 5, len));
+
+}
+
+void check_log_torn_segment(const std::string &dir) {
+    // a torn record ends the stream in its segment, the segments after it hold nothing committed
+    const size_t len = 64 << 10;
+    const uint64_t per_segment = LOG_SEGMENT_SZ / (len + sizeof(LogRecordHeader)) + 1;
+    auto stream = open_stream(dir);
+    CHECK(stream != nullptr && append_committed(*stream, 0, 5, len));
+    bool appended = stream != nullptr;
+    for (uint64_t seq = 5; seq < per_segment + 3 && appended; seq++) {
+        appended = stream->append(record(seq, len), seq);
+    }
+    CHECK(appended && file_size(segment_path(dir, 1)) > 0);
+    stream.reset();
+    CHECK(truncate(segment_path(dir, 0).c_str(), file_size(segment_path(dir, 0)) - 10) == 0);
+    stream = open_stream(dir);
+    CHECK(stream != nullptr && stream->committed() == per_segment - 1);
+    CHECK(file_size(segment_path(dir, 1)) < 0);
+    CHECK(stream != nullptr && append_committed(*stream, per_segment - 1, per_segment + 1, len));
+    CHECK(file_size(segment_path(dir, 1)) > 0);
+    CHECK(stream != nullptr && reads_back(*stream, per_segment, len) && reads_back(*stream, per_segment - 2, len));
+}
+
+// the frames a parser yields, each with its opcode in front, while the bytes come in as cut
+std::vector<std::string> parse(FrameParser &parser, const std::string &bytes, const std::vector<size_t> &cuts) {
+    std::vector<std::string> frames;
+    size_t from = 0;
+    for (size_t i = 0; i <= cuts.size(); i++) {
+        size_t to = (i < cuts.size()) ? cuts[i] : bytes.size();
+        parser.buffer().append(bytes.data() + from, to - from);
+        from = to;
+        Frame frame;
+        while (parser.next(frame) == FRAME_OK) {
+            frames.push_back(std::string(1, (char)frame.opcode) + std::string(frame.payload));
+        }
+    }
+    return frames;
+}
+
+void check_frames() {
+    std::vector<std::string> sent = {std::string(1, (char)OP_USERNAME) + "alice",
+                                     std::string(1, (char)OP_COMMAND) + "",
+                                     std::string(1, (char)OP_BROADCAST) + std::string(3000, 'x'),
+                                     std::string(1, (char)OP_EXIT) + "bye"};
+    std::string bytes;
+    for (const std::string &frame : sent) {
+        bytes += encode_frame(frame[0], std::string_view(frame).substr(1));
+    }
+
+    // pipelined in one read, then split at every byte
+    FrameParser whole;
+    CHECK(parse(whole, bytes, {}) == sent);
+    std::vector<size_t> every_byte;
+    for (size_t i = 1; i < bytes.size(); i++) {
+        every_byte.push_back(i);
+    }
+    FrameParser split;
+    CHECK(parse(split, bytes, every_byte) == sent);
+
+    // a frame wrapping around the end of the 4096 byte ring: payload, then header cut by the wrap
+    for (size_t head_room : {(size_t)200, (size_t)3}) {
+        FrameParser parser;
+        std::string filler = encode_frame(OP_TEXT, std::string(4096 - head_room - FRAME_HDR_SZ, 'f'));
+        std::string wrapped = encode_frame(OP_GROUP_MSG, "team " + std::string(1000, 'w'));
+        std::string stream = filler + wrapped + encode_frame(OP_EXIT, "");
+        std::vector<std::string> frames = parse(parser, stream, {filler.size() + 1});
+        CHECK(frames.size() == 3);
+        CHECK(frames.size() == 3 && frames[1] == std::string(1, (char)OP_GROUP_MSG) + "team " + std::string(1000, 'w'));
+    }
+
+    // a frame over MAX_FRAME_SZ is an error, not a wait for a megabyte
+    FrameParser big;
+    unsigned char hdr[FRAME_HDR_SZ];
+    encode_frame_header(hdr, OP_TEXT, MAX_FRAME_SZ + 1);
+    big.buffer().append((const char *)hdr, FRAME_HDR_SZ);
+    Frame frame;
+    CHECK(big.next(frame) == FRAME_ERROR);
+
+    // a retained frame is returned again, as a rate limited command is
+    FrameParser held;
+    held.buffer().append(bytes.data(), bytes.size());
+    CHECK(held.next(frame) == FRAME_OK && frame.payload == "alice");
+    held.retain();
+    CHECK(held.next(frame) == FRAME_OK && frame.payload == "alice");
+    CHECK(held.next(frame) == FRAME_OK && frame.opcode == OP_COMMAND && frame.payload.empty());
+}
+
+int main() {
+    char base[] = "/tmp/check_XXXXXX";
+    if (mkdtemp(base) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string root = base;
+    std::vector<std::pair<const char *, void (*)(const std::string &)>> log_checks = {
+        {"commit", check_log_commit},
+        {"recover", check_log_recover},
+        {"index", check_log_index_growth},
+        {"segments", check_log_segments},
+        {"torn", check_log_torn_segment}};
+    for (auto &[name, check] : log_checks) {
+        std::string dir = root + "/" + name;
+        check(dir);
+        remove_dir(dir);
+    }
+    rmdir(root.c_str());
+    check_frames();
+
+    std::cout << checks - failures << " of " << checks << " checks passed\n";
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,775 @@
+// Headless load generator for server_grp: logs in thousands of framed sessions from one process,
+// drives a mix of /msg, /group_msg and /broadcast at a fixed rate and reports throughput and
+// end-to-end delivery latency as JSON on stdout.
+//
+// Every message carries its send time ("@t<nanoseconds>"), the receiving session subtracts it
+// from the time of arrival, so a broadcast yields one latency sample per recipient.
+//
+// -T connects with TLS (the server certificate is not verified), -R drops every session after the
+// logins and logs it in again at once, resuming its TLS session, to measure a reconnect storm.
+// -z offers compression at login, the bytes received per delivery show what it saves.
+// -M scrapes the server's metrics endpoint before and after the load, the system calls of its
+// receive and send paths per delivery compare its I/O backends (server_grp -B epoll|uring).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../compression.h"
+#include "../framing.h"
+
+#define MAX_EVENTS 256
+#define LOGIN_WINDOW 128     // logins a thread has in flight at once
+#define SUB_BUCKETS 32       // histogram buckets per power of two, about 3% resolution
+#define TS_MARKER "@t"       // precedes the send time in a payload
+
+enum MsgKind { KIND_MSG, KIND_GROUP, KIND_BROADCAST, NUM_KINDS };
+const char *KIND_NAMES[NUM_KINDS] = {"msg", "group_msg", "broadcast"};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 12345;
+    int sessions = 1000;
+    int threads = 1;
+    double duration = 10;      // seconds of measured load
+    double rate = 1000;        // messages sent per second, all threads together
+    int mix[NUM_KINDS] = {80, 15, 5};
+    int groups = 10;
+    size_t payload = 64;       // bytes per message, including the timestamp
+    std::string prefix = "load";
+    bool tls = false;          // -T
+    bool reconnect = false;    // -R
+    bool compress = false;     // -z
+    int metrics_port = 0;      // -M, the server's metrics endpoint on host
+};
+
+Options opts;
+
+// Latency histogram in microseconds, SUB_BUCKETS linear buckets per power of two.
+struct Histogram {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(64 * SUB_BUCKETS);
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    static size_t index(uint64_t us) {
+        if (us < SUB_BUCKETS) {
+            return us;
+        }
+        int e = 63 - __builtin_clzll(us); // >= log2(SUB_BUCKETS)
+        int shift = e - __builtin_ctz(SUB_BUCKETS);
+        return (shift + 1) * SUB_BUCKETS + ((us >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    // largest value that falls into bucket i
+    static uint64_t upper(size_t i) {
+        if (i < SUB_BUCKETS) {
+            return i;
+        }
+        int shift = i / SUB_BUCKETS - 1;
+        return ((SUB_BUCKETS + i % SUB_BUCKETS + 1) << shift) - 1;
+    }
+
+    void add(uint64_t us) {
+        counts[index(us)]++;
+        total++;
+        max = std::max(max, us);
+    }
+
+    void merge(const Histogram &other) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = (uint64_t)(p / 100 * total), seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen > rank) {
+                return std::min(upper(i), max);
+            }
+        }
+        return max;
+    }
+};
+
+struct Conn {
+    int fd;
+    int index;               // session number, the username is prefix + index
+    SSL *ssl = nullptr;      // TLS only
+    SSL_SESSION *ticket = nullptr; // TLS session the server issued, resumed by the reconnect
+    bool again = false;      // logging in again in the reconnect storm
+    bool framed = false;     // the server acknowledged FRAME_MAGIC
+    int replies = 0;         // frames received during login, the second one is the verdict
+    bool logged_in = false;
+    bool failed = false;
+    std::string handshake;   // text received before the acknowledgement
+    FrameParser parser;
+    std::string out;         // bytes the socket has not accepted yet
+    size_t out_off = 0;
+    bool want_write = false; // EPOLLOUT is armed
+};
+
+struct Worker {
+    int epoll_fd;
+    std::vector<Conn *> conns;
+    Histogram hist;
+    uint64_t sent[NUM_KINDS] = {};
+    uint64_t expected = 0;   // deliveries the sent messages should cause
+    uint64_t delivered = 0;  // timestamped messages received
+    uint64_t last_frame_ns = 0;
+    uint64_t bytes_in = 0;   // bytes received once the sessions are logged in
+    Inflater inflater;       // OP_DEFLATE frames of every session of the worker
+    std::string text;        // the last inflated frame
+    std::mt19937_64 rng;
+};
+
+std::atomic<int> logged_in{0};
+std::atomic<int> login_failed{0};
+std::atomic<int> reconnected{0};      // logins again in the reconnect storm
+std::atomic<int> reconnect_failed{0};
+std::atomic<int> resumed{0};          // reconnects that resumed their TLS session
+std::atomic<uint64_t> storm_start{0}; // when the first session dropped its connection
+std::atomic<int> barrier_count{0};
+SSL_CTX *tls_ctx = nullptr;
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+std::string username(int index) { return opts.prefix + std::to_string(index); }
+std::string password(int index) { return "pw" + std::to_string(index); }
+std::string group_name(int index) { return opts.prefix + "_g" + std::to_string(index % opts.groups); }
+
+int group_size(int index) {
+    int g = index % opts.groups;
+    return opts.sessions / opts.groups + (g < opts.sessions % opts.groups ? 1 : 0);
+}
+
+void arm(Worker &w, Conn *c, bool write) {
+    struct epoll_event ev = {};
+    ev.events = write ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_write = write;
+}
+
+// I/O counters of the server, read from its metrics endpoint
+struct IoSample {
+    std::string backend = "unknown";
+    double calls[2] = {}; // system calls of the receive and the send path
+    bool ok = false;
+};
+
+// scrapes the server's metrics endpoint, ok is false if it could not be read
+IoSample scrape_io() {
+    IoSample sample;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts.metrics_port);
+    addr.sin_addr.s_addr = inet_addr(opts.host.c_str());
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return sample;
+    }
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    std::string body;
+    if (send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) == (ssize_t)sizeof(request) - 1) {
+        char buffer[16384];
+        ssize_t n;
+        while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            body.append(buffer, n);
+        }
+    }
+    close(fd);
+
+    const char *paths[2] = {"receive", "send"};
+    for (int i = 0; i < 2; i++) {
+        std::string key = std::string("shadow_room_io_calls_total{path=\"") + paths[i] + "\"} ";
+        size_t at = body.find(key);
+        if (at == std::string::npos) {
+            return sample;
+        }
+        sample.calls[i] = strtod(body.c_str() + at + key.size(), nullptr);
+    }
+    std::string key = "shadow_room_io_backend_info{backend=\"";
+    size_t at = body.find(key);
+    if (at != std::string::npos) {
+        at += key.size();
+        sample.backend = body.substr(at, body.find('"', at) - at);
+    }
+    sample.ok = true;
+    return sample;
+}
+
+// keeps the TLS session of a connection for its reconnect
+int save_ticket(SSL *ssl, SSL_SESSION *session) {
+    Conn *c = (Conn *)SSL_get_app_data(ssl);
+    SSL_SESSION_free(c->ticket);
+    c->ticket = session;
+    return 1; // the reference is ours now
+}
+
+// send and recv, through TLS if it is on. 0 from conn_send means TLS waits for input first.
+ssize_t conn_send(Conn *c, const char *data, size_t len) {
+    if (c->ssl == nullptr) {
+        return send(c->fd, data, len, MSG_NOSIGNAL);
+    }
+    int n = SSL_write(c->ssl, data, len);
+    if (n > 0) {
+        return n;
+    }
+    int err = SSL_get_error(c->ssl, n);
+    errno = (err == SSL_ERROR_WANT_WRITE) ? EAGAIN : EPROTO;
+    return (err == SSL_ERROR_WANT_READ) ? 0 : -1;
+}
+
+ssize_t conn_recv(Conn *c, char *buf, size_t len) {
+    if (c->ssl == nullptr) {
+        return recv(c->fd, buf, len, 0);
+    }
+    int n = SSL_read(c->ssl, buf, len);
+    if (n > 0) {
+        return n;
+    }
+    int err = SSL_get_error(c->ssl, n);
+    if (err == SSL_ERROR_ZERO_RETURN) {
+        return 0;
+    }
+    errno = (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? EAGAIN : EPROTO;
+    return -1;
+}
+
+void flush(Worker &w, Conn *c) {
+    while (c->out_off < c->out.size()) {
+        ssize_t n = conn_send(c, c->out.data() + c->out_off, c->out.size() - c->out_off);
+        if (n == 0) {
+            return; // the TLS handshake is waiting for the server, read_conn flushes again
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!c->want_write) {
+                    arm(w, c, true);
+                }
+                return;
+            }
+            c->failed = true;
+            return;
+        }
+        c->out_off += n;
+    }
+    c->out.clear();
+    c->out_off = 0;
+    if (c->want_write) {
+        arm(w, c, false);
+    }
+}
+
+void send_frame(Worker &w, Conn *c, uint8_t opcode, const std::string &payload) {
+    c->out += encode_frame(opcode, payload);
+    if (!c->want_write) {
+        flush(w, c);
+    }
+}
+
+// counts the outcome of a login, of the first round or of the reconnect storm
+void count_login(Conn *c, bool ok) {
+    if (!c->again) {
+        (ok ? logged_in : login_failed)++;
+        return;
+    }
+    (ok ? reconnected : reconnect_failed)++;
+    if (ok && c->ssl != nullptr && SSL_session_reused(c->ssl)) {
+        resumed++;
+    }
+}
+
+void handle_frame(Worker &w, Conn *c, const Frame &frame, uint64_t now) {
+    w.last_frame_ns = now;
+    if (frame.opcode == OP_COMPRESS) {
+        return; // the answer to the compression offer, a session that was declined just gets OP_TEXT
+    }
+    std::string_view payload = frame.payload;
+    if (frame.opcode == OP_DEFLATE) {
+        if (!w.inflater.decompress(payload, w.text)) {
+            c->failed = true;
+            return;
+        }
+        payload = w.text;
+    }
+    if (!c->logged_in) {
+        // the password prompt, then the banner or the failure
+        if (++c->replies == 2) {
+            c->failed = payload.find("Authentication failed") != std::string_view::npos;
+            c->logged_in = !c->failed;
+            count_login(c, c->logged_in);
+        }
+        return;
+    }
+    size_t pos = payload.find(TS_MARKER);
+    if (pos == std::string_view::npos) {
+        return; // join notices, replies to the group setup
+    }
+    uint64_t sent_ns = strtoull(std::string(payload.substr(pos + 2, 20)).c_str(), nullptr, 10);
+    w.hist.add(now > sent_ns ? (now - sent_ns) / 1000 : 0);
+    w.delivered++;
+}
+
+void read_conn(Worker &w, Conn *c) {
+    while (!c->failed) {
+        if (!c->framed) {
+            char buf[4096];
+            ssize_t n = conn_recv(c, buf, sizeof(buf));
+            if (n <= 0) {
+                c->failed = c->failed || n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                return;
+            }
+            c->handshake.append(buf, n);
+            size_t pos = c->handshake.find(FRAME_MAGIC);
+            if (pos == std::string::npos) {
+                continue;
+            }
+            // bytes after the acknowledgement are already frames
+            size_t start = pos + FRAME_MAGIC_LEN;
+            auto [dst, space] = c->parser.buffer().write_space(c->handshake.size() - start);
+            memcpy(dst, c->handshake.data() + start, c->handshake.size() - start);
+            c->parser.buffer().commit(c->handshake.size() - start);
+            c->handshake.clear();
+            c->framed = true;
+        } else {
+            auto [dst, space] = c->parser.buffer().write_space(65536);
+            ssize_t n = conn_recv(c, dst, space);
+            if (n <= 0) {
+                c->failed = c->failed || n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                return;
+            }
+            c->parser.buffer().commit(n);
+            w.bytes_in += c->logged_in ? n : 0;
+        }
+        uint64_t now = now_ns();
+        Frame frame;
+        FrameStatus status;
+        while ((status = c->parser.next(frame)) == FRAME_OK) {
+            handle_frame(w, c, frame, now);
+        }
+        if (status == FRAME_ERROR) {
+            c->failed = true;
+        }
+    }
+}
+
+// services the sockets of a worker for up to timeout_ms
+void poll_once(Worker &w, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(w.epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        Conn *c = (Conn *)events[i].data.ptr;
+        if (events[i].events & EPOLLOUT) {
+            flush(w, c);
+        }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            read_conn(w, c);
+            if (c->ssl != nullptr && !c->want_write && !c->failed) {
+                flush(w, c); // writes that waited for the handshake
+            }
+        }
+        if (c->failed) {
+            epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+            if (!c->logged_in && c->replies < 2) {
+                c->replies = 2; // connection lost during login
+                count_login(c, false);
+            }
+        }
+    }
+}
+
+// connected blocking socket, -1 on failure
+int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts.port);
+    addr.sin_addr.s_addr = inet_addr(opts.host.c_str());
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        static std::atomic<bool> reported{false};
+        if (!reported.exchange(true)) {
+            perror("connect");
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// connects c and starts its login, false if the server cannot be reached
+bool connect_conn(Worker &w, Conn *c) {
+    int fd = connect_server();
+    if (fd < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c->fd = fd;
+    if (tls_ctx != nullptr) {
+        c->ssl = SSL_new(tls_ctx);
+        SSL_set_fd(c->ssl, fd);
+        SSL_set_app_data(c->ssl, c);
+        SSL_set_connect_state(c->ssl);
+        if (c->ticket != nullptr) {
+            SSL_set_session(c->ssl, c->ticket);
+        }
+    }
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+    // negotiate framing and log in with one write
+    c->out = FRAME_MAGIC + (opts.compress ? encode_frame(OP_COMPRESS, COMPRESS_METHOD) : "") +
+             encode_frame(OP_USERNAME, username(c->index)) + encode_frame(OP_PASSWORD, password(c->index));
+    flush(w, c);
+    return true;
+}
+
+Conn *open_conn(Worker &w, int index) {
+    Conn *c = new Conn();
+    c->index = index;
+    if (!connect_conn(w, c)) {
+        delete c;
+        return nullptr;
+    }
+    return c;
+}
+
+// drops the connection of c, which keeps its TLS session
+void close_conn(Worker &w, Conn *c) {
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+    if (c->ssl != nullptr) {
+        SSL_shutdown(c->ssl); // close_notify, OpenSSL marks the session of a connection cut without it as not resumable
+    }
+    SSL_free(c->ssl);
+    c->ssl = nullptr;
+    close(c->fd);
+}
+
+// services the sockets until every thread has arrived, then until nothing arrived for quiet_ms
+void barrier(Worker &w, int generation, int quiet_ms) {
+    barrier_count++;
+    while (barrier_count < generation * opts.threads) {
+        poll_once(w, 1);
+    }
+    w.last_frame_ns = now_ns();
+    while (now_ns() - w.last_frame_ns < (uint64_t)quiet_ms * 1000000) {
+        poll_once(w, 1);
+    }
+}
+
+void send_one(Worker &w) {
+    Conn *c = w.conns[w.rng() % w.conns.size()];
+    if (!c->logged_in || c->failed) {
+        return;
+    }
+    int pick = w.rng() % 100;
+    int kind = 0;
+    while (kind < NUM_KINDS - 1 && pick >= opts.mix[kind]) {
+        pick -= opts.mix[kind];
+        kind++;
+    }
+
+    std::string text = TS_MARKER + std::to_string(now_ns()) + " ";
+    text.resize(std::max(text.size(), opts.payload), 'x');
+    if (kind == KIND_MSG) {
+        int to = w.rng() % opts.sessions;
+        if (to == c->index) {
+            to = (to + 1) % opts.sessions;
+        }
+        send_frame(w, c, OP_MSG, username(to) + " " + text);
+        w.expected += 1;
+    } else if (kind == KIND_GROUP) {
+        send_frame(w, c, OP_GROUP_MSG, group_name(c->index) + " " + text);
+        w.expected += group_size(c->index) - 1;
+    } else {
+        send_frame(w, c, OP_BROADCAST, text);
+        w.expected += logged_in - 1;
+    }
+    w.sent[kind]++;
+}
+
+void run_worker(Worker *wp, int id, uint64_t *run_start, uint64_t *run_end) {
+    Worker &w = *wp;
+    w.rng.seed(id * 7919 + 1);
+
+    // log in this thread's share of the sessions, at most LOGIN_WINDOW at a time
+    int next = id;
+    size_t pending;
+    do {
+        pending = 0;
+        for (Conn *c : w.conns) {
+            pending += !c->logged_in && c->replies < 2;
+        }
+        while (pending < LOGIN_WINDOW && next < opts.sessions) {
+            Conn *c = open_conn(w, next);
+            next += opts.threads;
+            if (c == nullptr) {
+                login_failed++;
+                continue;
+            }
+            w.conns.push_back(c);
+            pending++;
+        }
+        poll_once(w, 1);
+    } while (pending > 0 || next < opts.sessions);
+    int generation = 1;
+    barrier(w, generation++, 200);
+
+    // reconnect storm: every session drops its connection at once and logs in again, as many at a
+    // time as during the first logins
+    if (opts.reconnect) {
+        uint64_t none = 0;
+        storm_start.compare_exchange_strong(none, now_ns());
+        std::vector<Conn *> again;
+        for (Conn *c : w.conns) {
+            if (c->logged_in && !c->failed) {
+                close_conn(w, c);
+                again.push_back(c);
+            }
+        }
+        size_t reopened = 0;
+        do {
+            pending = 0;
+            for (size_t i = 0; i < reopened; i++) {
+                pending += !again[i]->logged_in && again[i]->replies < 2;
+            }
+            while (pending < LOGIN_WINDOW && reopened < again.size()) {
+                Conn *c = again[reopened++];
+                Conn fresh;
+                fresh.index = c->index;
+                fresh.ticket = c->ticket;
+                fresh.again = true;
+                *c = std::move(fresh);
+                if (!connect_conn(w, c)) {
+                    c->replies = 2;
+                    count_login(c, false);
+                    continue;
+                }
+                pending++;
+            }
+            poll_once(w, 1);
+        } while (pending > 0 || reopened < again.size());
+        barrier(w, generation++, 200);
+    }
+
+    // every session creates its group (all but the first attempt fail) and joins it
+    for (Conn *c : w.conns) {
+        if (c->logged_in) {
+            send_frame(w, c, OP_CREATE_GROUP, group_name(c->index));
+            send_frame(w, c, OP_JOIN_GROUP, group_name(c->index));
+        }
+    }
+    barrier(w, generation++, 200);
+
+    // paced load, the thread's share of the rate
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(opts.duration * 1e9);
+    double share = opts.rate / opts.threads;
+    uint64_t issued = 0;
+    for (uint64_t now = start; now < end; now = now_ns()) {
+        uint64_t due = (uint64_t)((now - start) / 1e9 * share);
+        for (; issued < due && !w.conns.empty(); issued++) {
+            send_one(w);
+        }
+        poll_once(w, 1);
+    }
+    if (id == 0) {
+        *run_start = start;
+        *run_end = now_ns();
+    }
+
+    // wait for the deliveries still in flight
+    barrier(w, generation, 500);
+}
+
+void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [-n sessions] [-t threads] [-d seconds] [-m messages per second]"
+              << " [-x msg%,group%,broadcast%] [-g groups] [-b payload bytes] [-u user prefix]"
+              << " [-h host] [-p port] [-T] [-R] [-z] [-M metrics port] [-W]\n"
+              << "  -T connects with TLS\n"
+              << "  -R logs every session out and in again after the logins (a reconnect storm)\n"
+              << "  -z offers compression at login\n"
+              << "  -M reports the server's I/O backend and its system calls during the load\n"
+              << "  -W prints the users.txt lines of the sessions and exits\n";
+}
+
+int main(int argc, char *argv[]) {
+    bool write_users = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:d:m:x:g:b:u:h:p:TRzM:W")) != -1) {
+        switch (opt) {
+        case 'n': opts.sessions = atoi(optarg); break;
+        case 't': opts.threads = atoi(optarg); break;
+        case 'd': opts.duration = atof(optarg); break;
+        case 'm': opts.rate = atof(optarg); break;
+        case 'x':
+            if (sscanf(optarg, "%d,%d,%d", &opts.mix[0], &opts.mix[1], &opts.mix[2]) != 3) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'g': opts.groups = atoi(optarg); break;
+        case 'b': opts.payload = atoi(optarg); break;
+        case 'u': opts.prefix = optarg; break;
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        case 'T': opts.tls = true; break;
+        case 'R': opts.reconnect = true; break;
+        case 'z': opts.compress = true; break;
+        case 'M': opts.metrics_port = atoi(optarg); break;
+        case 'W': write_users = true; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (opts.sessions < 2 || opts.threads < 1 || opts.groups < 1 || opts.duration <= 0 || opts.rate <= 0 ||
+        opts.mix[0] + opts.mix[1] + opts.mix[2] != 100) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (write_users) {
+        for (int i = 0; i < opts.sessions; i++) {
+            std::cout << username(i) << ":" << password(i) << "\n";
+        }
+        return 0;
+    }
+
+    // one descriptor per session
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    if (opts.tls) {
+        // the certificate is not verified, only the cost of the handshakes and records is of interest
+        tls_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(tls_ctx, save_ticket);
+    }
+
+    // fail early when there is no server
+    int probe = connect_server();
+    if (probe < 0) {
+        return 1;
+    }
+    close(probe);
+
+    std::vector<Worker> workers(opts.threads);
+    std::vector<std::thread> threads;
+    uint64_t run_start = 0, run_end = 0;
+    uint64_t login_start = now_ns();
+    for (int i = 0; i < opts.threads; i++) {
+        workers[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        threads.emplace_back(run_worker, &workers[i], i, &run_start, &run_end);
+    }
+    // the login phase is over once every session has its verdict
+    while (logged_in + login_failed < opts.sessions) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double login_s = (now_ns() - login_start) / 1e9;
+    double reconnect_s = 0;
+    if (opts.reconnect) {
+        while (storm_start == 0 || reconnected + reconnect_failed < logged_in) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        reconnect_s = (now_ns() - storm_start) / 1e9;
+    }
+    // the workers pause before the load, the counters are read while the logins are over
+    IoSample io_before = opts.metrics_port > 0 ? scrape_io() : IoSample();
+    for (auto &t : threads) {
+        t.join();
+    }
+    IoSample io_after = io_before.ok ? scrape_io() : IoSample();
+    if (opts.metrics_port > 0 && !io_after.ok) {
+        std::cerr << "Could not read the I/O counters from the metrics endpoint.\n";
+    }
+
+    Histogram hist;
+    uint64_t sent[NUM_KINDS] = {}, expected = 0, delivered = 0, bytes_in = 0;
+    for (auto &w : workers) {
+        hist.merge(w.hist);
+        for (int k = 0; k < NUM_KINDS; k++) {
+            sent[k] += w.sent[k];
+        }
+        expected += w.expected;
+        delivered += w.delivered;
+        bytes_in += w.bytes_in;
+        for (Conn *c : w.conns) {
+            SSL_free(c->ssl);
+            SSL_SESSION_free(c->ticket);
+            close(c->fd);
+            delete c;
+        }
+        close(w.epoll_fd);
+    }
+    double run_s = (run_end - run_start) / 1e9;
+    uint64_t total_sent = sent[0] + sent[1] + sent[2];
+
+    printf("{\n");
+    printf("  \"sessions\": %d,\n  \"logged_in\": %d,\n  \"login_failed\": %d,\n", opts.sessions, logged_in.load(),
+           login_failed.load());
+    printf("  \"tls\": %s,\n  \"compress\": %s,\n", opts.tls ? "true" : "false", opts.compress ? "true" : "false");
+    printf("  \"login_seconds\": %.3f,\n  \"logins_per_second\": %.1f,\n", login_s, logged_in / login_s);
+    if (opts.reconnect) {
+        printf("  \"reconnected\": %d,\n  \"reconnect_failed\": %d,\n  \"resumed\": %d,\n", reconnected.load(),
+               reconnect_failed.load(), resumed.load());
+        printf("  \"reconnect_seconds\": %.3f,\n  \"reconnects_per_second\": %.1f,\n", reconnect_s,
+               reconnected / reconnect_s);
+    }
+    printf("  \"threads\": %d,\n  \"groups\": %d,\n  \"payload_bytes\": %zu,\n", opts.threads, opts.groups, opts.payload);
+    printf("  \"target_rate\": %.1f,\n  \"run_seconds\": %.3f,\n", opts.rate, run_s);
+    printf("  \"sent\": {\"%s\": %llu, \"%s\": %llu, \"%s\": %llu, \"total\": %llu},\n", KIND_NAMES[0],
+           (unsigned long long)sent[0], KIND_NAMES[1], (unsigned long long)sent[1], KIND_NAMES[2],
+           (unsigned long long)sent[2], (unsigned long long)total_sent);
+    printf("  \"sent_per_second\": %.1f,\n", total_sent / run_s);
+    printf("  \"expected_deliveries\": %llu,\n  \"delivered\": %llu,\n", (unsigned long long)expected,
+           (unsigned long long)delivered);
+    printf("  \"deliveries_per_second\": %.1f,\n", delivered / run_s);
+    printf("  \"received_bytes\": %llu,\n  \"received_bytes_per_delivery\": %.1f,\n", (unsigned long long)bytes_in,
+           delivered ? (double)bytes_in / delivered : 0.0);
+    if (io_after.ok) {
+        double receive = io_after.calls[0] - io_before.calls[0], send = io_after.calls[1] - io_before.calls[1];
+        printf("  \"io_backend\": \"%s\",\n", io_after.backend.c_str());
+        printf("  \"io_calls\": {\"receive\": %.0f, \"send\": %.0f, \"per_delivery\": %.3f},\n", receive, send,
+               delivered ? (receive + send) / delivered : 0.0);
+    }
+    printf("  \"latency_us\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}\n",
+           (unsigned long long)hist.percentile(50), (unsigned long long)hist.percentile(99),
+           (unsigned long long)hist.percentile(99.9), (unsigned long long)hist.max);
+    printf("}\n");
+    return 0;
+}
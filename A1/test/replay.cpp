@@ -0,0 +1,392 @@
+// Replays a trace recorded by server_grp -t against a server: every session of the trace logs in
+// again with its password from users.txt, sends its commands at the times they were received and
+// leaves when it left, so a production traffic shape can be driven at a controlled speed.
+//
+// -s scales the time: 1 replays in real time, 10 ten times faster and 0 as fast as the server takes
+// it. The records of one session keep their order, records of different threads of the server are
+// merged by their time. Reports what was sent and how late the schedule ran as JSON on stdout.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../framing.h"
+#include "../trace.h"
+
+#define MAX_EVENTS 256
+#define QUIET_MS 500 // the replay ends once nothing arrived for this long after the last record
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 12345;
+    double speed = 1;                 // -s, 0 replays as fast as possible
+    std::string users = "users.txt";  // -u, username:password lines
+};
+
+Options opts;
+
+struct Record {
+    TraceRecordHeader header;
+    std::string payload;
+};
+
+struct Conn {
+    int fd;
+    bool framed = false;     // the server acknowledged FRAME_MAGIC
+    int replies = 0;         // frames received during login, the second one is the verdict
+    bool logged_in = false;
+    bool failed = false;
+    bool closing = false;    // the session left, closed once its output is written
+    std::string handshake;   // text received before the acknowledgement
+    FrameParser parser;
+    std::string out;         // bytes the socket has not accepted yet
+    size_t out_off = 0;
+    bool want_write = false; // EPOLLOUT is armed
+};
+
+int epoll_fd;
+uint64_t last_frame_ns = 0;
+uint64_t frames = 0;     // frames received after the logins
+int logged_in = 0;
+int login_failed = 0;
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void arm(Conn *c, bool write) {
+    struct epoll_event ev = {};
+    ev.events = write ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_write = write;
+}
+
+void drop_conn(Conn *c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+    close(c->fd);
+    c->fd = -1;
+    c->failed = true;
+}
+
+void flush(Conn *c) {
+    while (c->out_off < c->out.size()) {
+        ssize_t n = send(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!c->want_write) {
+                    arm(c, true);
+                }
+                return;
+            }
+            c->failed = true;
+            return;
+        }
+        c->out_off += n;
+    }
+    c->out.clear();
+    c->out_off = 0;
+    if (c->closing) {
+        drop_conn(c);
+    } else if (c->want_write) {
+        arm(c, false);
+    }
+}
+
+void send_frame(Conn *c, uint8_t opcode, std::string_view payload) {
+    c->out += encode_frame(opcode, payload);
+    if (!c->want_write) {
+        flush(c);
+    }
+}
+
+void handle_frame(Conn *c, const Frame &frame) {
+    last_frame_ns = now_ns();
+    if (c->logged_in) {
+        frames++;
+        return;
+    }
+    // the password prompt, then the banner or the failure
+    if (++c->replies == 2) {
+        c->logged_in = frame.payload.find("Authentication failed") == std::string_view::npos;
+        (c->logged_in ? logged_in : login_failed)++;
+    }
+}
+
+void read_conn(Conn *c) {
+    while (!c->failed) {
+        if (!c->framed) {
+            char buf[4096];
+            ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                c->failed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                return;
+            }
+            c->handshake.append(buf, n);
+            size_t pos = c->handshake.find(FRAME_MAGIC);
+            if (pos == std::string::npos) {
+                continue;
+            }
+            // bytes after the acknowledgement are already frames
+            size_t start = pos + FRAME_MAGIC_LEN;
+            auto [dst, space] = c->parser.buffer().write_space(c->handshake.size() - start);
+            memcpy(dst, c->handshake.data() + start, c->handshake.size() - start);
+            c->parser.buffer().commit(c->handshake.size() - start);
+            c->handshake.clear();
+            c->framed = true;
+        } else {
+            auto [dst, space] = c->parser.buffer().write_space(65536);
+            ssize_t n = recv(c->fd, dst, space, 0);
+            if (n <= 0) {
+                c->failed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+                return;
+            }
+            c->parser.buffer().commit(n);
+        }
+        Frame frame;
+        FrameStatus status;
+        while ((status = c->parser.next(frame)) == FRAME_OK) {
+            handle_frame(c, frame);
+        }
+        if (status == FRAME_ERROR) {
+            c->failed = true;
+        }
+    }
+}
+
+// services the sockets for up to timeout_ms
+void poll_once(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        Conn *c = (Conn *)events[i].data.ptr;
+        if (c->fd >= 0 && (events[i].events & EPOLLOUT)) {
+            flush(c);
+        }
+        if (c->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            read_conn(c);
+        }
+        if (c->fd >= 0 && c->failed) {
+            if (!c->logged_in && c->replies < 2) {
+                c->replies = 2; // connection lost during login
+                login_failed++;
+            }
+            drop_conn(c);
+        }
+    }
+}
+
+// connected blocking socket, -1 on failure
+int connect_server() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts.port);
+    addr.sin_addr.s_addr = inet_addr(opts.host.c_str());
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        static bool reported = false;
+        if (!reported) {
+            reported = true;
+            perror("connect");
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// connects and starts a login with one write, nullptr if the server cannot be reached
+Conn *connect_conn(const std::string &username, const std::string &password) {
+    int fd = connect_server();
+    if (fd < 0) {
+        return nullptr;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Conn *c = new Conn();
+    c->fd = fd;
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+    // the commands that follow are pipelined, the server holds them until the password is verified
+    c->out = FRAME_MAGIC + encode_frame(OP_USERNAME, username) + encode_frame(OP_PASSWORD, password);
+    flush(c);
+    return c;
+}
+
+// the records of a trace file in time order, false if it is not a trace
+bool load_trace(const char *path, std::vector<Record> &records) {
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        perror(path);
+        return false;
+    }
+    if (!read_trace_magic(file)) {
+        std::cerr << path << " is not a trace of server_grp -t.\n";
+        fclose(file);
+        return false;
+    }
+    Record record;
+    while (read_trace_record(file, record.header, record.payload)) {
+        records.push_back(record);
+    }
+    fclose(file);
+    // stable: the records of a session came from one thread and are already in order
+    std::stable_sort(records.begin(), records.end(),
+                     [](const Record &a, const Record &b) { return a.header.time_ns < b.header.time_ns; });
+    return true;
+}
+
+// username -> password of every line of the users file
+std::unordered_map<std::string, std::string> load_passwords() {
+    std::unordered_map<std::string, std::string> passwords;
+    std::ifstream in(opts.users);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t sep = line.find(':');
+        if (sep != std::string::npos) {
+            passwords[line.substr(0, sep)] = line.substr(sep + 1);
+        }
+    }
+    return passwords;
+}
+
+void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [-s speed] [-u users file] [-h host] [-p port] trace_file\n"
+              << "  -s 1 replays in real time (default), 2 twice as fast, 0 as fast as possible\n"
+              << "  -u has the passwords of the traced users (default users.txt)\n";
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:u:h:p:")) != -1) {
+        switch (opt) {
+        case 's': opts.speed = atof(optarg); break;
+        case 'u': opts.users = optarg; break;
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || opts.speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<Record> records;
+    if (!load_trace(argv[optind], records)) {
+        return 1;
+    }
+    auto passwords = load_passwords();
+
+    // fail early when there is no server
+    int probe = connect_server();
+    if (probe < 0) {
+        return 1;
+    }
+    close(probe);
+
+    // one descriptor per session
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    std::unordered_map<uint32_t, Conn *> sessions; // trace session number -> its connection
+    std::vector<Conn *> conns;
+    int started = 0, skipped = 0;
+    uint64_t commands = 0, skipped_commands = 0, max_lag = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < records.size(); i++) {
+        const Record &r = records[i];
+        if (opts.speed > 0) {
+            uint64_t due = start + (uint64_t)(r.header.time_ns / opts.speed);
+            uint64_t now;
+            while ((now = now_ns()) < due) {
+                poll_once(std::max<uint64_t>(1, (due - now) / 1000000) - 1);
+            }
+            max_lag = std::max(max_lag, now - due);
+        } else if (i % 64 == 0) {
+            poll_once(0); // keeps reading, the server stalls on clients that do not
+        }
+
+        auto it = sessions.find(r.header.session);
+        Conn *c = it != sessions.end() ? it->second : nullptr;
+        if (r.header.kind == TRACE_LOGIN) {
+            auto pw = passwords.find(r.payload);
+            if (pw == passwords.end() || (c = connect_conn(r.payload, pw->second)) == nullptr) {
+                skipped++;
+                continue;
+            }
+            sessions[r.header.session] = c;
+            conns.push_back(c);
+            started++;
+        } else if (c == nullptr || c->fd < 0) {
+            skipped_commands += r.header.kind == TRACE_COMMAND;
+        } else if (r.header.kind == TRACE_COMMAND) {
+            if (opcode_action(r.header.opcode) != nullptr) {
+                send_frame(c, r.header.opcode, r.payload);
+            } else {
+                // a line the server did not know as a command, it gets the same answer again
+                send_frame(c, OP_COMMAND, "/unknown" + (r.payload.empty() ? "" : " " + r.payload));
+            }
+            commands++;
+        } else if (r.header.kind == TRACE_LOGOUT) {
+            c->closing = true;
+            if (!c->want_write) {
+                flush(c);
+            }
+        }
+    }
+    uint64_t sent_ns = now_ns() - start;
+
+    // wait for the replies still in flight
+    last_frame_ns = now_ns();
+    while (now_ns() - last_frame_ns < (uint64_t)QUIET_MS * 1000000) {
+        poll_once(1);
+    }
+    for (Conn *c : conns) {
+        if (c->fd >= 0) {
+            close(c->fd);
+        }
+        delete c;
+    }
+    close(epoll_fd);
+
+    double trace_s = records.empty() ? 0 : records.back().header.time_ns / 1e9;
+    double replay_s = sent_ns / 1e9;
+    printf("{\n");
+    printf("  \"records\": %zu,\n  \"speed\": %.2f,\n", records.size(), opts.speed);
+    printf("  \"sessions\": %d,\n  \"logged_in\": %d,\n  \"login_failed\": %d,\n  \"skipped_sessions\": %d,\n",
+           started, logged_in, login_failed, skipped);
+    printf("  \"commands\": %llu,\n  \"skipped_commands\": %llu,\n", (unsigned long long)commands,
+           (unsigned long long)skipped_commands);
+    printf("  \"trace_seconds\": %.3f,\n  \"replay_seconds\": %.3f,\n", trace_s, replay_s);
+    printf("  \"commands_per_second\": %.1f,\n", replay_s > 0 ? commands / replay_s : 0);
+    printf("  \"frames_received\": %llu,\n", (unsigned long long)frames);
+    printf("  \"max_lag_ms\": %.3f\n", max_lag / 1e6);
+    printf("}\n");
+    return 0;
+}
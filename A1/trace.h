@@ -0,0 +1,115 @@
+// Binary trace of the commands server_grp received (server_grp -t), fed back to a server by test/replay.
+//
+//   file:   | TRACE_MAGIC (8 bytes) | record | record | ...
+//   record: | TraceRecordHeader | payload (len bytes) |
+//
+// A session is numbered at its login (TRACE_LOGIN, the username), then every command it sends is one
+// TRACE_COMMAND with the action opcode and its arguments, as handle_action got them. Passwords are never
+// recorded. Integers are in host byte order.
+//
+// Each thread that handles commands appends to a TraceRing of its own, a single producer single consumer
+// byte ring: the producer never waits, a record that does not fit is dropped. The server's trace thread
+// drains every ring into the file, so records of different threads are not in time order in the file.
+// The records of one session are, a session is handled by a single reactor.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#define TRACE_MAGIC "SRTRACE"   // 8 bytes including the terminating NUL
+#define TRACE_RING_SZ (1 << 20) // bytes of one thread's TraceRing, a power of two
+#define TRACE_MAX_RECORD 65536  // larger payloads are cut, a trace is for timing, not for the text
+
+enum TraceKind : uint8_t
+{
+    TRACE_LOGIN = 1, // payload: the username
+    TRACE_COMMAND,   // payload: the arguments of the action opcode
+    TRACE_LOGOUT     // no payload, the session ended
+};
+
+struct TraceRecordHeader
+{
+    uint64_t time_ns; // since the trace was started
+    uint32_t session; // number of the session, from 1 in the order of the logins
+    uint32_t len;     // payload bytes
+    uint8_t kind;     // TraceKind
+    uint8_t opcode;   // action opcode (framing.h) of a TRACE_COMMAND, 0 otherwise
+    uint8_t reserved[6];
+};
+
+static_assert(sizeof(TraceRecordHeader) == 24, "the trace format has 24 byte record headers");
+
+class TraceRing
+{
+public:
+    // appends one record, false if the ring has no room for it. Called by the owning thread only.
+    bool push(const TraceRecordHeader &header, std::string_view payload)
+    {
+        size_t need = sizeof(header) + payload.size();
+        uint64_t at = tail.load(std::memory_order_relaxed);
+        if (need > TRACE_RING_SZ - (at - head.load(std::memory_order_acquire)))
+        {
+            return false;
+        }
+        copy_in(at, (const char *)&header, sizeof(header));
+        copy_in(at + sizeof(header), payload.data(), payload.size());
+        tail.store(at + need, std::memory_order_release); // the consumer sees the whole record or none of it
+        return true;
+    }
+
+    // appends every complete record in the ring to out and frees its space, returns the bytes moved
+    size_t drain(std::string &out)
+    {
+        uint64_t from = head.load(std::memory_order_relaxed);
+        uint64_t to = tail.load(std::memory_order_acquire);
+        for (uint64_t at = from; at < to;)
+        {
+            size_t chunk = std::min<uint64_t>(to - at, TRACE_RING_SZ - (at & (TRACE_RING_SZ - 1)));
+            out.append(data.get() + (at & (TRACE_RING_SZ - 1)), chunk);
+            at += chunk;
+        }
+        head.store(to, std::memory_order_release);
+        return to - from;
+    }
+
+private:
+    void copy_in(uint64_t at, const char *src, size_t n)
+    {
+        size_t offset = at & (TRACE_RING_SZ - 1);
+        size_t first = std::min(n, (size_t)TRACE_RING_SZ - offset); // the rest wraps around to the start
+        memcpy(data.get() + offset, src, first);
+        memcpy(data.get(), src + first, n - first);
+    }
+
+    std::unique_ptr<char[]> data = std::make_unique<char[]>(TRACE_RING_SZ);
+    std::atomic<uint64_t> head{0}; // bytes consumed, advanced by drain()
+    std::atomic<uint64_t> tail{0}; // bytes produced, advanced by push()
+};
+
+// reads the next record of a trace file, false at its end or at a torn record
+inline bool read_trace_record(FILE *file, TraceRecordHeader &header, std::string &payload)
+{
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.len > TRACE_MAX_RECORD)
+    {
+        return false;
+    }
+    payload.resize(header.len);
+    return header.len == 0 || fread(payload.data(), header.len, 1, file) == 1;
+}
+
+// checks the magic at the start of a trace file
+inline bool read_trace_magic(FILE *file)
+{
+    char magic[sizeof(TRACE_MAGIC)];
+    return fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+}
+
+#endif
@@ -0,0 +1,289 @@
+// Minimal io_uring wrapper for server_grp, built on the raw system calls so it needs no liburing.
+//
+// A Uring owns one submission and completion queue pair and, optionally, one ring of provided buffers.
+// It is used by a single thread: SQEs are filled with the prep_* helpers, submit() hands them to the
+// kernel (and waits for completions if asked to) and drain() passes every completion to a callback.
+//
+// Multishot receives pick a buffer from the provided ring themselves, the completion names it with
+// IORING_CQE_F_BUFFER and buffer_id(), and recycle() gives it back once its bytes are copied out.
+
+#ifndef URING_H
+#define URING_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+class Uring
+{
+public:
+    Uring() = default;
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+    ~Uring()
+    {
+        if (bufs != nullptr)
+        {
+            munmap(bufs, bufs_len);
+            delete[] data;
+        }
+        if (sqes != nullptr)
+        {
+            munmap(sqes, sqes_len);
+        }
+        if (cq_ptr != nullptr && cq_ptr != sq_ptr)
+        {
+            munmap(cq_ptr, cq_len);
+        }
+        if (sq_ptr != nullptr)
+        {
+            munmap(sq_ptr, sq_len);
+        }
+        if (ring_fd >= 0)
+        {
+            close(ring_fd);
+        }
+    }
+
+    // creates the queues, false with errno set if the kernel has no io_uring
+    bool init(unsigned entries)
+    {
+        // completions of multishot requests outnumber submissions, the completion queue gets room for them
+        io_uring_params params = {};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = 4 * entries;
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0 && errno == EINVAL)
+        {
+            params = {};
+            params.flags = IORING_SETUP_CQSIZE; // a kernel older than the optional flags
+            params.cq_entries = 4 * entries;
+            ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (ring_fd < 0)
+        {
+            return false;
+        }
+
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        }
+        sq_ptr = map(sq_len, IORING_OFF_SQ_RING);
+        cq_ptr = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ptr : map(cq_len, IORING_OFF_CQ_RING);
+        sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)map(sqes_len, IORING_OFF_SQES);
+        if (sq_ptr == nullptr || cq_ptr == nullptr || sqes == nullptr)
+        {
+            return false;
+        }
+
+        char *sq = (char *)sq_ptr;
+        sq_head = (unsigned *)(sq + params.sq_off.head);
+        sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        unsigned *array = (unsigned *)(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; i++)
+        {
+            array[i] = i; // SQE i always sits in slot i
+        }
+        char *cq = (char *)cq_ptr;
+        cq_head = (unsigned *)(cq + params.cq_off.head);
+        cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        tail = *sq_tail;
+        return true;
+    }
+
+    // registers count buffers of size bytes each as buffer group group, count is a power of two
+    bool setup_buffers(uint16_t group, unsigned count, unsigned size)
+    {
+        bufs_len = count * sizeof(io_uring_buf);
+        void *mem = mmap(nullptr, bufs_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            return false;
+        }
+        bufs = (io_uring_buf_ring *)mem;
+        io_uring_buf_reg reg = {};
+        reg.ring_addr = (uint64_t)bufs;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            int err = errno;
+            munmap(bufs, bufs_len);
+            bufs = nullptr;
+            errno = err;
+            return false;
+        }
+        data = new char[(size_t)count * size];
+        buf_count = count;
+        buf_size = size;
+        buf_group = group;
+        for (unsigned id = 0; id < count; id++)
+        {
+            put_buffer(id, id);
+        }
+        __atomic_store_n(&bufs->tail, (uint16_t)count, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // next free SQE, zeroed, the queue is submitted first if it is full
+    io_uring_sqe *get_sqe()
+    {
+        while (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+        {
+            if (submit(0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                return nullptr;
+            }
+        }
+        io_uring_sqe *sqe = &sqes[tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        tail++;
+        return sqe;
+    }
+
+    // hands the queued SQEs to the kernel and waits until wait_nr completions are there, one system call
+    int submit(unsigned wait_nr)
+    {
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        unsigned pending = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        return syscall(__NR_io_uring_enter, ring_fd, pending, wait_nr, flags, nullptr, 0);
+    }
+
+    // passes every completion waiting to handle, returns how many there were
+    template <typename F>
+    unsigned drain(F &&handle)
+    {
+        unsigned head = *cq_head;
+        unsigned seen = 0;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            head++;
+            seen++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE); // the slot is free once copied
+            handle(cqe);
+        }
+        return seen;
+    }
+
+    bool has_buffers() const { return bufs != nullptr; }
+    uint16_t group() const { return buf_group; }
+    static unsigned buffer_id(const io_uring_cqe &cqe) { return cqe.flags >> IORING_CQE_BUFFER_SHIFT; }
+    const char *buffer(unsigned id) const { return data + (size_t)id * buf_size; }
+
+    // gives a buffer back to the kernel for the next receive
+    void recycle(unsigned id)
+    {
+        uint16_t ring_tail = bufs->tail;
+        put_buffer(ring_tail, id);
+        __atomic_store_n(&bufs->tail, (uint16_t)(ring_tail + 1), __ATOMIC_RELEASE);
+    }
+
+    // accepts every connection of listen_fd until cancelled, the sockets are non-blocking
+    static void prep_multishot_accept(io_uring_sqe *sqe, int listen_fd, uint64_t user_data)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = user_data;
+    }
+
+    // receives into provided buffers of this ring until cancelled or the connection ends
+    void prep_multishot_recv(io_uring_sqe *sqe, int fd, uint64_t user_data) const
+    {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buf_group;
+        sqe->user_data = user_data;
+    }
+
+    // a completion every time fd becomes readable, until cancelled
+    static void prep_multishot_poll(io_uring_sqe *sqe, int fd, uint64_t user_data)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = user_data;
+    }
+
+    // one sendmsg, flags MSG_DONTWAIT make a full socket buffer complete with -EAGAIN
+    static void prep_sendmsg(io_uring_sqe *sqe, int fd, const msghdr *msg, unsigned flags, uint64_t user_data)
+    {
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+        sqe->user_data = user_data;
+    }
+
+    // cancels the request submitted with target, its last completion follows
+    static void prep_cancel(io_uring_sqe *sqe, uint64_t target, uint64_t user_data)
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = user_data;
+    }
+
+private:
+    void *map(size_t len, uint64_t offset)
+    {
+        void *ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    }
+
+    void put_buffer(unsigned slot, unsigned id)
+    {
+        // not bufs->bufs, the header's flexible array wrapper has an empty struct in front of it in C++
+        io_uring_buf &buf = ((io_uring_buf *)bufs)[slot & (buf_count - 1)];
+        buf.addr = (uint64_t)(data + (size_t)id * buf_size);
+        buf.len = buf_size;
+        buf.bid = id;
+    }
+
+    int ring_fd = -1;
+    void *sq_ptr = nullptr; // ring mappings, cq_ptr == sq_ptr with IORING_FEAT_SINGLE_MMAP
+    void *cq_ptr = nullptr;
+    size_t sq_len = 0;
+    size_t cq_len = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_len = 0;
+    unsigned *sq_head = nullptr; // advanced by the kernel
+    unsigned *sq_tail = nullptr; // published by submit()
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned tail = 0;           // SQEs handed out, ahead of *sq_tail until the next submit()
+    unsigned *cq_head = nullptr; // advanced by drain()
+    unsigned *cq_tail = nullptr; // advanced by the kernel
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+    io_uring_buf_ring *bufs = nullptr; // provided buffer ring, nullptr without setup_buffers()
+    size_t bufs_len = 0;
+    char *data = nullptr;              // memory of the provided buffers
+    unsigned buf_count = 0;
+    unsigned buf_size = 0;
+    uint16_t buf_group = 0;
+};
+
+#endif
@@ -5,10 +5,24 @@
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 const int INF = 9999;
+const int UNREACHED = numeric_limits<int>::max(); // engine distances are not capped at INF
 
 void printDVRTable(int node, const vector<vector<int>>& table, const vector<vector<int>>& nextHop) {
     cout << "Node " << node << " Routing Table:\n";
@@ -128,33 +142,482 @@ void simulateLSR(const vector<vector<int>>& graph) {
     }
 }
 
-vector<vector<int>> readGraphFromFile(const string& filename) {
-    ifstream file(filename);
-    if (!file.is_open()) {
+// A file mapped read-only into memory, unmapped when destroyed
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    // maps the whole file, false if it cannot be opened (an empty file maps to no data)
+    bool open(const string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void* mapped = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        data = (const char*)mapped;
+        if (data != nullptr) madvise(mapped, size, MADV_SEQUENTIAL); // text is parsed front to back once
+        return true;
+    }
+
+    void close() {
+        if (data != nullptr) munmap((void*)data, size);
+        data = nullptr;
+        size = 0;
+    }
+};
+
+// Compressed sparse row form of a graph: the links of node u are
+// targets[offsets[u]] .. targets[offsets[u + 1] - 1], with the costs in weights.
+// The arrays point into the stores, or straight into a mapped binary CSR file.
+struct CSRGraph {
+    int n = 0;
+    uint64_t m = 0; // number of links
+    const uint64_t* offsets = nullptr;
+    const int* targets = nullptr;
+    const int* weights = nullptr;
+    vector<uint64_t> offsetStore;
+    vector<int> targetStore;
+    vector<int> weightStore;
+    MappedFile file; // the input while it is parsed, or for good if the arrays are in it
+};
+
+// Binary CSR file: this header, then offsets (n + 1 x uint64), targets (m x int32) and
+// weights (m x int32), in host byte order. Written with -w, used in place without parsing.
+const char CSR_MAGIC[8] = {'R', 'T', 'C', 'S', 'R', '0', '1', '\0'};
+
+struct CSRHeader {
+    char magic[8];
+    uint32_t n;
+    uint32_t reserved;
+    uint64_t m;
+};
+
+enum InputFormat { FORMAT_MATRIX, FORMAT_EDGES, FORMAT_CSR };
+
+void inputError(const string& filename, const string& problem) {
+    cerr << "Error: " << filename << ": " << problem << endl;
+    exit(1);
+}
+
+// The same links as the simulations: 0 and INF mean no direct connection, self-loops are ignored
+bool isLink(long long from, long long to, long long cost) {
+    return from != to && cost != 0 && cost < INF;
+}
+
+// Skips whitespace and '#' comments, false at the end of the input
+bool skipSpace(const char*& p, const char* end) {
+    while (p < end) {
+        if (*p == '#') {
+            while (p < end && *p != '\n') ++p;
+        } else if (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r') {
+            ++p;
+        } else {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses the next integer of a text input in place, much faster than ifstream >>
+int nextInt(const char*& p, const char* end, const string& filename) {
+    if (!skipSpace(p, end)) inputError(filename, "unexpected end of file");
+    bool negative = *p == '-';
+    if (negative || *p == '+') ++p;
+    if (p == end || *p < '0' || *p > '9') inputError(filename, "expected an integer");
+    long long value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+        if (value > numeric_limits<int>::max()) inputError(filename, "integer out of range");
+    }
+    return negative ? -value : value;
+}
+
+// A link cost, the shortest routes are only defined without negative ones
+int nextCost(const char*& p, const char* end, const string& filename) {
+    int cost = nextInt(p, end, filename);
+    if (cost < 0) inputError(filename, "negative link cost");
+    return cost;
+}
+
+void useStores(CSRGraph& g) {
+    g.m = g.targetStore.size();
+    g.offsets = g.offsetStore.data();
+    g.targets = g.targetStore.data();
+    g.weights = g.weightStore.data();
+}
+
+// n, then an n x n matrix of link costs, one row after the other
+void loadMatrix(const char* p, const char* end, CSRGraph& g, const string& filename) {
+    g.n = nextInt(p, end, filename);
+    if (g.n < 0) inputError(filename, "negative number of nodes");
+    g.offsetStore.assign(g.n + 1, 0);
+    for (int i = 0; i < g.n; ++i) {
+        for (int j = 0; j < g.n; ++j) {
+            int cost = nextCost(p, end, filename);
+            if (isLink(i, j, cost)) {
+                g.targetStore.push_back(j);
+                g.weightStore.push_back(cost);
+            }
+        }
+        g.offsetStore[i + 1] = g.targetStore.size();
+    }
+    useStores(g);
+}
+
+// "n m", then m lines "from to cost", each a one-way link. Parsed twice: the first pass counts the
+// links of every node, the second puts each link in its place, so nothing else is held per link.
+void loadEdgeList(const char* p, const char* end, CSRGraph& g, const string& filename) {
+    g.n = nextInt(p, end, filename);
+    int links = nextInt(p, end, filename);
+    if (g.n < 0 || links < 0) inputError(filename, "negative number of nodes or links");
+    g.offsetStore.assign(g.n + 1, 0);
+    const char* body = p;
+    for (int e = 0; e < links; ++e) {
+        int from = nextInt(p, end, filename), to = nextInt(p, end, filename), cost = nextCost(p, end, filename);
+        if (from < 0 || from >= g.n || to < 0 || to >= g.n)
+            inputError(filename, "link " + to_string(e + 1) + " names a node out of range");
+        if (isLink(from, to, cost)) g.offsetStore[from + 1]++;
+    }
+    if (skipSpace(p, end)) inputError(filename, "more links than the " + to_string(links) + " announced");
+    for (int u = 0; u < g.n; ++u) g.offsetStore[u + 1] += g.offsetStore[u];
+
+    g.targetStore.resize(g.offsetStore[g.n]);
+    g.weightStore.resize(g.offsetStore[g.n]);
+    vector<uint64_t> next(g.offsetStore.begin(), g.offsetStore.end() - 1); // next free slot of every node
+    p = body;
+    for (int e = 0; e < links; ++e) {
+        int from = nextInt(p, end, filename), to = nextInt(p, end, filename), cost = nextCost(p, end, filename);
+        if (!isLink(from, to, cost)) continue;
+        g.targetStore[next[from]] = to;
+        g.weightStore[next[from]++] = cost;
+    }
+    useStores(g);
+}
+
+// Uses the arrays of a binary CSR file where they are mapped, after checking them once
+void loadBinaryCSR(CSRGraph& g, const string& filename) {
+    const CSRHeader* header = (const CSRHeader*)g.file.data;
+    size_t arrays = g.file.size - sizeof(CSRHeader);
+    if (header->n >= (uint32_t)numeric_limits<int>::max() || header->m > arrays / 8 ||
+        arrays != (header->n + 1ull) * sizeof(uint64_t) + header->m * 2 * sizeof(int))
+        inputError(filename, "truncated or damaged binary CSR file");
+    g.n = header->n;
+    g.m = header->m;
+    g.offsets = (const uint64_t*)(g.file.data + sizeof(CSRHeader));
+    g.targets = (const int*)(g.offsets + g.n + 1);
+    g.weights = g.targets + g.m;
+
+    // the engine trusts the arrays, so a damaged file is caught here and not by a crash or a hang.
+    // Every entry has to be a link the text formats would have kept, a file holds nothing else.
+    if (g.offsets[0] != 0 || g.offsets[g.n] != g.m) inputError(filename, "offsets do not span the links");
+    for (int u = 0; u < g.n; ++u) {
+        if (g.offsets[u] > g.offsets[u + 1] || g.offsets[u + 1] > g.m) inputError(filename, "offsets are not in order");
+        for (uint64_t e = g.offsets[u]; e < g.offsets[u + 1]; ++e) {
+            if (g.targets[e] < 0 || g.targets[e] >= g.n) inputError(filename, "a link names a node out of range");
+            if (g.weights[e] < 0) inputError(filename, "negative link cost");
+            if (!isLink(u, g.targets[e], g.weights[e])) inputError(filename, "an entry is not a link");
+        }
+    }
+}
+
+// Binary CSR by its magic, else the first line of a text input: "n" starts a matrix, "n m" an edge list
+InputFormat detectFormat(const MappedFile& file, const string& filename) {
+    if (file.size >= sizeof(CSRHeader) && memcmp(file.data, CSR_MAGIC, sizeof(CSR_MAGIC)) == 0)
+        return FORMAT_CSR;
+    const char* p = file.data;
+    const char* end = p + file.size;
+    int numbers = 0;
+    if (skipSpace(p, end)) {
+        while (p < end && *p != '\n' && *p != '#') {
+            if (*p == ' ' || *p == '\t' || *p == '\r') {
+                ++p;
+                continue;
+            }
+            numbers++;
+            while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') ++p;
+        }
+    }
+    if (numbers == 1) return FORMAT_MATRIX;
+    if (numbers == 2) return FORMAT_EDGES;
+    inputError(filename, "not an adjacency matrix, an edge list or a binary CSR file");
+    return FORMAT_MATRIX;
+}
+
+// Loads a graph in any input format, memory grows with its links, not with n * n
+void loadGraph(const string& filename, CSRGraph& g) {
+    if (!g.file.open(filename)) {
         cerr << "Error: Could not open file " << filename << endl;
         exit(1);
     }
-    
-    int n;
-    file >> n;
-    vector<vector<int>> graph(n, vector<int>(n));
+    InputFormat format = detectFormat(g.file, filename);
+    if (format == FORMAT_CSR) {
+        loadBinaryCSR(g, filename);
+        return;
+    }
+    const char* end = g.file.data + g.file.size;
+    if (format == FORMAT_MATRIX)
+        loadMatrix(g.file.data, end, g, filename);
+    else
+        loadEdgeList(g.file.data, end, g, filename);
+    g.file.close(); // the text is not needed once parsed
+}
 
-    for (int i = 0; i < n; ++i)
-        for (int j = 0; j < n; ++j)
-            file >> graph[i][j];
+void writeBinaryCSR(const CSRGraph& g, const string& filename) {
+    CSRHeader header;
+    memcpy(header.magic, CSR_MAGIC, sizeof(CSR_MAGIC));
+    header.n = g.n;
+    header.reserved = 0;
+    header.m = g.m;
+    FILE* out = fopen(filename.c_str(), "wb");
+    if (out == nullptr || fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(g.offsets, sizeof(uint64_t), g.n + 1, out) != (size_t)g.n + 1 ||
+        fwrite(g.targets, sizeof(int), g.m, out) != g.m || fwrite(g.weights, sizeof(int), g.m, out) != g.m ||
+        fclose(out) != 0) {
+        cerr << "Error: Could not write file " << filename << endl;
+        exit(1);
+    }
+}
 
-    file.close();
+// The adjacency matrix of a graph for the simulations, 0 where there is no direct connection
+vector<vector<int>> toMatrix(const CSRGraph& g) {
+    vector<vector<int>> graph(g.n, vector<int>(g.n, 0));
+    for (int u = 0; u < g.n; ++u) {
+        for (uint64_t e = g.offsets[u]; e < g.offsets[u + 1]; ++e) {
+            int& cost = graph[u][g.targets[e]];
+            if (cost == 0 || g.weights[e] < cost) cost = g.weights[e]; // the cheapest of repeated links
+        }
+    }
     return graph;
 }
 
+// All-pairs results of the engine, row src (n entries from src * n) holds the routes of node src
+struct RouteTables {
+    int n = 0;
+    vector<int> cost;    // UNREACHED if there is no path
+    vector<int> nextHop; // -1 for the node itself and for unreachable nodes
+};
+
+// Totals of the routes a worker computed, kept when the tables are not
+struct RouteStats {
+    long long reachable = 0; // pairs with a path, a node and itself not counted
+    long long totalCost = 0;
+    int maxCost = 0;
+};
+
+// Sources not routed yet of one worker, packed as end << 32 | begin, so the owner taking from the
+// front and a thief taking the back half each need a single compare-and-swap
+struct WorkRange {
+    atomic<uint64_t> range{0};
+};
+
+// Dijkstra with a binary heap from src, writing the cost and first hop of every node to dist and hop.
+// Stale heap entries are skipped when popped instead of being decreased in place.
+void dijkstraCSR(const CSRGraph& g, int src, int* dist, int* hop, vector<pair<int, int>>& heap) {
+    fill(dist, dist + g.n, UNREACHED);
+    fill(hop, hop + g.n, -1);
+    dist[src] = 0;
+    heap.clear();
+    heap.push_back(make_pair(0, src));
+    greater<pair<int, int>> later;
+    while (!heap.empty()) {
+        pop_heap(heap.begin(), heap.end(), later);
+        int d = heap.back().first, u = heap.back().second;
+        heap.pop_back();
+        if (d > dist[u]) continue; // u was settled with a smaller cost already
+
+        for (uint64_t e = g.offsets[u]; e < g.offsets[u + 1]; ++e) {
+            int v = g.targets[e];
+            int newDist = d + g.weights[e];
+            if (newDist < dist[v]) {
+                dist[v] = newDist;
+                hop[v] = (u == src) ? v : hop[u]; // the first hop is inherited along the path
+                heap.push_back(make_pair(newDist, v));
+                push_heap(heap.begin(), heap.end(), later);
+            }
+        }
+    }
+}
+
+// Takes the first source of a worker's range, false if it is empty
+bool takeSource(WorkRange& work, int& src) {
+    uint64_t r = work.range.load();
+    while (true) {
+        uint32_t begin = r & 0xffffffffu, end = r >> 32;
+        if (begin >= end) return false;
+        if (work.range.compare_exchange_weak(r, (uint64_t)end << 32 | (begin + 1))) {
+            src = begin;
+            return true;
+        }
+    }
+}
+
+// Moves the back half of victim's range to the empty range of the thief, false if victim has none
+bool stealSources(WorkRange& victim, WorkRange& thief) {
+    uint64_t r = victim.range.load();
+    while (true) {
+        uint32_t begin = r & 0xffffffffu, end = r >> 32;
+        if (begin >= end) return false;
+        uint32_t middle = end - (end - begin + 1) / 2;
+        if (victim.range.compare_exchange_weak(r, (uint64_t)middle << 32 | begin)) {
+            thief.range.store((uint64_t)end << 32 | middle);
+            return true;
+        }
+    }
+}
+
+// Routes sources until no worker has any left, with buffers allocated once per worker
+void routeWorker(const CSRGraph& g, vector<WorkRange>& work, int id, RouteTables* tables, RouteStats& stats) {
+    int workers = work.size();
+    vector<int> dist(tables ? 0 : g.n), hop(tables ? 0 : g.n);
+    vector<pair<int, int>> heap;
+    heap.reserve(g.n + 1); // the heap rarely holds more than one entry per node, it grows if it does
+    while (true) {
+        int src;
+        if (!takeSource(work[id], src)) {
+            bool stolen = false;
+            for (int k = 1; k < workers && !stolen; ++k)
+                stolen = stealSources(work[(id + k) % workers], work[id]);
+            if (!stolen) return; // every range is empty
+            continue;
+        }
+
+        int* d = tables ? &tables->cost[(size_t)src * g.n] : dist.data();
+        int* h = tables ? &tables->nextHop[(size_t)src * g.n] : hop.data();
+        dijkstraCSR(g, src, d, h, heap);
+        for (int v = 0; v < g.n; ++v) {
+            if (v == src || d[v] == UNREACHED) continue;
+            stats.reachable++;
+            stats.totalCost += d[v];
+            stats.maxCost = max(stats.maxCost, d[v]);
+        }
+    }
+}
+
+void printEngineTables(const RouteTables& tables) {
+    // same layout as printLSRTable, built in one buffer since there are n * n lines
+    string out;
+    char line[64];
+    for (int src = 0; src < tables.n; ++src) {
+        out += "Node " + to_string(src) + " Routing Table:\nDest\tCost\tNext Hop\n";
+        for (int i = 0; i < tables.n; ++i) {
+            if (i == src) continue;
+            int cost = tables.cost[(size_t)src * tables.n + i];
+            snprintf(line, sizeof(line), "%d\t%d\t%d\n", i, cost == UNREACHED ? INF : cost,
+                     tables.nextHop[(size_t)src * tables.n + i]);
+            out += line;
+        }
+        out += "\n";
+        if (out.size() > (1 << 20)) {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+}
+
+// Engine mode: shortest paths from every source on a CSR graph, spread over a work-stealing
+// pool of threads. With printTables the routes go into flat n * n tables printed like LSR,
+// otherwise only their totals are kept and memory stays linear in the size of the graph.
+void simulateEngine(const CSRGraph& g, int threads, bool printTables) {
+    threads = max(1, min(threads, max(g.n, 1)));
+    RouteTables tables;
+    if (printTables) {
+        tables.n = g.n;
+        tables.cost.resize((size_t)g.n * g.n);
+        tables.nextHop.resize((size_t)g.n * g.n);
+    }
+
+    // each worker starts with an equal slice of the sources, the ones done early steal from the rest
+    vector<WorkRange> work(threads);
+    for (int t = 0; t < threads; ++t) {
+        uint64_t begin = (uint64_t)g.n * t / threads, end = (uint64_t)g.n * (t + 1) / threads;
+        work[t].range.store(end << 32 | begin);
+    }
+    vector<RouteStats> stats(threads);
+    vector<thread> pool;
+    auto start = chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t)
+        pool.push_back(thread(routeWorker, cref(g), ref(work), t, printTables ? &tables : nullptr, ref(stats[t])));
+    for (thread& worker : pool) worker.join();
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    RouteStats total;
+    for (const RouteStats& s : stats) {
+        total.reachable += s.reachable;
+        total.totalCost += s.totalCost;
+        total.maxCost = max(total.maxCost, s.maxCost);
+    }
+    if (printTables) {
+        cout << "--- Engine Final Tables ---\n" << flush;
+        printEngineTables(tables);
+    }
+    cout << "--- Engine Summary ---\n";
+    cout << "Nodes: " << g.n << "\nLinks: " << g.m << "\nThreads: " << threads << "\n";
+    cout << "Reachable pairs: " << total.reachable << "\n";
+    cout << "Average cost: " << fixed << setprecision(2)
+         << (total.reachable ? (double)total.totalCost / total.reachable : 0.0) << "\n";
+    cout << "Longest route cost: " << total.maxCost << "\n";
+    cout << "Routing time: " << setprecision(1) << ms << " ms\n";
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        cerr << "Usage: " << argv[0] << " <input_file>\n";
+    bool engine = false;
+    bool printTables = true;
+    int threads = max(1u, thread::hardware_concurrency());
+    string filename, csrFile;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-e") {
+            engine = true;
+        } else if (arg == "-q") {
+            printTables = false;
+        } else if (arg == "-t" && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threads = atoi(argv[++i]);
+        } else if (arg == "-w" && i + 1 < argc) {
+            csrFile = argv[++i];
+        } else if (filename.empty() && arg[0] != '-') {
+            filename = arg;
+        } else {
+            filename.clear();
+            break;
+        }
+    }
+    if (filename.empty()) {
+        cerr << "Usage: " << argv[0] << " [-e [-t threads] [-q]] [-w <binary CSR file>] <input_file>\n";
+        cerr << "  -e runs the parallel engine in place of the DVR and LSR simulations\n";
+        cerr << "  -q prints only the engine's summary, not the n * n routing tables\n";
+        cerr << "  -w writes the input as a binary CSR file and exits\n";
+        cerr << "The input is an adjacency matrix, an edge list or a binary CSR file, told apart by its start\n";
         return 1;
     }
 
-    string filename = argv[1];
-    vector<vector<int>> graph = readGraphFromFile(filename);
+    CSRGraph csr;
+    loadGraph(filename, csr);
+
+    if (!csrFile.empty()) {
+        writeBinaryCSR(csr, csrFile);
+        cout << "Wrote " << csr.n << " nodes and " << csr.m << " links to " << csrFile << "\n";
+        return 0;
+    }
+
+    if (engine) {
+        cout << "\n--- Parallel Routing Engine ---\n";
+        simulateEngine(csr, threads, printTables);
+        return 0;
+    }
+
+    vector<vector<int>> graph = toMatrix(csr);
 
     cout << "\n--- Distance Vector Routing Simulation ---\n";
     simulateDVR(graph);